@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Runs parallel work on a parser's uap_executor, or on threads of our own
+// when it has none.
+
+struct uap_executor;
+struct uap_parser;
+
+
+// True if the executor has at least one callback.
+bool executor_present(const struct uap_executor *executor);
+
+
+// Number of tasks worth running at once: the executor's concurrency hint,
+// or the number of online CPUs.
+int executor_concurrency(const struct uap_executor *executor);
+
+
+// Call fn(arg, i) for every i < count using up to `max_tasks` tasks,
+// including the calling thread, and return once every call is done. Without
+// an executor (NULL or no callbacks) the extra tasks are new threads.
+void executor_parallel_for(
+		const struct uap_executor *executor,
+		size_t count,
+		size_t max_tasks,
+		void (*fn)(void *arg, size_t index),
+		void *arg);
+
+
+// The executor given in the parser's options. Defined in user_agent_parser.c.
+const struct uap_executor *ua_parser_executor(const struct uap_parser *ua_parser);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A fixed-size, lock-free set of user agents known to match nothing in one
+// expression group. Entries are a 40 bit hash fingerprint plus the length of
+// the user agent, stored in one of two buckets of four slots, so a lookup
+// reads at most eight words. When both buckets are full a resident
+// entry is overwritten; it's a cache, not a set.
+struct negative_cache_t;
+
+
+// Allocate a cache holding at least `entries` user agents.
+struct negative_cache_t *negative_cache_create(size_t entries);
+
+
+// Destroy and free a negative_cache_t instance.
+void negative_cache_destroy(struct negative_cache_t *);
+
+
+// Forget every entry and reset the counters.
+void negative_cache_clear(struct negative_cache_t *);
+
+
+// Check whether the user agent with the given hash (simd_hash64()) and length
+// is recorded.
+// `count` updates the lookup and hit counters.
+bool negative_cache_contains(struct negative_cache_t *, uint64_t hash, size_t length, bool count);
+
+
+// Record a user agent which matched nothing. `count` updates the insert
+// counter.
+void negative_cache_insert(struct negative_cache_t *, uint64_t hash, size_t length, bool count);
+
+
+// Number of entries the cache can hold.
+size_t negative_cache_capacity(const struct negative_cache_t *);
+
+
+// Read the counters and the memory used by the cache.
+void negative_cache_stats(const struct negative_cache_t *, uint64_t *lookups, uint64_t *hits, uint64_t *inserts, size_t *bytes);
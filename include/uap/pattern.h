@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Rewrites of regexes.yaml expressions into faster equivalents.
+
+
+// Whether the expression is plain ASCII, so it can be compiled without UTF-8.
+bool pattern_ascii(const char *pattern);
+
+
+// Rewrites a caseless expression into one which matches the same strings once
+// they've been lowercased: ASCII letters become lowercase while escapes keep
+// their meaning. `out` needs room for the pattern. Returns false if the
+// expression uses anything the rewrite can't preserve exactly (non-ASCII
+// literals, inline options, named groups, character codes, POSIX classes,
+// ranges spanning letters of both cases...)
+bool pattern_lowercase(char *out, const char *pattern);
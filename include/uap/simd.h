@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// String scanning kernels. Each has a scalar version plus SSE4.2, AVX2 and
+// AVX-512 (BW) versions on x86-64, picked on first use from what the CPU
+// supports. Setting UAP_SIMD=scalar|sse4.2|avx2|avx512 in the environment
+// caps the level, e.g. for comparing results. Every version returns the same
+// results.
+
+
+// A set of bytes to search for, built once by simd_byteset_init().
+struct simd_byteset {
+	uint8_t low_nibbles[16];  // bit h of entry l: byte 0xhl (h < 8) is in the set
+	uint8_t high_nibbles[16]; // 1 << h for h < 8
+	uint64_t bits[4];         // the whole set, for the scalar kernels
+	bool ascii;               // vector kernels only handle ASCII sets
+};
+
+
+// Name of the kernels in use: "scalar", "sse4.2", "avx2" or "avx512".
+const char *simd_level_name();
+
+
+// Number of levels the CPU supports, UAP_SIMD aside. Level 0 is scalar.
+int simd_level_count();
+
+
+// Switch to the kernels of `level`, for comparing levels in tests. Levels
+// the CPU doesn't support are ignored. Returns the level in use before.
+int simd_set_level(int level);
+
+
+// Check whether `length` bytes of `str` are all ASCII.
+bool simd_is_ascii(const char *str, size_t length);
+
+
+// Copy `length` bytes of `src` to `dst` (plus a null terminator) with ASCII
+// letters lowercased. Returns false if `src` isn't pure ASCII, in which case
+// `dst` is incomplete.
+bool simd_ascii_lowercase(char *dst, const char *src, size_t length);
+
+
+// Find the first occurrence of `needle` in `haystack`, or NULL.
+const char *simd_memmem(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length);
+
+
+// As simd_memmem(), ignoring the case of ASCII letters.
+const char *simd_memmem_caseless(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length);
+
+
+// Prepare a set of the bytes in the null terminated string `bytes`.
+void simd_byteset_init(struct simd_byteset *set, const char *bytes);
+
+
+// Index of the first byte of `str` which is in `set`, or `length` if none is.
+size_t simd_find_byteset(const char *str, size_t length, const struct simd_byteset *set);
+
+
+// Index of the first byte of `str` which isn't in `set`, or `length`.
+size_t simd_span_byteset(const char *str, size_t length, const struct simd_byteset *set);
+
+
+// Set bit b of bits[b / 64] for every byte value b present in `str`.
+void simd_byte_presence(const char *str, size_t length, uint64_t bits[4]);
+
+
+// Strip bytes in `set` from both ends of `str`. Returns the remaining length
+// and stores its offset in `start`.
+size_t simd_trim(const char *str, size_t length, const struct simd_byteset *set, size_t *start);
+
+
+// 64-bit XXH64 hash. The result never depends on the kernels in use, so it's
+// safe to persist.
+uint64_t simd_hash64(const char *str, size_t length, uint64_t seed);
@@ -1,6 +1,16 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 
+
+// Number of string fields in a uap_useragent_info, in declaration order:
+// user_agent (4), os (5), device (3).
+#define UAP_NUM_FIELDS 12
+
+
+// The strings live in one buffer owned by the struct, which grows as needed
+// and is reused from parse to parse; see uap_useragent_info_shrink().
 struct uap_useragent_info {
     struct {
         const char *family;
@@ -24,21 +34,93 @@ struct uap_useragent_info {
     } device;
 
     const char *strings;
+    size_t strings_used;              // bytes of `strings` holding the fields
+    size_t strings_capacity;          // bytes allocated for `strings`
+    size_t length[UAP_NUM_FIELDS];    // of each field, in declaration order
 };
 
 
 struct uap_parser;
 
 
+// Load-time optimizations, none of which change parse results.
+// Merge runs of adjacent expressions with identical replacements into a
+// single expression, trading per-expression overhead for larger expressions.
+#define UAP_PARSER_MERGE_RULES (1 << 0)
+// Also compile a byte-mode (non-UTF-8) variant of every ASCII-only
+// expression, used for pure ASCII user agents.
+#define UAP_PARSER_ASCII_RULES (1 << 1)
+// Compile expressions with PCRE auto-callouts so uap_parser_parse_string_cost()
+// can count match steps. Makes every parse much slower; meant for fuzzing and
+// profiling. Installs a process-wide pcre_callout.
+#define UAP_PARSER_COUNT_STEPS (1 << 2)
+
+
+// Lets parallel work (batch parsing, compiling expressions on load) run on
+// the host application's scheduler instead of threads the library starts.
+// Give parallel_for, submit or both; parallel_for is preferred when set.
+struct uap_executor {
+    // Call fn(arg, i) for every i < count, spread over the pool, and return
+    // once all calls are done.
+    void (*parallel_for)(void *context, size_t count, void (*fn)(void *arg, size_t index), void *arg);
+
+    // Run fn(arg) soon, on any thread. Return 0 if the task can't be
+    // queued. The library never blocks waiting for a task to start; if none
+    // gets a turn the submitting thread does all the work itself.
+    int (*submit)(void *context, void (*fn)(void *arg), void *arg);
+
+    // How many tasks are worth running at once, 0 if unknown.
+    int concurrency;
+
+    void *context; // passed to the callbacks
+};
+
+
+struct uap_parser_options {
+    unsigned int flags;            // UAP_PARSER_* flags
+
+    // Remember up to this many user agents per group (user agent, OS,
+    // device) which matched none of the group's expressions, so repeats skip
+    // straight to "Other". Costs 8 bytes per entry; 0 disables the cache.
+    // Entries are hash fingerprints plus lengths, so a distinct user agent
+    // is wrongly taken for a cached one with a probability around 2^-37.
+    size_t negative_cache_entries;
+
+    // Cap, in bytes, on the memory held by the parser: expressions and their
+    // variants, JIT code, caches and interned strings. Whenever loading
+    // leaves the parser over budget, optional memory is shed as described
+    // at uap_parser_set_memory_budget(). 0 means no limit.
+    size_t memory_budget;
+
+    // Where to run parallel work. Without one, batch parsing starts its own
+    // threads and loading stays on the calling thread.
+    struct uap_executor executor;
+
+    // Track the user agents parsed, for uap_parser_workload_stats(): reuse
+    // distances of 1 in `workload_sampling` distinct user agents, chosen by
+    // hash, and distinct user agents per window of `workload_window_seconds`
+    // (0 for 60). Takes about 1.2MB; 0 disables tracking. 100 suits most
+    // traffic, lower rates give finer curves for small caches.
+    unsigned int workload_sampling;
+    unsigned int workload_window_seconds;
+};
+
+
 // Allocate and initialize a new user_agent_parser.
 struct uap_parser * uap_parser_create();
 
 
-// Ingest a "regexes.yaml" from the uap-parser/uap-core project.
+// Allocate and initialize a new user_agent_parser with the given options.
+// Passing NULL is the same as calling uap_parser_create().
+struct uap_parser * uap_parser_create_with_options(const struct uap_parser_options *options);
+
+
+// Ingest a "regexes.yaml" from the uap-parser/uap-core project. Returns 0 if
+// it isn't valid YAML, keeping the rules read before the error.
 int uap_parser_read_file(struct uap_parser *ua_parser, FILE *fd);
 
 
-// Ingest a "regexes.yaml" from an in-memory buffer.
+// Ingest a "regexes.yaml" from an in-memory buffer, as uap_parser_read_file().
 int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *buffer, const size_t bufsize);
 
 
@@ -46,6 +128,97 @@ int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *bu
 void uap_parser_destroy(struct uap_parser *ua_parser);
 
 
+// Count how often each expression is tried and produces a match. Counting
+// is off by default since it adds atomic increments to every parse.
+void uap_parser_collect_rule_stats(struct uap_parser *ua_parser, int enable);
+
+
+// Re-freeze the loaded expressions so frequently matched ones are tried first,
+// using the counts gathered by uap_parser_collect_rule_stats(). Expressions
+// which could match the same input never swap places, so results are
+// unchanged. Must not be called while other threads are parsing.
+// Returns the number of expressions moved, or -1 on failure.
+int uap_parser_reorder_rules(struct uap_parser *ua_parser);
+
+
+// Write the counts gathered by uap_parser_collect_rule_stats() as a binary
+// rule profile, keyed by a fingerprint of each expression so it still
+// applies after regexes.yaml changes. Expressions merged by
+// UAP_PARSER_MERGE_RULES are written one by one, so the profile suits
+// parsers with or without merging. Returns 1 on success, 0 on failure or
+// if the parser has neither collected counts nor loaded a profile, as the
+// profile would show every expression as never tried.
+int uap_parser_write_profile(const struct uap_parser *ua_parser, FILE *fd);
+
+
+// Seed a parser with a profile from uap_parser_write_profile(), so a new
+// process starts where the last one left off:
+//  - expressions are reordered by the profile's hit counts (see
+//    uap_parser_reorder_rules())
+//  - expressions tried by at least 1% of the parses reaching their group
+//    are JIT compiled up front
+//  - loaded before uap_parser_read_file(), expressions the profile shows were
+//    never tried aren't compiled until they're first needed
+// Expressions the profile doesn't know are left alone, and results never
+// change. Must not be called while other threads are parsing. Returns the
+// number of loaded expressions the profile covered (0 when loaded before the
+// expressions), or -1 if the file isn't a valid profile.
+int uap_parser_load_profile(struct uap_parser *ua_parser, FILE *fd);
+
+
+// Get a freshly loaded parser up to speed before it takes traffic: compile
+// the expressions a profile deferred, then parse `count` user agents from
+// `corpus` (or a built-in set of common ones if `corpus` is NULL), faulting
+// in and caching the memory parsing touches. Gives up once `budget_ms`
+// milliseconds have passed, 0 for no limit. The warm-up parses count towards
+// rule stats and workload tracking like any others. Safe to call while other
+// threads parse, unless the parser has a memory budget: then it ends by
+// shedding whatever the deferred expressions took it over by, as
+// uap_parser_set_memory_budget() does. Returns 1 if it finished, 0 if it ran
+// out of time.
+int uap_parser_warmup(
+        struct uap_parser *ua_parser,
+        const char *const *corpus,
+        size_t count,
+        unsigned int budget_ms);
+
+
+// Pick how each expression is run by timing the ways which give the same
+// results on `count` user agents from `corpus`, e.g. a sample of traffic:
+//  - PCRE's interpreter
+//  - PCRE JIT code, which must be clearly faster as it costs memory
+//  - PCRE's DFA matcher, for expressions whose captures aren't used
+//  - a substring search, for expressions of plain text (used on ASCII user
+//    agents)
+// Each expression is timed on the user agents earlier ones don't match, so
+// ones the corpus never reaches stay with the interpreter. Results never
+// change. Expressions are timed exactly as parsing runs them: on ASCII user
+// agents, through their lowercase or byte-mode variant when they have one.
+// Writes a line per expression with the choice, the variant ASCII user
+// agents ran and each way's nanoseconds to `report` unless it's NULL. Does nothing for parsers made
+// with UAP_PARSER_COUNT_STEPS. Must not be called while other threads are
+// parsing. Returns the number of expressions which changed, or -1 on failure.
+int uap_parser_autotune(struct uap_parser *ua_parser, const char *const *corpus, size_t count, FILE *report);
+
+
+// Ways of running an expression, for uap_parser_autotune_force()
+#define UAP_STRATEGY_INTERPRETER 0
+#define UAP_STRATEGY_JIT         1
+#define UAP_STRATEGY_DFA         2
+#define UAP_STRATEGY_LITERAL     3
+
+// As uap_parser_autotune(), but instead of timing the candidates switches
+// every expression able to use `strategy` to it, still checking against the
+// corpus that results don't change. Lets tests cover every way expressions
+// are run. Returns the number of expressions which changed, or -1 on failure.
+int uap_parser_autotune_force(struct uap_parser *ua_parser, const char *const *corpus, size_t count, int strategy);
+
+
+// Write the loaded expressions, in their current order, as a "regexes.yaml".
+// Native rules are left out. Returns 1 on success, 0 on failure.
+int uap_parser_write_yaml(const struct uap_parser *ua_parser, FILE *fd);
+
+
 // Parse a user agent string into the provided user_agent_info structure.
 // The user_agent_info instance can be reused for different user agent strings.
 // Returns the number of matched groups (user agent, os, device)
@@ -55,6 +228,372 @@ int uap_parser_parse_string(
         const char *user_agent_string);
 
 
+// As uap_parser_parse_string(), for a user agent string of `length` bytes
+// which doesn't need to be null terminated.
+int uap_parser_parse_string_length(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const char *user_agent_string,
+        size_t length);
+
+
+struct uap_parse_cost {
+    unsigned int rules_tried; // expressions run, across all groups
+    uint64_t match_steps;     // PCRE match steps, needs UAP_PARSER_COUNT_STEPS
+};
+
+
+// As uap_parser_parse_string_length(), also measuring how much work the
+// parse took.
+int uap_parser_parse_string_cost(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const char *user_agent_string,
+        size_t length,
+        struct uap_parse_cost *cost);
+
+
+// Capture spans reported per group, the whole match included
+#define UAP_MAX_CAPTURE_SPANS 16
+
+// Where one group's result came from. Spans are byte offsets into the user
+// agent, {-1, -1} for captures which took no part in the match.
+struct uap_match_provenance {
+    int matched;                  // the fields below describe the rule which matched
+    unsigned int rule_index;      // the expression's position within its group in regexes.yaml,
+                                  // or the position a native rule was added at
+    uint64_t fingerprint;         // the rule's fingerprint in rule profiles, 0 for native rules
+    unsigned int rules_tried;     // rules run in this group, a matching one included
+    int num_spans;                // 0 for native rules, 1 (the whole match) for expressions run as DFAs
+    struct {
+        int start;
+        int end;
+    } span[UAP_MAX_CAPTURE_SPANS]; // the whole match, then captures 1, 2...
+};
+
+struct uap_provenance {
+    struct uap_match_provenance user_agent;
+    struct uap_match_provenance os;
+    struct uap_match_provenance device;
+};
+
+
+// As uap_parser_parse_string_length(), also reporting which rule produced
+// each group's result, how many rules were tried and the rule's capture
+// spans, from which callers can take further tokens without running
+// expressions of their own. Rules folded together by UAP_PARSER_MERGE_RULES
+// are reported as the original rule which matched.
+int uap_parser_parse_string_provenance(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const char *user_agent_string,
+        size_t length,
+        struct uap_provenance *provenance);
+
+
+// Parse results in a fixed-size block with no pointers, which can be kept
+// on the stack, copied with memcpy() or handed to another process through
+// shared memory. Fields are in uap_useragent_info order (see UAP_NUM_FIELDS):
+// field i is the null terminated string at data + offset[i], length[i] bytes
+// long. Fields are filled in order; any which don't fit in `data` are left
+// empty and `overflow` is set. Unlike uap_useragent_info, the result is
+// written even when no group matched, with "Other" for each family.
+struct uap_inline_info {
+    uint16_t offset[UAP_NUM_FIELDS];
+    uint16_t length[UAP_NUM_FIELDS];
+    uint8_t matched;   // matched groups, as returned by the parse
+    uint8_t overflow;  // some fields were left empty for lack of room
+    uint16_t used;     // bytes of data in use
+    char data[460];    // brings the struct to 512 bytes
+};
+
+
+// As uap_parser_parse_string_length(), writing into a uap_inline_info.
+// Allocates nothing beyond what the parse itself needs.
+int uap_parser_parse_inline(
+        const struct uap_parser *ua_parser,
+        struct uap_inline_info *ua_info,
+        const char *user_agent_string,
+        size_t length);
+
+
+struct iovec; // <sys/uio.h>
+
+
+// As uap_parser_parse_string_length(), for a user agent split across
+// `iovcnt` buffers, such as a header straddling two receive buffers. A user
+// agent in a single buffer (ignoring empty ones) is parsed in place; a split
+// one is copied together, on the stack if it's short or else into a buffer
+// the parser keeps a few of for reuse (reported as `scratch` memory, and
+// freed by uap_parser_destroy()). Returns -1 if that buffer can't be
+// allocated.
+int uap_parser_parse_iov(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const struct iovec *iov,
+        int iovcnt);
+
+
+// The last parse of one client connection. Keep one next to each keep-alive
+// or HTTP/2 connection's state, whose requests nearly always repeat the same
+// user agent. Only one thread may use a memo at a time.
+struct uap_parse_memo {
+    struct uap_useragent_info info;   // result of the last parse
+    int matched;                      // its matched groups
+    uint64_t generation;              // of the parser which produced it, 0 if none
+    char *user_agent;                 // copy of the last user agent
+    size_t length;
+    size_t capacity;
+};
+
+
+// Prepare a memo. Results are never reused across parsers, even one created
+// at the address of a destroyed one.
+void uap_parse_memo_init(struct uap_parse_memo *memo);
+
+
+// Free what the memo holds, including the strings in memo->info.
+void uap_parse_memo_cleanup(struct uap_parse_memo *memo);
+
+
+// As uap_parser_parse_string_length(), with the result left in memo->info
+// until the next call. If the user agent is the same as last time (a length
+// check and memcmp, no hashing or shared state), the previous result is
+// returned without parsing.
+int uap_parser_parse_memo(
+        const struct uap_parser *ua_parser,
+        struct uap_parse_memo *memo,
+        const char *user_agent_string,
+        size_t length);
+
+
+// User agent tokens, as split by uap_tokenize():
+//  - a product is a run of bytes up to a space, tab or parenthesis, such as
+//    "Chrome/120.0.0.0" or "Mobile", split at its first '/' into a name and
+//    a version
+//  - a comment is the text between a pair of parentheses, such as
+//    "Windows NT 10.0; Win64; x64", including any nested parentheses
+#define UAP_TOKEN_PRODUCT 0
+#define UAP_TOKEN_COMMENT 1
+
+struct uap_token {
+    uint32_t type;           // UAP_TOKEN_*
+    uint32_t start;          // offset into the user agent
+    uint32_t length;
+    uint32_t name_length;    // product name, from `start`; the whole comment
+    uint32_t version_start;  // product version after the '/'
+    uint32_t version_length; // 0 if there's no version
+};
+
+
+// Split `length` bytes of a user agent into product and comment tokens in a
+// single pass, without running any expressions. Stores up to `max_tokens`
+// of them and returns how many there are in all, so a larger array can be
+// passed again if that's more than `max_tokens`. Only the first 4GB of the
+// user agent is tokenized.
+size_t uap_tokenize(const char *user_agent, size_t length, struct uap_token *tokens, size_t max_tokens);
+
+
+// The first product token named exactly `name`, e.g. "MyApp" to read the
+// version of "MyApp/2.3.1", or NULL if there's none.
+const struct uap_token *uap_token_find_product(
+        const char *user_agent,
+        const struct uap_token *tokens,
+        size_t count,
+        const char *name);
+
+
+// Rule groups, in the order regexes.yaml lists them and parsing runs them.
+#define UAP_GROUP_USER_AGENT 0
+#define UAP_GROUP_OS         1
+#define UAP_GROUP_DEVICE     2
+
+#define UAP_RULE_MAX_TOKENS 32
+
+// The user agent as handed to native rules, shared by every rule of a parse.
+struct uap_rule_subject {
+    const char *user_agent;  // not null terminated
+    size_t length;
+    const char *lowercase;   // ASCII-lowercased copy, or NULL if not prepared
+    int ascii;               // 1 if known to be pure ASCII
+
+    // Filled in by uap_rule_subject_tokens()
+    int tokenized;
+    size_t token_count;
+    struct uap_token tokens[UAP_RULE_MAX_TOKENS];
+};
+
+
+// What a native rule found, in uap_useragent_info order for its group:
+// user agent family, major, minor, patch; OS family, major, minor, patch,
+// patchMinor; device family, brand, model. Values are copied, so they may
+// point into the user agent. A NULL family gives "Other", any other NULL
+// field an empty string.
+struct uap_rule_fields {
+    const char *value[5];
+    size_t length[5];
+};
+
+
+// Add a C callback to one of the rule groups, tried in turn with the group's
+// expressions. It sits just before the expression at `position` in the
+// group's section of regexes.yaml, so 0 puts it first and anything past the
+// end puts it last; rules added at the same position run in the order
+// they're added. `fn` returns 1 if it matched, after filling in `fields`, or
+// 0 to move on to the next rule. It's called from every parsing thread, and
+// must only depend on the user agent. Native rules never move relative to
+// anything else when the parser reorders or merges its expressions.
+// Must be called before uap_parser_read_file(). Returns 1 on success, 0 if
+// the group is unknown or the expressions are already loaded.
+int uap_parser_add_rule(
+        struct uap_parser *ua_parser,
+        int group,
+        unsigned int position,
+        int (*fn)(void *context, struct uap_rule_subject *subject, struct uap_rule_fields *fields),
+        void *context);
+
+
+// The subject's tokens (see uap_tokenize()), split on the first call and
+// then shared by the parse's other native rules. Returns how many there are,
+// at most UAP_RULE_MAX_TOKENS.
+size_t uap_rule_subject_tokens(struct uap_rule_subject *subject, const struct uap_token **tokens);
+
+
+// A column of strings in Apache Arrow's layout: value i is the bytes
+// data[offsets[i]] up to data[offsets[i + 1]].
+struct uap_string_column {
+    size_t length;            // number of values
+    const int32_t *offsets;   // length + 1 entries
+    const char *data;
+    const uint8_t *validity;  // Arrow validity bitmap, or NULL if all values are valid
+};
+
+
+// Parse results for a whole column, one Arrow-layout string column per
+// uap_useragent_info field. User agents which match nothing get "Other" for
+// each family and empty strings elsewhere. Null inputs give null outputs.
+struct uap_result_columns {
+    size_t length;
+    int32_t *offsets[UAP_NUM_FIELDS]; // length + 1 entries each
+    char *data[UAP_NUM_FIELDS];
+    uint8_t *validity;                // shared by all fields, NULL if all valid
+};
+
+
+// Parse every value of `input` into `output`, spread across `num_threads`
+// tasks (0 uses the executor's concurrency, or one per online CPU). Runs on
+// the parser's executor if it has one. The caller owns the arrays in
+// `output` afterwards and may take them individually, or release them all
+// with uap_result_columns_cleanup(). Returns 1 on success, 0 on failure.
+int uap_parser_parse_batch(
+        const struct uap_parser *ua_parser,
+        const struct uap_string_column *input,
+        struct uap_result_columns *output,
+        int num_threads);
+
+
+// Free any arrays still attached to `columns`.
+void uap_result_columns_cleanup(struct uap_result_columns *columns);
+
+
+// A dictionary-encoded column in Arrow's layout: row i is the dictionary's
+// value indices[i].
+struct uap_dictionary_column {
+    size_t length;                       // number of rows
+    const int32_t *indices;              // length entries
+    const uint8_t *validity;             // of the rows, or NULL if all valid
+    struct uap_string_column dictionary;
+};
+
+
+// Parse a dictionary-encoded column by parsing each dictionary value once,
+// as uap_parser_parse_batch() does. `output` gets one entry per dictionary
+// value, so each field becomes a dictionary-encoded column with the input's
+// indices and validity. Values no valid row refers to aren't parsed and come
+// back null, as do null values. Returns 1 on success, 0 on failure,
+// including an index outside the dictionary.
+int uap_parser_parse_dictionary(
+        const struct uap_parser *ua_parser,
+        const struct uap_dictionary_column *input,
+        struct uap_result_columns *output,
+        int num_threads);
+
+
+struct uap_negative_cache_stats {
+    uint64_t lookups;   // parses which consulted the cache
+    uint64_t hits;      // parses which skipped the group's expressions
+    uint64_t inserts;   // user agents recorded as matching nothing
+    size_t bytes;       // memory held by the cache
+};
+
+
+// Fill in stats[0..2] for the user agent, OS and device fall-through caches.
+// Lookups, hits and inserts are only counted while
+// uap_parser_collect_rule_stats() is enabled. Returns 0 if the parser was
+// created without negative_cache_entries.
+int uap_parser_negative_cache_stats(const struct uap_parser *ua_parser, struct uap_negative_cache_stats stats[3]);
+
+
+// Cache sizes on the miss-ratio curve: 1, 2, 4 ... 2^24 entries
+#define UAP_MISS_RATIO_POINTS 25
+
+struct uap_workload_stats {
+    uint64_t parses;          // user agents parsed
+    uint64_t sampled;         // parses in the reuse distance sample
+
+    // Share of parses an LRU cache of 2^i user agents would miss, from the
+    // sample. User agents not seen again within about 16k sampled distinct
+    // user agents count as misses at every size.
+    double miss_ratio[UAP_MISS_RATIO_POINTS];
+
+    uint64_t distinct;        // estimated distinct user agents, window in progress
+    uint64_t distinct_last;   // the same for the last complete window, 0 before one
+    double window_elapsed;    // seconds since the window in progress began
+};
+
+
+// Read what the parser has measured of its traffic. Safe while other threads
+// parse; it records their queued samples and ends the window if it's over.
+// Returns 0 if the parser was created without workload_sampling.
+int uap_parser_workload_stats(struct uap_parser *ua_parser, struct uap_workload_stats *stats);
+
+
+struct uap_memory_usage {
+    size_t rules;     // compiled expressions, study data and replacements
+    size_t variants;  // lowercase and byte-mode variants of expressions
+    size_t jit;       // JIT compiled code
+    size_t caches;    // negative caches
+    size_t workload;  // workload tracking, which is never shed
+    size_t strings;   // interned expressions and replacement strings
+    size_t scratch;   // spare buffers for joining split user agents
+    size_t total;
+    size_t budget;    // 0 if there's no limit
+};
+
+
+// Measure the memory held by the parser. Returns 1 if it's within budget.
+int uap_parser_memory_usage(const struct uap_parser *ua_parser, struct uap_memory_usage *usage);
+
+
+// Change the memory budget (0 for none), then shed optional memory until the
+// parser fits, in this order:
+//  1. free the spare buffers uap_parser_parse_iov() keeps
+//  2. halve the negative caches, largest first, until they're gone
+//  3. drop JIT code, least hit expressions first
+//  4. drop lowercase and byte-mode variants, least hit expressions first
+// Hit counts come from uap_parser_collect_rule_stats(); without them the
+// expressions furthest down each group go first. Expressions, strings and
+// workload tracking are never shed, and nothing shed is rebuilt if the budget
+// grows again. Results don't change, only speed. Must not run concurrently
+// with parsing. Returns 1 if the parser fits the budget.
+//
+// Expressions a profile deferred are compiled on first use, after the
+// budget was applied. Parsing sheds only the spare buffers to make room for
+// them, as it can't free what other threads may be using; the rest waits
+// for uap_parser_warmup() or the next call to this.
+int uap_parser_set_memory_budget(struct uap_parser *ua_parser, size_t budget);
+
+
 // Create a new structure for holding parsed user-agent results.
 struct uap_useragent_info * uap_useragent_info_create();
 
@@ -74,3 +613,8 @@ void uap_useragent_info_init(struct uap_useragent_info *);
 // data associated with the instance. It's then your responsibility
 // to free the user_agent_info instance.
 void uap_useragent_info_cleanup(struct uap_useragent_info *);
+
+// Parses keep the string buffer at its largest size so far. This trims it
+// down to what the current result uses, after parsing an unusually long
+// user agent for example.
+void uap_useragent_info_shrink(struct uap_useragent_info *);
@@ -36,6 +36,11 @@ void unique_strings_freeze(struct unique_strings_t *);
 const char* unique_strings_get(const struct unique_string_handle_t *);
 
 
+// Memory held by the instance, including its look-up structures until it's
+// frozen.
+size_t unique_strings_bytes(const struct unique_strings_t *);
+
+
 // Check if the given string is owned by the unique strings instance.  If it is
 // owned, then it's managed and you shouldn't attempt to free it.
 bool unique_strings_owns(struct unique_strings_t *, const char *str);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Measures the stream of user agents a parser sees:
+//  - reuse distances of a spatially hashed sample of user agents (SHARDS),
+//    scaled up by the sampling rate, giving the miss ratio of an LRU cache of
+//    any size. Sampled user agents are queued without a lock, and one in
+//    every batch takes it to record the queue.
+//  - a HyperLogLog count of distinct user agents in the current and the last
+//    completed time window, updated lock-free by every parse.
+struct workload_t;
+
+struct uap_workload_stats;
+
+
+// Allocate a tracker sampling 1 in `sampling` distinct user agents, with
+// windows of `window_seconds`.
+struct workload_t *workload_create(unsigned int sampling, unsigned int window_seconds);
+
+
+// Destroy and free a workload_t instance.
+void workload_destroy(struct workload_t *);
+
+
+// Record a parse of the user agent with the given hash (simd_hash64()).
+void workload_record(struct workload_t *, uint64_t hash);
+
+
+// Record the queued samples, and fill in the miss-ratio curve and distinct
+// counts.
+void workload_stats(struct workload_t *, struct uap_workload_stats *stats);
+
+
+// Memory held by the tracker.
+size_t workload_bytes(const struct workload_t *);
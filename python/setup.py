@@ -0,0 +1,29 @@
+import glob
+import os
+
+from setuptools import Extension, setup
+
+root = os.path.dirname(os.path.abspath(__file__))
+library = os.path.join(root, "..")
+
+# Build the library sources straight into the extension so it doesn't depend
+# on an installed libuaparser.
+sources = ["uap/_uap.c"] + sorted(
+    os.path.relpath(path, root) for path in glob.glob(os.path.join(library, "src", "*.c"))
+)
+
+setup(
+    name="uap",
+    version="0.2.0",
+    description="User agent parsing backed by the uap C library",
+    packages=["uap"],
+    ext_modules=[
+        Extension(
+            "uap._uap",
+            sources=sources,
+            include_dirs=[os.path.join(library, "include")],
+            extra_compile_args=["-std=c99", "-O3", "-pthread"],
+            libraries=["yaml", "pcre", "pthread", "m"],
+        )
+    ],
+)
@@ -0,0 +1,124 @@
+"""Checks the batch paths against parsing one user agent at a time.
+
+    make python && cd python && python3 -m unittest discover -s tests
+
+The NumPy and Arrow tests are skipped when those packages aren't installed.
+"""
+
+import os
+import unittest
+
+import uap
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+try:
+    import pyarrow as pa
+except ImportError:
+    pa = None
+
+REGEXES = os.environ.get(
+    "UAP_REGEXES",
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "..", "uap-core", "regexes.yaml"),
+)
+
+USER_AGENTS = [
+    "Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 "
+    "(KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+    "zq-batch-probe",
+    "",
+    None,
+]
+
+# More than four threads' worth of rows (BATCH_MIN_ROWS_PER_THREAD is 256),
+# so the threaded passes really split the column
+STRINGS = USER_AGENTS * 220
+
+
+class BatchTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.parser = uap.Parser(REGEXES)
+        cls.expected = {ua: cls.parser.parse(ua) for ua in USER_AGENTS if ua is not None}
+
+    def assertRows(self, rows, strings, null=None):
+        """rows: one dict of fields per row, `null` for null inputs."""
+        self.assertEqual(len(rows), len(strings))
+        for row, ua in zip(rows, strings):
+            self.assertEqual(row, self.expected[ua] if ua is not None else null, ua)
+
+    def test_parse_strings(self):
+        for threads in (1, 4):
+            result = uap.parse_strings(self.parser, STRINGS, threads=threads)
+            self.assertEqual(sorted(result), sorted(uap.FIELDS))
+
+            rows = [
+                {name: result[name][row] for name in uap.FIELDS} if ua is not None else None
+                for row, ua in enumerate(STRINGS)
+            ]
+            self.assertRows(rows, STRINGS)
+
+    @unittest.skipIf(np is None, "numpy isn't installed")
+    def test_parse_numpy(self):
+        encoded = [(ua or "").encode() for ua in STRINGS]
+        offsets = np.zeros(len(STRINGS) + 1, dtype=np.int32)
+        offsets[1:] = np.cumsum([len(ua) for ua in encoded])
+        data = np.frombuffer(b"".join(encoded), dtype=np.uint8)
+        validity = np.packbits([ua is not None for ua in STRINGS], bitorder="little")
+
+        for threads in (1, 4):
+            result, out_validity = uap.parse_numpy(self.parser, offsets, data, validity, threads=threads)
+            valid = np.unpackbits(out_validity, bitorder="little")[: len(STRINGS)]
+
+            rows = []
+            for row in range(len(STRINGS)):
+                if not valid[row]:
+                    rows.append(None)
+                    continue
+                fields = {}
+                for name, (field_offsets, field_data) in result.items():
+                    fields[name] = field_data[field_offsets[row]:field_offsets[row + 1]].tobytes().decode()
+                rows.append(fields)
+            self.assertRows(rows, STRINGS)
+
+    @unittest.skipIf(pa is None, "pyarrow isn't installed")
+    def test_parse_arrow_sliced(self):
+        # An offset off a byte boundary makes the validity bitmap shift
+        strings = STRINGS[3:1053]
+        sliced = pa.array(STRINGS, type=pa.string()).slice(3, len(strings))
+
+        for threads in (1, 4):
+            self.assertRows(uap.parse_arrow(self.parser, sliced, threads=threads).to_pylist(), strings)
+
+        chunked = pa.chunked_array([sliced.slice(0, 500), sliced.slice(500)])
+        self.assertRows(uap.parse_arrow(self.parser, chunked, threads=4).to_pylist(), strings)
+
+    @unittest.skipIf(pa is None, "pyarrow isn't installed")
+    def test_parse_arrow_dictionary_sliced(self):
+        strings = STRINGS[5:1061]
+        encoded = pa.array(STRINGS, type=pa.string()).dictionary_encode()
+        sliced = encoded.slice(5, len(strings))
+
+        # A dictionary sliced too, with a null value some rows point at. Those
+        # rows are valid, with every field null.
+        dictionary = pa.array(["unused", None] + USER_AGENTS[:4], type=pa.string()).slice(1)
+        indices = pa.array([(USER_AGENTS.index(ua) + 1) if ua is not None else 0 for ua in STRINGS], type=pa.int32())
+        nulls_in_dictionary = pa.DictionaryArray.from_arrays(indices.slice(3), dictionary)
+
+        for threads in (1, 4):
+            result = uap.parse_arrow(self.parser, sliced, threads=threads)
+            self.assertTrue(pa.types.is_dictionary(result.type[0].type))
+            self.assertRows(result.to_pylist(), strings)
+            self.assertRows(
+                uap.parse_arrow(self.parser, nulls_in_dictionary, threads=threads).to_pylist(),
+                STRINGS[3:],
+                null=dict.fromkeys(uap.FIELDS),
+            )
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,160 @@
+"""User agent parsing backed by the uap C library.
+
+    >>> parser = uap.Parser("uap-core/regexes.yaml")
+    >>> parser.parse("Mozilla/5.0 ...")["user_agent_family"]
+
+Whole columns are parsed with the GIL released, on one thread per CPU, and
+come back as Arrow or NumPy columns whose buffers are owned by the library,
+with no per-row Python objects in between.
+"""
+
+from array import array
+
+from ._uap import FIELDS, Parser
+
+__all__ = ["FIELDS", "Parser", "parse_arrow", "parse_numpy", "parse_strings"]
+
+
+def parse_arrow(parser, strings, threads=0):
+    """Parse a pyarrow string array (or chunked array) into a StructArray
+    with one string field per entry in FIELDS. Null inputs give null rows.
+
+    Dictionary-encoded input is parsed one dictionary value at a time, and
+    gives dictionary-encoded fields which share the input's indices."""
+    import pyarrow as pa
+
+    if isinstance(strings, pa.ChunkedArray):
+        dictionary = pa.types.is_dictionary(strings.type)
+        return pa.chunked_array(
+            [parse_arrow(parser, chunk, threads) for chunk in strings.chunks],
+            type=_arrow_type(pa, dictionary),
+        )
+
+    if pa.types.is_dictionary(strings.type):
+        return _parse_arrow_dictionary(parser, strings, threads)
+
+    if strings.type != pa.string():
+        strings = strings.cast(pa.string())
+
+    validity, offsets, data = strings.buffers()
+    columns, out_validity = parser.parse_batch(
+        offsets,
+        data if data is not None else b"",
+        validity if strings.null_count else None,
+        offset=strings.offset,
+        length=len(strings),
+        threads=threads,
+    )
+
+    null_bitmap = pa.py_buffer(out_validity) if out_validity is not None else None
+    arrays = [
+        pa.StringArray.from_buffers(
+            len(strings),
+            pa.py_buffer(field_offsets),
+            pa.py_buffer(field_data),
+            null_bitmap,
+        )
+        for field_offsets, field_data in columns
+    ]
+    return pa.StructArray.from_buffers(
+        _arrow_type(pa), len(strings), [null_bitmap], children=arrays
+    )
+
+
+def parse_numpy(parser, offsets, data, validity=None, threads=0):
+    """Parse an Arrow-layout column given as NumPy (or any buffer-protocol)
+    arrays. Returns {field: (int32 offsets, uint8 data)} as NumPy views over
+    the library's buffers, plus the validity bitmap or None."""
+    import numpy as np
+
+    columns, out_validity = parser.parse_batch(offsets, data, validity, threads=threads)
+    result = {
+        name: (
+            np.frombuffer(field_offsets, dtype=np.int32),
+            np.frombuffer(field_data, dtype=np.uint8),
+        )
+        for name, (field_offsets, field_data) in zip(FIELDS, columns)
+    }
+    if out_validity is not None:
+        out_validity = np.frombuffer(out_validity, dtype=np.uint8)
+    return result, out_validity
+
+
+def parse_strings(parser, strings, threads=0):
+    """Parse a sequence of str (None for missing values) and return
+    {field: list of str or None}. Convenient for lists and pandas object
+    columns; prefer parse_arrow() for large data."""
+    strings = list(strings)
+    offsets = array("i", [0])
+    data = bytearray()
+    validity = bytearray((len(strings) + 7) // 8)
+
+    for row, ua in enumerate(strings):
+        if ua is not None:
+            data += ua.encode("utf-8", "surrogatepass")
+            validity[row // 8] |= 1 << (row % 8)
+        offsets.append(len(data))
+
+    columns, out_validity = parser.parse_batch(offsets, bytes(data), validity, threads=threads)
+
+    result = {}
+    for name, (field_offsets, field_data) in zip(FIELDS, columns):
+        field_offsets = memoryview(field_offsets).cast("i")
+        field_data = bytes(field_data)
+        result[name] = [
+            field_data[field_offsets[row]:field_offsets[row + 1]].decode("utf-8", "replace")
+            if strings[row] is not None
+            else None
+            for row in range(len(strings))
+        ]
+    return result
+
+
+def _parse_arrow_dictionary(parser, strings, threads):
+    import pyarrow as pa
+
+    indices = strings.indices
+    if indices.type != pa.int32():
+        indices = indices.cast(pa.int32())
+    dictionary = strings.dictionary
+    if dictionary.type != pa.string():
+        dictionary = dictionary.cast(pa.string())
+
+    validity, index_data = indices.buffers()
+    dictionary_validity, offsets, data = dictionary.buffers()
+    columns, out_validity = parser.parse_dictionary(
+        index_data,
+        offsets,
+        data if data is not None else b"",
+        validity if indices.null_count else None,
+        dictionary_validity if dictionary.null_count else None,
+        offset=indices.offset,
+        length=len(indices),
+        dictionary_offset=dictionary.offset,
+        dictionary_length=len(dictionary),
+        threads=threads,
+    )
+
+    null_bitmap = pa.py_buffer(out_validity) if out_validity is not None else None
+    arrays = [
+        pa.DictionaryArray.from_arrays(
+            indices,
+            pa.StringArray.from_buffers(
+                len(dictionary),
+                pa.py_buffer(field_offsets),
+                pa.py_buffer(field_data),
+                null_bitmap,
+            ),
+        )
+        for field_offsets, field_data in columns
+    ]
+    return pa.StructArray.from_arrays(
+        arrays,
+        fields=list(_arrow_type(pa, True)),
+        mask=indices.is_null() if indices.null_count else None,
+    )
+
+
+def _arrow_type(pa, dictionary=False):
+    value_type = pa.dictionary(pa.int32(), pa.string()) if dictionary else pa.string()
+    return pa.struct([pa.field(name, value_type) for name in FIELDS])
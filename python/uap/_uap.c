@@ -0,0 +1,633 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/uap.h"
+
+
+static const char *const field_names[UAP_NUM_FIELDS] = {
+	"user_agent_family",
+	"user_agent_major",
+	"user_agent_minor",
+	"user_agent_patch",
+	"os_family",
+	"os_major",
+	"os_minor",
+	"os_patch",
+	"os_patch_minor",
+	"device_family",
+	"device_brand",
+	"device_model",
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// _Buffer: owns one malloc'd result array and exposes it through the buffer
+// protocol, so pyarrow.py_buffer() and numpy.frombuffer() wrap it without
+// copying.
+/////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	PyObject_HEAD
+	void *data;
+	Py_ssize_t size;
+} BufferObject;
+
+
+static void Buffer_dealloc(BufferObject *self) {
+	free(self->data);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static int Buffer_getbuffer(BufferObject *self, Py_buffer *view, int flags) {
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->size, 1, flags);
+}
+
+
+static PyBufferProcs Buffer_as_buffer = {
+	.bf_getbuffer = (getbufferproc)Buffer_getbuffer,
+};
+
+
+static PyTypeObject BufferType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "uap._uap._Buffer",
+	.tp_basicsize = sizeof(BufferObject),
+	.tp_dealloc = (destructor)Buffer_dealloc,
+	.tp_as_buffer = &Buffer_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Read-only bytes of a result array owned by the uap library.",
+};
+
+
+// Takes ownership of `data`, freeing it on failure
+static PyObject *Buffer_wrap(void *data, const Py_ssize_t size) {
+	BufferObject *buffer = PyObject_New(BufferObject, &BufferType);
+	if (!buffer) {
+		free(data);
+		return NULL;
+	}
+
+	buffer->data = data;
+	buffer->size = size;
+	return (PyObject *)buffer;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Parser
+/////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	PyObject_HEAD
+	struct uap_parser *ua_parser;
+} ParserObject;
+
+
+static void Parser_dealloc(ParserObject *self) {
+	if (self->ua_parser) {
+		uap_parser_destroy(self->ua_parser);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static int Parser_init(ParserObject *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = {"regexes", "merge_rules", "ascii_rules", "negative_cache", "memory_budget", NULL};
+	PyObject *regexes;
+	int merge_rules = 0;
+	int ascii_rules = 0;
+	Py_ssize_t negative_cache = 0;
+	Py_ssize_t memory_budget = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ppnn", keywords,
+			&regexes, &merge_rules, &ascii_rules, &negative_cache, &memory_budget)) {
+		return -1;
+	}
+
+	if (self->ua_parser) {
+		PyErr_SetString(PyExc_RuntimeError, "Parser is already initialized");
+		return -1;
+	}
+
+	struct uap_parser_options options = {
+		.flags = 0
+			| (merge_rules ? UAP_PARSER_MERGE_RULES : 0)
+			| (ascii_rules ? UAP_PARSER_ASCII_RULES : 0),
+		.negative_cache_entries = negative_cache > 0 ? (size_t)negative_cache : 0,
+		.memory_budget = memory_budget > 0 ? (size_t)memory_budget : 0,
+	};
+
+	self->ua_parser = uap_parser_create_with_options(&options);
+	if (!self->ua_parser) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	int ok;
+
+	// bytes are the regexes.yaml contents, anything else is a path to it
+	if (PyBytes_Check(regexes)) {
+		const unsigned char *buffer = (const unsigned char *)PyBytes_AS_STRING(regexes);
+		const size_t bufsize = PyBytes_GET_SIZE(regexes);
+
+		Py_BEGIN_ALLOW_THREADS
+		ok = uap_parser_read_buffer(self->ua_parser, buffer, bufsize);
+		Py_END_ALLOW_THREADS
+	} else {
+		PyObject *path;
+		if (!PyUnicode_FSConverter(regexes, &path)) {
+			return -1;
+		}
+
+		FILE *fd = fopen(PyBytes_AS_STRING(path), "r");
+		if (!fd) {
+			PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, regexes);
+			Py_DECREF(path);
+			return -1;
+		}
+		Py_DECREF(path);
+
+		Py_BEGIN_ALLOW_THREADS
+		ok = uap_parser_read_file(self->ua_parser, fd);
+		Py_END_ALLOW_THREADS
+		fclose(fd);
+	}
+
+	if (!ok) {
+		PyErr_SetString(PyExc_ValueError, "Failed to load regexes");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int _parser_ready(ParserObject *self) {
+	if (!self->ua_parser) {
+		PyErr_SetString(PyExc_RuntimeError, "Parser is not initialized");
+		return 0;
+	}
+	return 1;
+}
+
+
+static PyObject *Parser_parse(ParserObject *self, PyObject *arg) {
+	if (!_parser_ready(self)) {
+		return NULL;
+	}
+
+	const char *ua;
+	Py_ssize_t length;
+
+	if (PyUnicode_Check(arg)) {
+		if (!(ua = PyUnicode_AsUTF8AndSize(arg, &length))) {
+			return NULL;
+		}
+	} else if (PyBytes_Check(arg)) {
+		ua = PyBytes_AS_STRING(arg);
+		length = PyBytes_GET_SIZE(arg);
+	} else {
+		PyErr_SetString(PyExc_TypeError, "parse() expects str or bytes");
+		return NULL;
+	}
+
+	struct uap_useragent_info info;
+	uap_useragent_info_init(&info);
+
+	const char *fields[UAP_NUM_FIELDS] = {
+		"Other", "", "", "",
+		"Other", "", "", "", "",
+		"Other", "", "",
+	};
+
+	if (uap_parser_parse_string_length(self->ua_parser, &info, ua, length) > 0) {
+		const char *matched[UAP_NUM_FIELDS] = {
+			info.user_agent.family, info.user_agent.major, info.user_agent.minor, info.user_agent.patch,
+			info.os.family, info.os.major, info.os.minor, info.os.patch, info.os.patchMinor,
+			info.device.family, info.device.brand, info.device.model,
+		};
+		memcpy(fields, matched, sizeof(fields));
+	}
+
+	PyObject *result = PyDict_New();
+	for (int field = 0; result && field < UAP_NUM_FIELDS; field++) {
+		PyObject *value = PyUnicode_DecodeUTF8(fields[field], strlen(fields[field]), "replace");
+		if (!value || PyDict_SetItemString(result, field_names[field], value) < 0) {
+			Py_XDECREF(value);
+			Py_CLEAR(result);
+			break;
+		}
+		Py_DECREF(value);
+	}
+
+	uap_useragent_info_cleanup(&info);
+	return result;
+}
+
+
+// Arrow validity bitmaps of sliced arrays start mid-byte; the library wants
+// bit 0 to be the first row.
+static uint8_t *_shift_bitmap(const uint8_t *bitmap, const Py_ssize_t bit_offset, const Py_ssize_t length) {
+	uint8_t *shifted = calloc((length + 7) / 8 + 1, 1);
+	if (!shifted) {
+		return NULL;
+	}
+
+	for (Py_ssize_t row = 0; row < length; row++) {
+		const Py_ssize_t bit = bit_offset + row;
+		if ((bitmap[bit / 8] >> (bit % 8)) & 1) {
+			shifted[row / 8] |= 1 << (row % 8);
+		}
+	}
+
+	return shifted;
+}
+
+
+// Hand every array of `output` over to a _Buffer as soon as possible so each
+// one has exactly one owner at any time. Returns (columns, validity).
+static PyObject *_result_columns_wrap(struct uap_result_columns *output) {
+	const Py_ssize_t length = output->length;
+	PyObject *result = NULL;
+
+	PyObject *columns = PyTuple_New(UAP_NUM_FIELDS);
+	for (int field = 0; columns && field < UAP_NUM_FIELDS; field++) {
+		const Py_ssize_t data_size = output->offsets[field][length];
+
+		PyObject *column_offsets = Buffer_wrap(output->offsets[field], (length + 1) * sizeof(int32_t));
+		PyObject *column_data = Buffer_wrap(output->data[field], data_size);
+		output->offsets[field] = NULL;
+		output->data[field] = NULL;
+
+		PyObject *column = column_offsets && column_data ? PyTuple_Pack(2, column_offsets, column_data) : NULL;
+		Py_XDECREF(column_offsets);
+		Py_XDECREF(column_data);
+
+		if (!column) {
+			Py_CLEAR(columns);
+			break;
+		}
+		PyTuple_SET_ITEM(columns, field, column);
+	}
+
+	PyObject *result_validity = NULL;
+	if (columns && output->validity) {
+		result_validity = Buffer_wrap(output->validity, (length + 7) / 8);
+		output->validity = NULL;
+	} else if (columns) {
+		result_validity = Py_None;
+		Py_INCREF(Py_None);
+	}
+
+	if (columns && result_validity) {
+		result = PyTuple_Pack(2, columns, result_validity);
+	}
+	Py_XDECREF(columns);
+	Py_XDECREF(result_validity);
+	uap_result_columns_cleanup(output);
+
+	return result;
+}
+
+
+// Checks `length` rows of Arrow offsets (length + 1 entries) into `data_size`
+// bytes, setting a ValueError if they're unusable.
+static int _check_offsets(const int32_t *offsets, const Py_ssize_t length, const Py_ssize_t data_size) {
+	for (Py_ssize_t row = 0; row < length; row++) {
+		if (offsets[row] < 0 || offsets[row] > offsets[row + 1]) {
+			PyErr_SetString(PyExc_ValueError, "offsets must be non-negative and ascending");
+			return 0;
+		}
+	}
+	if (length && offsets[length] > data_size) {
+		PyErr_SetString(PyExc_ValueError, "offsets point past the end of data");
+		return 0;
+	}
+	return 1;
+}
+
+
+// A validity bitmap starting at row `offset`, shifted into `*shifted` if it
+// doesn't start on a byte boundary. Sets a MemoryError on failure.
+static const uint8_t *_bitmap_at(const uint8_t *bitmap, const Py_ssize_t offset, const Py_ssize_t length, uint8_t **shifted) {
+	if (!bitmap || !offset) {
+		return bitmap;
+	} else if (offset % 8 == 0) {
+		return bitmap + offset / 8;
+	} else if (!(*shifted = _shift_bitmap(bitmap, offset, length))) {
+		PyErr_NoMemory();
+	}
+	return *shifted;
+}
+
+
+static PyObject *Parser_parse_batch(ParserObject *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = {"offsets", "data", "validity", "offset", "length", "threads", NULL};
+	PyObject *offsets_obj, *data_obj, *validity_obj = Py_None;
+	Py_ssize_t offset = 0, length = -1;
+	int threads = 0;
+
+	if (!_parser_ready(self)) {
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|Onni", keywords,
+			&offsets_obj, &data_obj, &validity_obj, &offset, &length, &threads)) {
+		return NULL;
+	}
+
+	Py_buffer offsets = {0}, data = {0}, validity = {0};
+	uint8_t *shifted = NULL;
+	PyObject *result = NULL;
+
+	if (PyObject_GetBuffer(offsets_obj, &offsets, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+	if (PyObject_GetBuffer(data_obj, &data, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+	if (validity_obj != Py_None && PyObject_GetBuffer(validity_obj, &validity, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+
+	const Py_ssize_t available = offsets.len / (Py_ssize_t)sizeof(int32_t) - 1;
+	if (length < 0) {
+		length = available - offset;
+	}
+	if (offset < 0 || length < 0 || offset + length > available) {
+		PyErr_SetString(PyExc_ValueError, "offsets buffer is too short");
+		goto done;
+	}
+	if (validity.buf && validity.len * 8 < offset + length) {
+		PyErr_SetString(PyExc_ValueError, "validity buffer is too short");
+		goto done;
+	}
+
+	const int32_t *row_offsets = (const int32_t *)offsets.buf + offset;
+	if (!_check_offsets(row_offsets, length, data.len)) {
+		goto done;
+	}
+
+	const uint8_t *bitmap = _bitmap_at(validity.buf, offset, length, &shifted);
+	if (validity.buf && !bitmap) {
+		goto done;
+	}
+
+	struct uap_string_column input = {
+		.length = length,
+		.offsets = row_offsets,
+		.data = data.buf,
+		.validity = bitmap,
+	};
+	struct uap_result_columns output;
+	int ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = uap_parser_parse_batch(self->ua_parser, &input, &output, threads);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	result = _result_columns_wrap(&output);
+
+done:
+	free(shifted);
+	if (offsets.obj) {
+		PyBuffer_Release(&offsets);
+	}
+	if (data.obj) {
+		PyBuffer_Release(&data);
+	}
+	if (validity.obj) {
+		PyBuffer_Release(&validity);
+	}
+	return result;
+}
+
+
+static PyObject *Parser_parse_dictionary(ParserObject *self, PyObject *args, PyObject *kwargs) {
+	static char *keywords[] = {
+		"indices", "offsets", "data", "validity", "dictionary_validity",
+		"offset", "length", "dictionary_offset", "dictionary_length", "threads", NULL
+	};
+	PyObject *indices_obj, *offsets_obj, *data_obj, *validity_obj = Py_None, *dictionary_validity_obj = Py_None;
+	Py_ssize_t offset = 0, length = -1, dictionary_offset = 0, dictionary_length = -1;
+	int threads = 0;
+
+	if (!_parser_ready(self)) {
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|OOnnnni", keywords,
+			&indices_obj, &offsets_obj, &data_obj, &validity_obj, &dictionary_validity_obj,
+			&offset, &length, &dictionary_offset, &dictionary_length, &threads)) {
+		return NULL;
+	}
+
+	Py_buffer indices = {0}, offsets = {0}, data = {0}, validity = {0}, dictionary_validity = {0};
+	uint8_t *shifted = NULL, *dictionary_shifted = NULL;
+	PyObject *result = NULL;
+
+	if (PyObject_GetBuffer(indices_obj, &indices, PyBUF_C_CONTIGUOUS) < 0 ||
+			PyObject_GetBuffer(offsets_obj, &offsets, PyBUF_C_CONTIGUOUS) < 0 ||
+			PyObject_GetBuffer(data_obj, &data, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+	if (validity_obj != Py_None && PyObject_GetBuffer(validity_obj, &validity, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+	if (dictionary_validity_obj != Py_None &&
+			PyObject_GetBuffer(dictionary_validity_obj, &dictionary_validity, PyBUF_C_CONTIGUOUS) < 0) {
+		goto done;
+	}
+
+	const Py_ssize_t available = indices.len / (Py_ssize_t)sizeof(int32_t);
+	if (length < 0) {
+		length = available - offset;
+	}
+	const Py_ssize_t dictionary_available = offsets.len / (Py_ssize_t)sizeof(int32_t) - 1;
+	if (dictionary_length < 0) {
+		dictionary_length = dictionary_available - dictionary_offset;
+	}
+	if (offset < 0 || length < 0 || offset + length > available) {
+		PyErr_SetString(PyExc_ValueError, "indices buffer is too short");
+		goto done;
+	}
+	if (dictionary_offset < 0 || dictionary_length < 0 || dictionary_offset + dictionary_length > dictionary_available) {
+		PyErr_SetString(PyExc_ValueError, "offsets buffer is too short");
+		goto done;
+	}
+	if ((validity.buf && validity.len * 8 < offset + length) ||
+			(dictionary_validity.buf && dictionary_validity.len * 8 < dictionary_offset + dictionary_length)) {
+		PyErr_SetString(PyExc_ValueError, "validity buffer is too short");
+		goto done;
+	}
+
+	const int32_t *row_offsets = (const int32_t *)offsets.buf + dictionary_offset;
+	if (!_check_offsets(row_offsets, dictionary_length, data.len)) {
+		goto done;
+	}
+
+	const uint8_t *bitmap = _bitmap_at(validity.buf, offset, length, &shifted);
+	const uint8_t *dictionary_bitmap = _bitmap_at(dictionary_validity.buf, dictionary_offset, dictionary_length, &dictionary_shifted);
+	if ((validity.buf && !bitmap) || (dictionary_validity.buf && !dictionary_bitmap)) {
+		goto done;
+	}
+
+	struct uap_dictionary_column input = {
+		.length = length,
+		.indices = (const int32_t *)indices.buf + offset,
+		.validity = bitmap,
+		.dictionary = {
+			.length = dictionary_length,
+			.offsets = row_offsets,
+			.data = data.buf,
+			.validity = dictionary_bitmap,
+		},
+	};
+	struct uap_result_columns output;
+	int ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = uap_parser_parse_dictionary(self->ua_parser, &input, &output, threads);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		PyErr_SetString(PyExc_ValueError, "index outside the dictionary, or out of memory");
+		goto done;
+	}
+
+	result = _result_columns_wrap(&output);
+
+done:
+	free(shifted);
+	free(dictionary_shifted);
+	Py_buffer *buffers[] = { &indices, &offsets, &data, &validity, &dictionary_validity };
+	for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+		if (buffers[i]->obj) {
+			PyBuffer_Release(buffers[i]);
+		}
+	}
+	return result;
+}
+
+
+static PyObject *Parser_memory_usage(ParserObject *self, PyObject *Py_UNUSED(ignored)) {
+	if (!self->ua_parser) {
+		PyErr_SetString(PyExc_RuntimeError, "Parser is not initialized");
+		return NULL;
+	}
+
+	struct uap_memory_usage usage;
+	uap_parser_memory_usage(self->ua_parser, &usage);
+
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+			"rules", (Py_ssize_t)usage.rules,
+			"variants", (Py_ssize_t)usage.variants,
+			"jit", (Py_ssize_t)usage.jit,
+			"caches", (Py_ssize_t)usage.caches,
+			"workload", (Py_ssize_t)usage.workload,
+			"strings", (Py_ssize_t)usage.strings,
+			"scratch", (Py_ssize_t)usage.scratch,
+			"total", (Py_ssize_t)usage.total,
+			"budget", (Py_ssize_t)usage.budget);
+}
+
+
+static PyMethodDef Parser_methods[] = {
+	{"parse", (PyCFunction)Parser_parse, METH_O,
+		"parse(user_agent) -> dict\n\n"
+		"Parse one user agent string (str or bytes)."},
+	{"parse_batch", (PyCFunction)(void (*)(void))Parser_parse_batch, METH_VARARGS | METH_KEYWORDS,
+		"parse_batch(offsets, data, validity=None, offset=0, length=-1, threads=0)\n"
+		"    -> (columns, validity)\n\n"
+		"Parse an Arrow-layout string column given as buffer-protocol objects:\n"
+		"int32 offsets, utf-8 data and an optional validity bitmap. The GIL is\n"
+		"released while the rows are parsed on `threads` threads (0 for one per\n"
+		"CPU). Returns one (offsets, data) pair of buffers per field, in FIELDS\n"
+		"order, plus the validity bitmap or None."},
+	{"parse_dictionary", (PyCFunction)(void (*)(void))Parser_parse_dictionary, METH_VARARGS | METH_KEYWORDS,
+		"parse_dictionary(indices, offsets, data, validity=None, dictionary_validity=None,\n"
+		"                 offset=0, length=-1, dictionary_offset=0, dictionary_length=-1,\n"
+		"                 threads=0) -> (columns, validity)\n\n"
+		"Parse a dictionary-encoded column: int32 indices (with `validity`) into\n"
+		"a dictionary given as offsets, data and `dictionary_validity`. Each\n"
+		"dictionary value is parsed once, with the GIL released. Returns one\n"
+		"(offsets, data) pair per field with an entry per dictionary value, to\n"
+		"be used with the same indices, plus the dictionary's validity; values\n"
+		"no valid row refers to are null."},
+	{"memory_usage", (PyCFunction)Parser_memory_usage, METH_NOARGS,
+		"memory_usage() -> dict\n\n"
+		"Bytes held by the parser, by kind, with the total and the budget."},
+	{NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject ParserType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "uap._uap.Parser",
+	.tp_basicsize = sizeof(ParserObject),
+	.tp_dealloc = (destructor)Parser_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Parser(regexes, merge_rules=False, ascii_rules=False, negative_cache=0,\n"
+		"       memory_budget=0)\n\n"
+		"Load a regexes.yaml, given as a path or as bytes of its contents.\n"
+		"negative_cache is the number of fall-through user agents to remember\n"
+		"per group. memory_budget caps the parser's memory in bytes, shedding\n"
+		"caches and optional compiled variants to fit.",
+	.tp_methods = Parser_methods,
+	.tp_init = (initproc)Parser_init,
+	.tp_new = PyType_GenericNew,
+};
+
+
+static struct PyModuleDef uap_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "uap._uap",
+	.m_doc = "Bindings for the uap user agent parser.",
+	.m_size = -1,
+};
+
+
+PyMODINIT_FUNC PyInit__uap(void) {
+	if (PyType_Ready(&BufferType) < 0 || PyType_Ready(&ParserType) < 0) {
+		return NULL;
+	}
+
+	PyObject *module = PyModule_Create(&uap_module);
+	if (!module) {
+		return NULL;
+	}
+
+	PyObject *fields = PyTuple_New(UAP_NUM_FIELDS);
+	for (int field = 0; fields && field < UAP_NUM_FIELDS; field++) {
+		PyObject *name = PyUnicode_FromString(field_names[field]);
+		if (!name) {
+			Py_CLEAR(fields);
+			break;
+		}
+		PyTuple_SET_ITEM(fields, field, name);
+	}
+
+	if (!fields || PyModule_AddObject(module, "FIELDS", fields) < 0) {
+		Py_XDECREF(fields);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&ParserType);
+	if (PyModule_AddObject(module, "Parser", (PyObject *)&ParserType) < 0) {
+		Py_DECREF(&ParserType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	return module;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# uaparser's pipeline mode (-p) must give every record the fields parsing its
+# user agent on its own gives, in input order, whether the log comes from a
+# file or stdin and whatever the partitioning and memory budget.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+tab=$(printf '\t')
+other="Other$tab$tab$tab${tab}Other$tab$tab$tab$tab${tab}Other$tab$tab"
+
+# Repeats for the dedup tables, and a version too long for an inline result
+long="Mozilla/5.0 (X11; Linux x86_64) Firefox/$(printf '9%.0s' $(seq 300)).$(printf '9%.0s' $(seq 150))"
+{ cat bench/user_agents.txt; echo "$long"; cat bench/user_agents.txt; echo; } | awk '{ print NR "\t" $0 }' > "$dir/log"
+
+printf "Running pipeline tests ...  "
+
+while IFS="$tab" read -r number ua; do
+	fields=$(./uaparser "$ua" | cut -f2 | paste -sd '\t' -)
+	printf '%s\t%s\t%s\n' "$number" "$ua" "${fields:-$other}"
+done < "$dir/log" > "$dir/expected"
+
+passed=0
+for options in "-P 5 -j 3" "-P 16 -j 1 -m 0" "-j 2 -m 1"; do
+	./uaparser -p -c 2 $options "$dir/log" > "$dir/file"
+	./uaparser -p -c 2 $options < "$dir/log" > "$dir/stdin"
+
+	if cmp -s "$dir/expected" "$dir/file" && cmp -s "$dir/expected" "$dir/stdin"; then
+		passed=$((passed + 1))
+	else
+		printf '\nuaparser -p %s differs from parsing each line\n' "$options" >&2
+		diff "$dir/expected" "$dir/file" | head -5 >&2
+	fi
+done
+
+echo "$passed PASSED"
+[ "$passed" -eq 3 ]
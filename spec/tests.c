@@ -2,8 +2,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <yaml.h>
 
+#include "uap/pattern.h"
+#include "uap/simd.h"
 #include "uap/uap.h"
 
 #define MAKE_FOURCC(a,b,c,d) ((a)|((b)<<8)|((c)<<16)|((d)<<24))
@@ -194,25 +198,1229 @@ static void run_test_file(
 }
 
 
+static struct uap_parser *load_parser(const struct uap_parser_options *options) {
+	struct uap_parser *ua_parser = uap_parser_create_with_options(options);
+	FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
+	if (fd != NULL) {
+		uap_parser_read_file(ua_parser, fd);
+		fclose(fd);
+	} else {
+		uap_parser_destroy(ua_parser);
+		return NULL;
+	}
+	return ua_parser;
+}
+
+
+// What a stand-in executor was asked to run
+struct executor_calls {
+	int calls;
+	size_t tasks;
+};
+
+
+// Runs tasks as soon as they're submitted, standing in for a host thread pool
+static int inline_submit(void *context, void (*fn)(void *arg), void *arg) {
+	struct executor_calls *calls = context;
+	calls->calls++;
+	calls->tasks++;
+	fn(arg);
+	return 1;
+}
+
+
+// Runs every index on the calling thread, last first, so nothing may rely
+// on the order a pool picks them up in
+static void reverse_parallel_for(void *context, size_t count, void (*fn)(void *arg, size_t index), void *arg) {
+	struct executor_calls *calls = context;
+	calls->calls++;
+	calls->tasks += count;
+	while (count > 0) {
+		fn(arg, --count);
+	}
+}
+
+
+static void run_base_tests(struct uap_parser *ua_parser) {
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+}
+
+
+// Tokens written out as "name|version", "name" or "(comment)", separated by spaces
+static void describe_tokens(char *out, const size_t size, const char *user_agent) {
+	struct uap_token tokens[16];
+	const size_t count = uap_tokenize(user_agent, strlen(user_agent), tokens, 16);
+	size_t used = 0;
+
+	out[0] = '\0';
+
+	for (size_t i = 0; i < count && i < 16 && used < size; i++) {
+		const char *text = user_agent + tokens[i].start;
+
+		if (tokens[i].type == UAP_TOKEN_COMMENT) {
+			used += snprintf(out + used, size - used, "%s(%.*s)", i ? " " : "", (int)tokens[i].length, text);
+		} else if (tokens[i].version_length) {
+			used += snprintf(out + used, size - used, "%s%.*s|%.*s", i ? " " : "",
+					(int)tokens[i].name_length, text,
+					(int)tokens[i].version_length, user_agent + tokens[i].version_start);
+		} else {
+			used += snprintf(out + used, size - used, "%s%.*s", i ? " " : "", (int)tokens[i].name_length, text);
+		}
+	}
+}
+
+
+static void run_tokenizer_tests() {
+	static const char *const cases[][2] = {
+		{
+			"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+			"Mozilla|5.0 (Windows NT 10.0; Win64; x64) AppleWebKit|537.36 (KHTML, like Gecko) Chrome|120.0.0.0 Safari|537.36",
+		},
+		{
+			"Mozilla/5.0 (Linux; Android 13; Pixel 7) Mobile Safari/537.36 MyApp/2.3.1",
+			"Mozilla|5.0 (Linux; Android 13; Pixel 7) Mobile Safari|537.36 MyApp|2.3.1",
+		},
+		{ "Opera/9.80 (J2ME/MIDP; Opera Mini/5.1 (nested)) Presto/2.5", "Opera|9.80 (J2ME/MIDP; Opera Mini/5.1 (nested)) Presto|2.5" },
+		{ "  curl/8.4.0\t", "curl|8.4.0" },
+		{ "Dalvik/2.1.0 (Linux; U", "Dalvik|2.1.0 (Linux; U)" },
+		{ "a)b()c/", "a b () c" },
+		{ "", "" },
+	};
+	const size_t num_cases = sizeof(cases) / sizeof(cases[0]);
+	int num_passed = 0;
+	char described[512];
+
+	printf("Running tokenizer tests ...  ");
+
+	for (size_t i = 0; i < num_cases; i++) {
+		describe_tokens(described, sizeof(described), cases[i][0]);
+
+		if (strcmp(described, cases[i][1]) == 0) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\ntokenizing \"%s\"\n  expected: %s\n  actual:   %s\n", cases[i][0], cases[i][1], described);
+		}
+	}
+
+	// Reading one product's version without any expressions
+	const char *user_agent = cases[1][0];
+	struct uap_token tokens[16];
+	const size_t count = uap_tokenize(user_agent, strlen(user_agent), tokens, 16);
+	const struct uap_token *app = uap_token_find_product(user_agent, tokens, count, "MyApp");
+
+	if (app && strncmp(user_agent + app->version_start, "2.3.1", app->version_length) == 0 &&
+			!uap_token_find_product(user_agent, tokens, count, "MyAp") &&
+			uap_tokenize(user_agent, strlen(user_agent), tokens, 2) == count) {
+		num_passed++;
+	} else {
+		fprintf(stderr, "\nfinding a product token failed\n");
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	if ((size_t)num_passed != num_cases + 1) {
+		fprintf(stderr, "%d FAILED\n", (int)(num_cases + 1) - num_passed);
+		exit(1);
+	}
+}
+
+
+#define SIMD_TEST_BUFFERS 2000
+#define SIMD_TEST_RESULTS 32
+
+
+// Everything the kernels report for one buffer, with a needle taken from it
+static void simd_results(const char *str, const size_t length, const char *needle, const size_t needle_length,
+		const struct simd_byteset *sets, const int num_sets, uint64_t results[SIMD_TEST_RESULTS]) {
+	char lowercase[512];
+	size_t n = 0;
+
+	results[n++] = simd_is_ascii(str, length);
+	results[n++] = simd_ascii_lowercase(lowercase, str, length);
+	results[n++] = results[1] ? simd_hash64(lowercase, length + 1, 0) : 0;
+
+	const char *found = simd_memmem(str, length, needle, needle_length);
+	results[n++] = found ? (uint64_t)(found - str) : UINT64_MAX;
+	found = simd_memmem_caseless(str, length, needle, needle_length);
+	results[n++] = found ? (uint64_t)(found - str) : UINT64_MAX;
+
+	simd_byte_presence(str, length, results + n);
+	n += 4;
+
+	for (int i = 0; i < num_sets; i++) {
+		size_t start;
+		results[n++] = simd_find_byteset(str, length, &sets[i]);
+		results[n++] = simd_span_byteset(str, length, &sets[i]);
+		results[n++] = simd_trim(str, length, &sets[i], &start);
+		results[n++] = start;
+	}
+}
+
+
+// Expected rewrites of caseless expressions, NULL where the rewrite must
+// refuse: escapes keep their case, classes and ranges lowercase only when
+// they stay the same set, and a merged expression's (*MARK:n) is kept
+static void run_pattern_lowercase_tests() {
+	static const char *const cases[][2] = {
+		{ "Firefox/(\\d+)",           "firefox/(\\d+)" },
+		{ "\\bMSIE\\s\\D\\W\\S",      "\\bmsie\\s\\D\\W\\S" },
+		{ "Mobile\\.Safari\\/",       "mobile\\.safari\\/" },
+		{ "\\x41",                    NULL },
+		{ "(Ab)\\1",                  NULL },
+		{ "\\QAb\\E",                 NULL },
+		{ "Ab\\",                     NULL },
+		{ "[A-Z]+[0-9A-F]",           "[a-z]+[0-9a-f]" },
+		{ "[]A][^]B]",                "[]a][^]b]" },
+		{ "[a-Z]",                    NULL },
+		{ "[!-~]",                    NULL },
+		{ "[\\!-Z]",                  NULL },
+		{ "[[:alpha:]]",              NULL },
+		{ "[Ab",                      NULL },
+		{ "(?:Ab)(?=C)(?<!D)",        "(?:ab)(?=c)(?<!d)" },
+		{ "(?i)Ab",                   NULL },
+		{ "(?<Name>Ab)",              NULL },
+		{ "(*MARK:12)Ab|(*MARK:3)Cd", "(*MARK:12)ab|(*MARK:3)cd" },
+		{ "(*MARK:x)Ab",              NULL },
+		{ "(*MARK:12Ab",              NULL },
+		{ "(*UTF8)Ab",                NULL },
+		{ "Caf\xc3\xa9",              NULL },
+	};
+	const int num_cases = sizeof(cases) / sizeof(cases[0]);
+	char out[64];
+	int num_passed = 0;
+
+	printf("Running pattern lowercase tests ...  ");
+
+	for (int i = 0; i < num_cases; i++) {
+		const bool rewritten = pattern_lowercase(out, cases[i][0]);
+
+		if (cases[i][1] ? rewritten && strcmp(out, cases[i][1]) == 0 : !rewritten) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\nlowercase of \"%s\" gave %s\n", cases[i][0], rewritten ? out : "nothing");
+		}
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	if (num_passed != num_cases) {
+		fprintf(stderr, "%d FAILED\n", num_cases - num_passed);
+		exit(1);
+	}
+}
+
+
+// Every kernel level the CPU supports must agree with the scalar kernels on
+// random buffers, mostly of user agent bytes with runs of the sets' bytes
+static void run_simd_tests() {
+	static const char alphabet[] = "Mozilla/5.0 (Windows NT; x64) AppleWebKit Safari\t  ;;((\xc3\xa9\xff";
+	static const char *const set_bytes[] = { " ", " \t", "()", " /;.", " \xc3" };
+	const int num_sets = sizeof(set_bytes) / sizeof(set_bytes[0]);
+
+	struct simd_byteset sets[5];
+	for (int i = 0; i < num_sets; i++) {
+		simd_byteset_init(&sets[i], set_bytes[i]);
+	}
+
+	const int num_levels = simd_level_count();
+	const int level = simd_set_level(0);
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	int num_passed = 0;
+
+	printf("Running SIMD kernel tests on %d levels ...  ", num_levels);
+
+	for (int i = 0; i < SIMD_TEST_BUFFERS; i++) {
+		char str[400], needle[24];
+		const size_t length = i % 300;
+
+		for (size_t j = 0; j < length; j++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			str[j] = alphabet[(state >> 32) % (sizeof(alphabet) - 1)];
+		}
+
+		// Some needles are in the buffer, in another case, others aren't
+		const size_t needle_start = length ? (state >> 8) % length : 0;
+		size_t needle_length = (state >> 20) % 20;
+		if (needle_start + needle_length > length) {
+			needle_length = length - needle_start;
+		}
+		memcpy(needle, str + needle_start, needle_length);
+		if (needle_length && i % 3 == 1) {
+			needle[needle_length - 1] ^= 0x20;
+		}
+
+		uint64_t expected[SIMD_TEST_RESULTS] = { 0 };
+		simd_set_level(0);
+		simd_results(str, length, needle, needle_length, sets, num_sets, expected);
+
+		int same = 1;
+		for (int l = 1; same && l < num_levels; l++) {
+			uint64_t results[SIMD_TEST_RESULTS] = { 0 };
+			simd_set_level(l);
+			simd_results(str, length, needle, needle_length, sets, num_sets, results);
+			same = memcmp(expected, results, sizeof(results)) == 0;
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\nkernels differ on buffer %d (%zu bytes)\n", i, length);
+		}
+	}
+
+	simd_set_level(level);
+	printf("%d PASSED\n", num_passed);
+
+	if (num_passed != SIMD_TEST_BUFFERS) {
+		fprintf(stderr, "%d FAILED\n", SIMD_TEST_BUFFERS - num_passed);
+		exit(1);
+	}
+}
+
+
+// A document broken part way through fails to load instead of scanning
+// forever, keeping the rules before the break
+static void run_read_error_tests() {
+	static const char regexes[] =
+		"user_agent_parsers:\n"
+		"  - regex: '^(Kept)/(\\d+)'\n"
+		"  - regex: \"unterminated\n";
+
+	struct uap_parser *ua_parser = uap_parser_create();
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running read error tests ...  ");
+
+	num_passed += !uap_parser_read_buffer(ua_parser, (const unsigned char *)regexes, sizeof(regexes) - 1);
+	num_passed += uap_parser_parse_string(ua_parser, ua_info, "Kept/1") > 0 &&
+		strcmp(ua_info->user_agent.family, "Kept") == 0;
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+
+	if (num_passed != 2) {
+		fprintf(stderr, "%d FAILED\n", 2 - num_passed);
+		exit(1);
+	}
+}
+
+
+// Replacements are trimmed of spaces at both ends, whichever ends have them
+static void run_replacement_trim_tests() {
+	static const char regexes[] =
+		"user_agent_parsers:\n"
+		"  - regex: '^Trim(.*)/(\\d+)'\n"
+		"    family_replacement: '$1'\n"
+		"    v1_replacement: ' $2 '\n";
+	static const char *const cases[][3] = {
+		{ "Trim  Both  /1", "Both", "1" },
+		{ "TrimEnd  /2", "End", "2" },
+		{ "Trim  Start/3", "Start", "3" },
+		{ "Trim   /4", "", "4" },
+	};
+	const size_t num_cases = sizeof(cases) / sizeof(cases[0]);
+
+	struct uap_parser *ua_parser = uap_parser_create();
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running replacement trim tests ...  ");
+
+	if (!uap_parser_read_buffer(ua_parser, (const unsigned char *)regexes, sizeof(regexes) - 1)) {
+		fprintf(stderr, "\nunable to read the trim test expressions\n");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < num_cases; i++) {
+		if (uap_parser_parse_string(ua_parser, ua_info, cases[i][0]) &&
+				strcmp(ua_info->user_agent.family, cases[i][1]) == 0 &&
+				strcmp(ua_info->user_agent.major, cases[i][2]) == 0) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\n\"%s\" gave \"%s\" \"%s\"\n", cases[i][0], ua_info->user_agent.family, ua_info->user_agent.major);
+		}
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+
+	if ((size_t)num_passed != num_cases) {
+		fprintf(stderr, "%d FAILED\n", (int)num_cases - num_passed);
+		exit(1);
+	}
+}
+
+
+// A native rule for "UapTest/<version>" products, as a client SDK might add
+static int uap_test_rule(void *context, struct uap_rule_subject *subject, struct uap_rule_fields *fields) {
+	const struct uap_token *tokens;
+	const size_t count = uap_rule_subject_tokens(subject, &tokens);
+	const struct uap_token *product = uap_token_find_product(subject->user_agent, tokens, count, "UapTest");
+
+	if (!product) {
+		return 0;
+	}
+
+	fields->value[0] = context;
+	fields->length[0] = strlen(context);
+	fields->value[1] = subject->user_agent + product->version_start;
+	fields->length[1] = product->version_length;
+	return 1;
+}
+
+
+static void run_native_rule_tests() {
+	struct uap_parser *ua_parser = uap_parser_create();
+	uap_parser_add_rule(ua_parser, UAP_GROUP_USER_AGENT, 0, &uap_test_rule, "UapTest");
+	uap_parser_add_rule(ua_parser, UAP_GROUP_DEVICE, 1000000, &uap_test_rule, "UapTest Device");
+
+	FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
+	uap_parser_read_file(ua_parser, fd);
+	fclose(fd);
+
+	puts("Native rules");
+	run_base_tests(ua_parser);
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	const char *user_agent = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) UapTest/7.2";
+	struct uap_provenance provenance;
+	uap_parser_parse_string_provenance(ua_parser, ua_info, user_agent, strlen(user_agent), &provenance);
+
+	// Native rules report the positions they were added at
+	if (strcmp(ua_info->user_agent.family, "UapTest") != 0 ||
+			strcmp(ua_info->user_agent.major, "7.2") != 0 ||
+			strcmp(ua_info->user_agent.minor, "") != 0 ||
+			strcmp(ua_info->os.family, "Windows") != 0 ||
+			strcmp(ua_info->device.family, "UapTest Device") != 0 ||
+			provenance.user_agent.rule_index != 0 ||
+			provenance.device.rule_index != 1000000) {
+		fprintf(stderr, "native rules gave %s %s / %s / %s\n",
+				ua_info->user_agent.family, ua_info->user_agent.major, ua_info->os.family, ua_info->device.family);
+		exit(1);
+	}
+
+	// Expressions keep their positions with native rules ahead of them
+	struct uap_parser *plain_parser = load_parser(NULL);
+	struct uap_provenance plain;
+	user_agent = "Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0";
+	uap_parser_parse_string_provenance(ua_parser, ua_info, user_agent, strlen(user_agent), &provenance);
+	uap_parser_parse_string_provenance(plain_parser, ua_info, user_agent, strlen(user_agent), &plain);
+	uap_parser_destroy(plain_parser);
+
+	if (!provenance.user_agent.matched || provenance.user_agent.rule_index != plain.user_agent.rule_index) {
+		fprintf(stderr, "native rules moved expression %u to %u\n", plain.user_agent.rule_index, provenance.user_agent.rule_index);
+		exit(1);
+	}
+
+	// Rules can't be added once the expressions are loaded
+	if (uap_parser_add_rule(ua_parser, UAP_GROUP_OS, 0, &uap_test_rule, "UapTest OS")) {
+		fprintf(stderr, "native rule added after loading\n");
+		exit(1);
+	}
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+}
+
+
+// Memoized parses must agree with plain ones, repeated or not
+static void run_parse_memo_tests(struct uap_parser *ua_parser) {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.",
+		"",
+		"",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	struct uap_parse_memo memo;
+	uap_parse_memo_init(&memo);
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running parse memo tests ...  ");
+
+	for (size_t i = 0; i < num_user_agents; i++) {
+		const int matched = uap_parser_parse_string(ua_parser, ua_info, user_agents[i]);
+		const int memo_matched = uap_parser_parse_memo(ua_parser, &memo, user_agents[i], strlen(user_agents[i]));
+
+		int same = matched == memo_matched;
+		for (int field = 0; same && matched && field < UAP_NUM_FIELDS; field++) {
+			same = strcmp(((const char **)ua_info)[field], ((const char **)&memo.info)[field]) == 0;
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\nmemoized parse of \"%s\" differs\n", user_agents[i]);
+		}
+	}
+
+	// A reload, likely at the old parser's address, must not answer from the
+	// old rules
+	static const char old_rules[] = "user_agent_parsers:\n  - regex: '(Memo)'\n    family_replacement: 'Old'\n";
+	static const char new_rules[] = "user_agent_parsers:\n  - regex: '(Memo)'\n    family_replacement: 'New'\n";
+
+	struct uap_parser *reloaded = uap_parser_create();
+	uap_parser_read_buffer(reloaded, (const unsigned char *)old_rules, sizeof(old_rules) - 1);
+	uap_parser_parse_memo(reloaded, &memo, "Memo", 4);
+	num_passed += strcmp(memo.info.user_agent.family, "Old") == 0;
+	uap_parser_destroy(reloaded);
+
+	reloaded = uap_parser_create();
+	uap_parser_read_buffer(reloaded, (const unsigned char *)new_rules, sizeof(new_rules) - 1);
+	uap_parser_parse_memo(reloaded, &memo, "Memo", 4);
+	num_passed += strcmp(memo.info.user_agent.family, "New") == 0;
+	uap_parser_destroy(reloaded);
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parse_memo_cleanup(&memo);
+
+	if ((size_t)num_passed != num_user_agents + 2) {
+		fprintf(stderr, "%d FAILED\n", (int)num_user_agents + 2 - num_passed);
+		exit(1);
+	}
+}
+
+
+// One info reused for short and long results must match a fresh one each
+// time, with the field lengths filled in, and again after shrinking. A
+// result which fits must go in the buffer already there.
+static void run_info_reuse_tests(struct uap_parser *ua_parser) {
+	char long_version[400];
+	memset(long_version, '9', sizeof(long_version));
+
+	char long_user_agent[512];
+	snprintf(long_user_agent, sizeof(long_user_agent), "Mozilla/5.0 (X11; Linux x86_64) Firefox/%.*s.%.*s",
+			300, long_version, 150, long_version);
+
+	const char *const user_agents[] = {
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		long_user_agent,
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		long_user_agent,
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	struct uap_useragent_info reused;
+	uap_useragent_info_init(&reused);
+	int num_passed = 0;
+
+	printf("Running result reuse tests ...  ");
+
+	int num_fits = 0;
+
+	for (size_t i = 0; i < num_user_agents; i++) {
+		struct uap_useragent_info *ua_info = uap_useragent_info_create();
+		const char *strings = reused.strings;
+		const size_t strings_capacity = reused.strings_capacity;
+
+		const int matched = uap_parser_parse_string(ua_parser, ua_info, user_agents[i]);
+		const int reused_matched = uap_parser_parse_string(ua_parser, &reused, user_agents[i]);
+		const char *parsed_strings = reused.strings;
+		const size_t capacity = reused.strings_capacity;
+
+		// The iPhone result is shorter than the long one, and the second long
+		// one the same length
+		const int fits = strings && reused.strings_used <= strings_capacity;
+		num_fits += fits;
+
+		// Shrinking the second time round keeps the result
+		if (i % 2) {
+			uap_useragent_info_shrink(&reused);
+		}
+
+		int same = matched == reused_matched && matched > 0 &&
+			reused.strings_used <= reused.strings_capacity &&
+			reused.strings_capacity == (i % 2 ? reused.strings_used : capacity) &&
+			(!fits || (parsed_strings == strings && capacity == strings_capacity));
+
+		for (int field = 0; same && field < UAP_NUM_FIELDS; field++) {
+			const char *value = ((const char **)&reused)[field];
+			same = strcmp(((const char **)ua_info)[field], value) == 0 && strlen(value) == reused.length[field];
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\nreused parse of \"%.40s\" differs\n", user_agents[i]);
+		}
+
+		uap_useragent_info_destroy(ua_info);
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_cleanup(&reused);
+
+	if (num_fits < 2) {
+		fprintf(stderr, "only %d results were parsed into the buffer already there\n", num_fits);
+		exit(1);
+	}
+
+	if ((size_t)num_passed != num_user_agents) {
+		fprintf(stderr, "%d FAILED\n", (int)num_user_agents - num_passed);
+		exit(1);
+	}
+}
+
+
+// Compares inline results, after a copy, with the regular ones. Fields
+// which don't fit must be empty and flagged.
+static void run_parse_inline_tests(struct uap_parser *ua_parser) {
+	char long_version[400];
+	memset(long_version, '9', sizeof(long_version));
+
+	char long_user_agent[512];
+	snprintf(long_user_agent, sizeof(long_user_agent), "Mozilla/5.0 (X11; Linux x86_64) Firefox/%.*s.%.*s",
+			300, long_version, 150, long_version);
+
+	const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"",
+		long_user_agent,
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running inline result tests ...  ");
+
+	for (size_t i = 0; i < num_user_agents; i++) {
+		struct uap_inline_info parsed, copy;
+		const int matched = uap_parser_parse_string(ua_parser, ua_info, user_agents[i]);
+		const int inline_matched = uap_parser_parse_inline(ua_parser, &parsed, user_agents[i], strlen(user_agents[i]));
+		memcpy(&copy, &parsed, sizeof(copy));
+
+		// Only the last user agent has a version too long to fit
+		int same = matched == inline_matched && copy.matched == matched && copy.overflow == (user_agents[i] == long_user_agent);
+		for (int field = 0; same && matched && field < UAP_NUM_FIELDS; field++) {
+			const char *value = copy.data + copy.offset[field];
+			same = strlen(value) == copy.length[field] &&
+				(strcmp(((const char **)ua_info)[field], value) == 0 || (copy.overflow && !copy.length[field]));
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\ninline parse of \"%.40s\" differs\n", user_agents[i]);
+		}
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+
+	if ((size_t)num_passed != num_user_agents) {
+		fprintf(stderr, "%d FAILED\n", (int)num_user_agents - num_passed);
+		exit(1);
+	}
+}
+
+
+// Parses a column cycling through a few user agents, with every seventh row
+// null, and compares each row with parsing its user agent alone
+static void run_parse_batch_tests(struct uap_parser *ua_parser, const int num_threads) {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36",
+		"zq-batch-probe",
+		"",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	// What parse_batch gives a user agent which matches nothing
+	static const char *const unmatched[UAP_NUM_FIELDS] = {
+		"Other", "", "", "",
+		"Other", "", "", "", "",
+		"Other", "", "",
+	};
+
+	enum { num_rows = 1201 }; // enough for four tasks
+	static char data[num_rows * 160];
+	static int32_t offsets[num_rows + 1];
+	static uint8_t validity[(num_rows + 7) / 8];
+	size_t used = 0;
+
+	memset(validity, 0, sizeof(validity));
+	for (size_t row = 0; row < num_rows; row++) {
+		if (row % 7 != 3) {
+			const size_t length = strlen(user_agents[row % num_user_agents]);
+			memcpy(data + used, user_agents[row % num_user_agents], length);
+			used += length;
+			validity[row / 8] |= 1 << (row % 8);
+		}
+		offsets[row + 1] = (int32_t)used;
+	}
+
+	const struct uap_string_column input = { num_rows, offsets, data, validity };
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_result_columns output;
+	int num_passed = 0;
+
+	printf("Running batch tests (%d threads) ...  ", num_threads);
+
+	if (uap_parser_parse_batch(ua_parser, &input, &output, num_threads) && output.length == num_rows) {
+		for (size_t row = 0; row < num_rows; row++) {
+			const int valid = output.validity && (output.validity[row / 8] >> (row % 8)) & 1;
+			int same = valid == (row % 7 != 3);
+
+			if (valid) {
+				const char *const *expected = unmatched;
+				if (uap_parser_parse_string(ua_parser, ua_info, user_agents[row % num_user_agents]) > 0) {
+					expected = (const char **)ua_info;
+				}
+
+				for (int field = 0; same && field < UAP_NUM_FIELDS; field++) {
+					const int32_t *field_offsets = output.offsets[field];
+					const size_t length = strlen(expected[field]);
+					same = (size_t)(field_offsets[row + 1] - field_offsets[row]) == length &&
+						memcmp(output.data[field] + field_offsets[row], expected[field], length) == 0;
+				}
+			}
+
+			if (same) {
+				num_passed++;
+			} else {
+				fprintf(stderr, "\nbatch row %zu differs\n", row);
+			}
+		}
+
+		uap_result_columns_cleanup(&output);
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+
+	if (num_passed != num_rows) {
+		fprintf(stderr, "%d FAILED\n", num_rows - num_passed);
+		exit(1);
+	}
+}
+
+
+// Parses a dictionary with a null value, an unreferenced value and a null
+// row, then one with an index outside the dictionary
+static void run_parse_dictionary_tests(struct uap_parser *ua_parser) {
+	static const char dictionary_data[] =
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0"
+		"unreferenced"
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1";
+	static const int32_t dictionary_offsets[] = { 0, 80, 92, 92, sizeof(dictionary_data) - 1 };
+	static const uint8_t dictionary_validity[] = { 0x0b }; // value 2 is null
+	static const int32_t indices[] = { 3, 0, 2, 3, 3, 1 };
+	static const uint8_t validity[] = { 0x1f };            // the last row is null
+
+	struct uap_dictionary_column input = {
+		.length   = 6,
+		.indices  = indices,
+		.validity = validity,
+		.dictionary = { 4, dictionary_offsets, dictionary_data, dictionary_validity },
+	};
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_result_columns output;
+	int num_passed = 0;
+
+	printf("Running dictionary batch tests ...  ");
+
+	if (uap_parser_parse_dictionary(ua_parser, &input, &output, 2)) {
+		num_passed += output.length == 4 && output.validity && output.validity[0] == 0x09;
+
+		for (int value = 0; value < 4; value += 3) {
+			const char *ua = dictionary_data + dictionary_offsets[value];
+			char user_agent[256];
+			snprintf(user_agent, sizeof(user_agent), "%.*s", dictionary_offsets[value + 1] - dictionary_offsets[value], ua);
+			uap_parser_parse_string(ua_parser, ua_info, user_agent);
+
+			int same = 1;
+			for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+				const int32_t *offsets = output.offsets[field];
+				const char *expected = ((const char **)ua_info)[field];
+				same = same && (size_t)(offsets[value + 1] - offsets[value]) == strlen(expected) &&
+					memcmp(output.data[field] + offsets[value], expected, strlen(expected)) == 0;
+			}
+			num_passed += same;
+		}
+
+		uap_result_columns_cleanup(&output);
+	}
+
+	const int32_t bad_indices[] = { 0, 4 };
+	input.length = 2;
+	input.indices = bad_indices;
+	num_passed += !uap_parser_parse_dictionary(ua_parser, &input, &output, 0);
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+
+	if (num_passed != 4) {
+		fprintf(stderr, "%d FAILED\n", 4 - num_passed);
+		exit(1);
+	}
+}
+
+
+// Splits each user agent at every few bytes, plus empty segments, and
+// compares with parsing it whole
+static void run_parse_iov_tests(struct uap_parser *ua_parser) {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+	static const size_t strides[] = { 0, 1, 7, 64 };
+	const size_t num_strides = sizeof(strides) / sizeof(strides[0]);
+
+	// Longer than fits on the stack, to go through the parser's scratch buffers
+	char long_user_agent[2048];
+	memset(long_user_agent, 'x', sizeof(long_user_agent));
+	memcpy(long_user_agent, user_agents[1], strlen(user_agents[1]));
+	long_user_agent[sizeof(long_user_agent) - 1] = '\0';
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_useragent_info *iov_info = uap_useragent_info_create();
+	struct iovec iov[2 * sizeof(long_user_agent) + 1];
+	int num_passed = 0;
+
+	printf("Running scatter-gather tests ...  ");
+
+	for (size_t i = 0; i <= num_user_agents; i++) {
+		char *user_agent = i < num_user_agents ? (char *)user_agents[i] : long_user_agent;
+		const size_t length = strlen(user_agent);
+		const int matched = uap_parser_parse_string(ua_parser, ua_info, user_agent);
+
+		for (size_t j = 0; j < num_strides; j++) {
+			// A stride of 0 is the whole user agent in one segment
+			const size_t stride = strides[j] ? strides[j] : length + 1;
+			int iovcnt = 0;
+
+			iov[iovcnt++] = (struct iovec){ user_agent, 0 };
+			for (size_t pos = 0; pos < length; pos += stride) {
+				iov[iovcnt++] = (struct iovec){ user_agent + pos, length - pos < stride ? length - pos : stride };
+				iov[iovcnt++] = (struct iovec){ NULL, 0 };
+			}
+
+			const int iov_matched = uap_parser_parse_iov(ua_parser, iov_info, iov, iovcnt);
+
+			int same = matched == iov_matched;
+			for (int field = 0; same && matched && field < UAP_NUM_FIELDS; field++) {
+				same = strcmp(((const char **)ua_info)[field], ((const char **)iov_info)[field]) == 0;
+			}
+
+			if (same) {
+				num_passed++;
+			} else {
+				fprintf(stderr, "\nparse of \"%.40s\" in %zu byte segments differs\n", user_agent, stride);
+			}
+		}
+	}
+
+	// The buffer is kept for reuse, counted, and the first thing a budget sheds
+	struct uap_memory_usage kept, shed;
+	uap_parser_memory_usage(ua_parser, &kept);
+	num_passed += kept.scratch >= sizeof(long_user_agent);
+	num_passed += uap_parser_set_memory_budget(ua_parser, kept.total - kept.scratch) &&
+		uap_parser_memory_usage(ua_parser, &shed) && shed.scratch == 0 && shed.total == kept.total - kept.scratch;
+	uap_parser_set_memory_budget(ua_parser, kept.budget);
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_useragent_info_destroy(iov_info);
+
+	if ((size_t)num_passed != (num_user_agents + 1) * num_strides + 2) {
+		fprintf(stderr, "%d FAILED\n", (int)((num_user_agents + 1) * num_strides + 2) - num_passed);
+		exit(1);
+	}
+}
+
+
+// A parser loaded over budget must have shed every optional cache, JIT and
+// variant, keeping its workload tracking, and fit again once the budget
+// covers what's left
+static void run_memory_budget_tests(struct uap_parser *ua_parser) {
+	struct uap_memory_usage shed, refit;
+	int num_passed = 0;
+
+	printf("Running memory budget tests ...  ");
+
+	num_passed += !uap_parser_memory_usage(ua_parser, &shed) && shed.budget == 1;
+	num_passed += shed.caches == 0 && shed.jit == 0 && shed.variants == 0;
+	num_passed += shed.workload > 0 && shed.rules > 0 && shed.strings > 0;
+
+	// Nothing left to shed
+	num_passed += !uap_parser_set_memory_budget(ua_parser, 1);
+
+	num_passed += uap_parser_set_memory_budget(ua_parser, shed.total) &&
+		uap_parser_memory_usage(ua_parser, &refit) && refit.total == shed.total;
+
+	printf("%d PASSED\n", num_passed);
+
+	if (num_passed != 5) {
+		fprintf(stderr, "%d FAILED\n", 5 - num_passed);
+		exit(1);
+	}
+}
+
+
+// Counted parses must give the plain result, and the same nonzero cost
+// every time a user agent is parsed
+// Negative cache counters summed over the three groups
+static struct uap_negative_cache_stats negative_cache_totals(const struct uap_parser *ua_parser) {
+	struct uap_negative_cache_stats stats[3], total = { 0 };
+
+	if (!uap_parser_negative_cache_stats(ua_parser, stats)) {
+		fprintf(stderr, "parser has no negative cache\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		total.lookups += stats[i].lookups;
+		total.hits += stats[i].hits;
+		total.inserts += stats[i].inserts;
+		total.bytes += stats[i].bytes;
+	}
+
+	return total;
+}
+
+
+// The base tests parse the same user agents each pass, so everything the
+// first pass recorded as falling through is answered from the cache on the
+// second, which records nothing new. A user agent matching no expression
+// at all misses once, then hits in every group.
+static void run_negative_cache_tests(
+		const struct uap_parser *ua_parser,
+		const struct uap_negative_cache_stats first_pass,
+		const struct uap_negative_cache_stats second_pass) {
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running negative cache tests ...  ");
+
+	num_passed += first_pass.inserts > 0 && first_pass.bytes > 0;
+	num_passed += second_pass.inserts == first_pass.inserts;
+	num_passed += second_pass.hits - first_pass.hits >= first_pass.inserts;
+	num_passed += second_pass.lookups - first_pass.lookups == first_pass.lookups;
+
+	const char *unknown = "zq-negative-cache-probe";
+	const int first_match = uap_parser_parse_string(ua_parser, ua_info, unknown);
+	const struct uap_negative_cache_stats missed = negative_cache_totals(ua_parser);
+	const int second_match = uap_parser_parse_string(ua_parser, ua_info, unknown);
+	const struct uap_negative_cache_stats hit = negative_cache_totals(ua_parser);
+
+	num_passed += missed.inserts - second_pass.inserts == 3 && missed.hits == second_pass.hits;
+	num_passed += hit.hits - missed.hits == 3 && hit.inserts == missed.inserts;
+	num_passed += first_match == second_match;
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+
+	if (num_passed != 7) {
+		fprintf(stderr, "%d FAILED\n", 7 - num_passed);
+		exit(1);
+	}
+}
+
+
+static void run_parse_cost_tests(struct uap_parser *ua_parser) {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_useragent_info *cost_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running parse cost tests ...  ");
+
+	for (size_t i = 0; i < num_user_agents; i++) {
+		const size_t length = strlen(user_agents[i]);
+		struct uap_parse_cost first, cost;
+
+		const int matched = uap_parser_parse_string(ua_parser, ua_info, user_agents[i]);
+		const int cost_matched = uap_parser_parse_string_cost(ua_parser, cost_info, user_agents[i], length, &first);
+
+		int same = matched == cost_matched && matched > 0 && first.rules_tried > 0 && first.match_steps > 0;
+		for (int field = 0; same && field < UAP_NUM_FIELDS; field++) {
+			same = strcmp(((const char **)ua_info)[field], ((const char **)cost_info)[field]) == 0;
+		}
+
+		for (int run = 0; same && run < 3; run++) {
+			uap_parser_parse_string_cost(ua_parser, cost_info, user_agents[i], length, &cost);
+			same = cost.rules_tried == first.rules_tried && cost.match_steps == first.match_steps;
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\ncost of \"%.40s\" is missing or varies\n", user_agents[i]);
+		}
+	}
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_useragent_info_destroy(cost_info);
+
+	if ((size_t)num_passed != num_user_agents) {
+		fprintf(stderr, "%d FAILED\n", (int)num_user_agents - num_passed);
+		exit(1);
+	}
+}
+
+
+// Merged expressions must report the same rules and spans as the
+// expressions they were merged from, with spans inside the user agent
+static void run_provenance_tests(struct uap_parser *ua_parser, struct uap_parser *merged_parser) {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36",
+		"Opera/9.80 (J2ME/MIDP; Opera Mini/9.80 (S60; SymbOS; Opera Mobi/23.348; U; en) Presto/2.5.25 Version/10.54",
+		"",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	int num_passed = 0;
+
+	printf("Running provenance tests ...  ");
+
+	for (size_t i = 0; i < num_user_agents; i++) {
+		const int length = (int)strlen(user_agents[i]);
+		struct uap_provenance plain, merged;
+
+		const int matched = uap_parser_parse_string_provenance(ua_parser, ua_info, user_agents[i], length, &plain);
+		const int merged_matched = uap_parser_parse_string_provenance(merged_parser, ua_info, user_agents[i], length, &merged);
+
+		const struct uap_match_provenance *groups[][2] = {
+			{ &plain.user_agent, &merged.user_agent },
+			{ &plain.os, &merged.os },
+			{ &plain.device, &merged.device },
+		};
+
+		int same = matched == merged_matched &&
+			matched == plain.user_agent.matched + plain.os.matched + plain.device.matched;
+
+		for (int group = 0; same && group < 3; group++) {
+			const struct uap_match_provenance *a = groups[group][0];
+			const struct uap_match_provenance *b = groups[group][1];
+
+			same = a->matched == b->matched &&
+				(a->rules_tried > 0 || !a->matched) &&
+				(!a->matched || (a->rule_index == b->rule_index && a->fingerprint == b->fingerprint &&
+					a->num_spans == b->num_spans && a->num_spans > 0));
+
+			for (int span = 0; same && a->matched && span < a->num_spans; span++) {
+				same = a->span[span].start == b->span[span].start &&
+					a->span[span].end == b->span[span].end &&
+					a->span[span].start <= a->span[span].end &&
+					a->span[span].end <= length;
+			}
+		}
+
+		if (same) {
+			num_passed++;
+		} else {
+			fprintf(stderr, "\nprovenance of \"%.40s\" differs\n", user_agents[i]);
+		}
+	}
+
+	// Firefox is the 8th user agent expression in the fixture, Windows 10
+	// the first OS one
+	struct uap_provenance firefox;
+	uap_parser_parse_string_provenance(ua_parser, ua_info, user_agents[1], strlen(user_agents[1]), &firefox);
+	num_passed += firefox.user_agent.rule_index == 7 && firefox.os.rule_index == 0;
+
+	// Expressions which fail to compile still count
+	static const char regexes[] =
+		"user_agent_parsers:\n"
+		"  - regex: '(Broken'\n"
+		"  - regex: '(Fixed)/(\\d+)'\n";
+
+	struct uap_parser *gap_parser = uap_parser_create();
+	struct uap_provenance fixed;
+	uap_parser_read_buffer(gap_parser, (const unsigned char *)regexes, sizeof(regexes) - 1);
+	uap_parser_parse_string_provenance(gap_parser, ua_info, "Fixed/1", 7, &fixed);
+	num_passed += fixed.user_agent.matched && fixed.user_agent.rule_index == 1;
+	uap_parser_destroy(gap_parser);
+
+	// A merged run whose result ignores captures is matched as plain
+	// alternation, where the later expression matches first in the string;
+	// the earlier expression still has to be the one named
+	static const char same_result[] =
+		"user_agent_parsers:\n"
+		"  - regex: 'Zeta'\n"
+		"    family_replacement: 'Spider'\n"
+		"  - regex: 'Alpha'\n"
+		"    family_replacement: 'Spider'\n";
+
+	const struct uap_parser_options merge = { .flags = UAP_PARSER_MERGE_RULES };
+	struct uap_parser *run_parser = uap_parser_create_with_options(&merge);
+	struct uap_provenance zeta;
+	uap_parser_read_buffer(run_parser, (const unsigned char *)same_result, sizeof(same_result) - 1);
+	uap_parser_parse_string_provenance(run_parser, ua_info, "Alpha Zeta", 10, &zeta);
+	num_passed += zeta.user_agent.matched && zeta.user_agent.rule_index == 0 &&
+		zeta.user_agent.span[0].start == 6 && zeta.user_agent.span[0].end == 10 &&
+		strcmp(ua_info->user_agent.family, "Spider") == 0;
+	uap_parser_destroy(run_parser);
+
+	printf("%d PASSED\n", num_passed);
+
+	uap_useragent_info_destroy(ua_info);
+
+	if ((size_t)num_passed != num_user_agents + 3) {
+		fprintf(stderr, "%d FAILED\n", (int)num_user_agents + 3 - num_passed);
+		exit(1);
+	}
+}
+
+
+static int _compare_profile_entries(const void *a, const void *b) {
+	return memcmp(a, b, 24);
+}
+
+
+// Writes the parser's profile after parsing `user_agents`, then reads the
+// entries back sorted, for comparing profiles entry by entry. Returns the
+// number of entries, or -1.
+static int _profile_entries(
+		struct uap_parser *ua_parser,
+		const char *const *user_agents,
+		const size_t count,
+		unsigned char entries[][24],
+		const int max_entries)
+{
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	uap_parser_collect_rule_stats(ua_parser, 1);
+	for (size_t i = 0; i < count; i++) {
+		uap_parser_parse_string(ua_parser, ua_info, user_agents[i]);
+	}
+	uap_useragent_info_destroy(ua_info);
+
+	FILE *profile = tmpfile();
+	unsigned char header[16];
+	int num_entries = -1;
+
+	if (uap_parser_write_profile(ua_parser, profile)) {
+		rewind(profile);
+		num_entries = fread(header, 16, 1, profile) == 1 ? (int)fread(entries, 24, max_entries, profile) : -1;
+		qsort(entries, num_entries > 0 ? num_entries : 0, 24, &_compare_profile_entries);
+	}
+
+	fclose(profile);
+	return num_entries;
+}
+
+
+// Profiles hold an entry per expression in regexes.yaml whether or not the
+// parser writing or loading them merges expressions, so they carry over
+// both ways with the same counts
+static void run_merged_profile_tests() {
+	static const char *const user_agents[] = {
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36",
+		"Opera/9.80 (J2ME/MIDP; Opera Mini/9.80 (S60; SymbOS; Opera Mobi/23.348; U; en) Presto/2.5.25 Version/10.54",
+		"Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)",
+		"curl/8.4.0",
+		"",
+	};
+	const size_t num_user_agents = sizeof(user_agents) / sizeof(user_agents[0]);
+	const struct uap_parser_options merge = { .flags = UAP_PARSER_MERGE_RULES };
+
+	unsigned char plain_entries[256][24], merged_entries[256][24];
+	int num_passed = 0;
+
+	printf("Running merged profile tests ...  ");
+
+	struct uap_parser *plain_parser = load_parser(NULL);
+	struct uap_parser *merged_parser = load_parser(&merge);
+	const int num_plain = _profile_entries(plain_parser, user_agents, num_user_agents, plain_entries, 256);
+	const int num_merged = _profile_entries(merged_parser, user_agents, num_user_agents, merged_entries, 256);
+
+	num_passed += num_plain > 0 && num_plain == num_merged;
+	num_passed += num_plain == num_merged && memcmp(plain_entries, merged_entries, (size_t)num_plain * 24) == 0;
+
+	// Each way round, every expression is found in the other's profile
+	for (int way = 0; way < 2; way++) {
+		struct uap_parser *writer = way ? merged_parser : plain_parser;
+		struct uap_parser *loader = way ? load_parser(NULL) : load_parser(&merge);
+
+		FILE *profile = tmpfile();
+		uap_parser_write_profile(writer, profile);
+		rewind(profile);
+		num_passed += uap_parser_load_profile(loader, profile) == num_plain;
+		fclose(profile);
+
+		uap_parser_destroy(loader);
+	}
+
+	uap_parser_destroy(plain_parser);
+	uap_parser_destroy(merged_parser);
+
+	printf("%d PASSED\n", num_passed);
+
+	if (num_passed != 4) {
+		fprintf(stderr, "%d FAILED\n", 4 - num_passed);
+		exit(1);
+	}
+}
+
+
 int main(int argc, char** argv) {
 	(void)argc;
 	(void)argv;
 
 
-	struct uap_parser *ua_parser = uap_parser_create();
-	FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
-	if (fd != NULL) {
-		uap_parser_read_file(ua_parser, fd);
-		fclose(fd);
-	} else {
-		uap_parser_destroy(ua_parser);
+	struct uap_parser *ua_parser = load_parser(NULL);
+	if (ua_parser == NULL) {
 		return -1;
 	}
 
+	uap_parser_collect_rule_stats(ua_parser, 1);
+
+	run_tokenizer_tests();
+	run_simd_tests();
+	run_pattern_lowercase_tests();
+	run_replacement_trim_tests();
+	run_read_error_tests();
+
 	// Base tests
-	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
-	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
-	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+	run_base_tests(ua_parser);
+	run_parse_memo_tests(ua_parser);
+	run_info_reuse_tests(ua_parser);
+	run_parse_iov_tests(ua_parser);
+	run_parse_inline_tests(ua_parser);
+	run_parse_batch_tests(ua_parser, 1);
+	run_parse_batch_tests(ua_parser, 4);
+	run_parse_dictionary_tests(ua_parser);
 
 	// Additional tests
 	run_test_file("../uap-core/test_resources/firefox_user_agent_strings.yaml", 0, ua_parser, &get_field_index_for_ua_test);
@@ -222,6 +1430,282 @@ int main(int argc, char** argv) {
 	run_test_file("../uap-core/test_resources/pgts_browser_list.yaml", 0, ua_parser, &get_field_index_for_ua_test);
 	// ^ this thing is 2MB of user agent strings, and so it takes forever to run.
 
+	// Reordering by the hit counts gathered above must not change any results
+	printf("Reordered %d expressions\n", uap_parser_reorder_rules(ua_parser));
+	run_base_tests(ua_parser);
+
+	uap_parser_destroy(ua_parser);
+
+	// Neither should the load-time optimizations
+	const struct uap_parser_options merged = { .flags = UAP_PARSER_MERGE_RULES };
+	ua_parser = load_parser(&merged);
+	puts("Merged expressions");
+	run_base_tests(ua_parser);
+
+	struct uap_parser *unmerged_parser = load_parser(NULL);
+	run_provenance_tests(unmerged_parser, ua_parser);
+	uap_parser_destroy(unmerged_parser);
+	uap_parser_destroy(ua_parser);
+
+	const struct uap_parser_options ascii = { .flags = UAP_PARSER_ASCII_RULES };
+	ua_parser = load_parser(&ascii);
+	puts("Byte-mode expressions");
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// Second pass answers fall-throughs from the negative cache
+	const struct uap_parser_options cached = { .negative_cache_entries = 4096 };
+	ua_parser = load_parser(&cached);
+	uap_parser_collect_rule_stats(ua_parser, 1);
+	puts("Negative cache");
+	run_base_tests(ua_parser);
+	const struct uap_negative_cache_stats first_pass = negative_cache_totals(ua_parser);
+	run_base_tests(ua_parser);
+	const struct uap_negative_cache_stats second_pass = negative_cache_totals(ua_parser);
+	run_negative_cache_tests(ua_parser, first_pass, second_pass);
+	uap_parser_destroy(ua_parser);
+
+	const struct uap_parser_options counted = { .flags = UAP_PARSER_COUNT_STEPS };
+	ua_parser = load_parser(&counted);
+	puts("Step counting");
+	run_base_tests(ua_parser);
+	run_parse_cost_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// A budget too small for anything optional sheds it all
+	const struct uap_parser_options budgeted = {
+		.flags = UAP_PARSER_ASCII_RULES,
+		.negative_cache_entries = 4096,
+		.memory_budget = 1,
+		.workload_sampling = 1,
+	};
+	ua_parser = load_parser(&budgeted);
+	puts("Memory budget");
+	run_memory_budget_tests(ua_parser);
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// Batches split into `concurrency` tasks, whichever callback runs them
+	struct executor_calls submitted = { 0 }, looped = { 0 };
+	const struct uap_parser_options executed = {
+		.flags = UAP_PARSER_ASCII_RULES,
+		.executor = { .submit = &inline_submit, .concurrency = 4, .context = &submitted },
+	};
+	ua_parser = load_parser(&executed);
+	puts("Executor, submit");
+	run_base_tests(ua_parser);
+	submitted = (struct executor_calls){ 0 };
+	run_parse_batch_tests(ua_parser, 0);
+	uap_parser_destroy(ua_parser);
+
+	const struct uap_parser_options looping = {
+		.flags = UAP_PARSER_ASCII_RULES,
+		.executor = { .parallel_for = &reverse_parallel_for, .submit = &inline_submit, .concurrency = 4, .context = &looped },
+	};
+	ua_parser = load_parser(&looping);
+	puts("Executor, parallel_for");
+	run_base_tests(ua_parser);
+	looped = (struct executor_calls){ 0 };
+	run_parse_batch_tests(ua_parser, 0);
+	uap_parser_destroy(ua_parser);
+
+	// The caller takes one of the submit executor's tasks itself
+	if (submitted.calls != 3 || looped.calls != 1 || looped.tasks != 4) {
+		fprintf(stderr, "batch ran %d submit calls, %d parallel_for calls of %zu tasks\n",
+				submitted.calls, looped.calls, looped.tasks);
+		exit(1);
+	}
+
+	// Without rule stats there are no counts to write. A profile of one
+	// user agent, loaded up front by a new parser, JIT compiles the
+	// expressions it tried and leaves those after its matches for later.
+	ua_parser = load_parser(NULL);
+	struct uap_memory_usage plain, profiled;
+	uap_parser_memory_usage(ua_parser, &plain);
+
+	FILE *profile = tmpfile();
+	if (uap_parser_write_profile(ua_parser, profile)) {
+		fprintf(stderr, "profile written without rule stats\n");
+		exit(1);
+	}
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	uap_parser_collect_rule_stats(ua_parser, 1);
+	uap_parser_parse_string(ua_parser, ua_info,
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0");
+	uap_useragent_info_destroy(ua_info);
+
+	const int written = uap_parser_write_profile(ua_parser, profile);
+	uap_parser_destroy(ua_parser);
+	rewind(profile);
+
+	ua_parser = uap_parser_create();
+	const int loaded = uap_parser_load_profile(ua_parser, profile);
+	fclose(profile);
+
+	FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
+	uap_parser_read_file(ua_parser, fd);
+	fclose(fd);
+
+	uap_parser_memory_usage(ua_parser, &profiled);
+	if (!written || loaded != 0 || profiled.jit <= plain.jit || profiled.rules >= plain.rules) {
+		fprintf(stderr, "profile didn't JIT compile hot expressions and defer cold ones\n");
+		exit(1);
+	}
+
+	puts("Rule profile");
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+	run_merged_profile_tests();
+
+	// A profile of no traffic defers every expression, and warming up
+	// compiles them all
+	ua_parser = load_parser(NULL);
+	uap_parser_collect_rule_stats(ua_parser, 1);
+	profile = tmpfile();
+	const int written_idle = uap_parser_write_profile(ua_parser, profile);
+	uap_parser_destroy(ua_parser);
+	rewind(profile);
+
+	ua_parser = uap_parser_create();
+	const int loaded_idle = uap_parser_load_profile(ua_parser, profile);
+
+	fd = fopen("../uap-core/regexes.yaml", "rb");
+	uap_parser_read_file(ua_parser, fd);
+	fclose(fd);
+
+	if (!written_idle || loaded_idle != 0) {
+		fprintf(stderr, "profile of no traffic wasn't written or loaded\n");
+		exit(1);
+	}
+
+	struct uap_memory_usage cold, warm;
+	uap_parser_memory_usage(ua_parser, &cold);
+	const int warmed = uap_parser_warmup(ua_parser, NULL, 0, 0);
+	uap_parser_memory_usage(ua_parser, &warm);
+
+	if (!warmed || warm.rules <= cold.rules) {
+		fprintf(stderr, "warm-up didn't compile the deferred expressions\n");
+		exit(1);
+	}
+
+	puts("Warmed up");
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// With a budget which fits the parser cold but not warm, warming up must
+	// shed its way back under
+	const struct uap_parser_options warm_cached = { .negative_cache_entries = 4096 };
+	struct uap_memory_usage cold_cached, warm_cached_usage;
+	rewind(profile);
+	ua_parser = uap_parser_create_with_options(&warm_cached);
+	uap_parser_load_profile(ua_parser, profile);
+	fclose(profile);
+
+	fd = fopen("../uap-core/regexes.yaml", "rb");
+	uap_parser_read_file(ua_parser, fd);
+	fclose(fd);
+
+	uap_parser_memory_usage(ua_parser, &cold_cached);
+	const int cold_fits = uap_parser_set_memory_budget(ua_parser, cold_cached.total + (warm.rules - cold.rules) / 2);
+	uap_parser_warmup(ua_parser, NULL, 0, 0);
+
+	if (!cold_fits || !uap_parser_memory_usage(ua_parser, &warm_cached_usage) ||
+			warm_cached_usage.caches >= cold_cached.caches) {
+		fprintf(stderr, "warm-up left the parser over its memory budget\n");
+		exit(1);
+	}
+
+	puts("Warmed up within budget");
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// Tuning must not change results, whichever way each expression ends up
+	// being run
+	static const char *const tuning_corpus[] = {
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+		"Mozilla/5.0 (Linux; Android 13; SM-S918B) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/115.0.0.0 Mobile Safari/537.36",
+		"Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)",
+		"Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0 \xc3\xa9",
+		"curl/8.4.0",
+		"",
+	};
+	ua_parser = load_parser(NULL);
+
+	FILE *report = tmpfile();
+	const int tuned = uap_parser_autotune(ua_parser, tuning_corpus, sizeof(tuning_corpus) / sizeof(tuning_corpus[0]), report);
+	const long report_size = ftell(report);
+
+	// Caseless expressions with a lowercase rewrite are timed through it, as
+	// parsing runs them on ASCII user agents
+	char line[256];
+	bool timed_lowercase = false;
+	rewind(report);
+	while (fgets(line, sizeof(line), report)) {
+		timed_lowercase = timed_lowercase || strstr(line, "\tlowercase\t") != NULL;
+	}
+	fclose(report);
+
+	if (tuned < 0 || report_size <= 0 || !timed_lowercase) {
+		fprintf(stderr, "autotuning failed\n");
+		exit(1);
+	}
+
+	printf("Autotuned %d expressions\n", tuned);
+	run_base_tests(ua_parser);
+	uap_parser_destroy(ua_parser);
+
+	// Timing picks different strategies from run to run, so also force each
+	// one onto every expression able to use it
+	static const char *const strategy_names[] = { "interpreter", "JIT", "DFA", "literal" };
+	static const int strategies[] = {
+		UAP_STRATEGY_INTERPRETER, UAP_STRATEGY_JIT, UAP_STRATEGY_DFA, UAP_STRATEGY_LITERAL,
+	};
+
+	for (int i = 0; i < 4; i++) {
+		ua_parser = load_parser(NULL);
+		const int forced = uap_parser_autotune_force(
+				ua_parser, tuning_corpus, sizeof(tuning_corpus) / sizeof(tuning_corpus[0]), strategies[i]);
+
+		// The interpreter is where every expression starts
+		if (forced < 0 || (strategies[i] != UAP_STRATEGY_INTERPRETER && forced == 0)) {
+			fprintf(stderr, "forcing the %s strategy changed %d expressions\n", strategy_names[i], forced);
+			exit(1);
+		}
+
+		printf("Forced %d expressions to the %s strategy\n", forced, strategy_names[i]);
+		run_base_tests(ua_parser);
+		uap_parser_destroy(ua_parser);
+	}
+
+	run_native_rule_tests();
+
+	// Sampling everything, the curve's tail is the share of first sightings
+	const struct uap_parser_options tracked = { .workload_sampling = 1 };
+	ua_parser = load_parser(&tracked);
+	puts("Workload tracking");
+	run_base_tests(ua_parser);
+	run_base_tests(ua_parser);
+
+	struct uap_workload_stats workload;
+	uap_parser_workload_stats(ua_parser, &workload);
+
+	const double first_seen = workload.miss_ratio[UAP_MISS_RATIO_POINTS - 1] * workload.parses;
+	int curve_ok = workload.parses > 0 && workload.sampled == workload.parses;
+	for (int i = 1; i < UAP_MISS_RATIO_POINTS; i++) {
+		curve_ok = curve_ok && workload.miss_ratio[i] <= workload.miss_ratio[i - 1];
+	}
+
+	printf("%llu parses, %llu distinct, LRU miss ratio %.3f at 64 entries\n",
+			(unsigned long long)workload.parses, (unsigned long long)workload.distinct, workload.miss_ratio[6]);
+
+	if (!curve_ok || workload.distinct < first_seen * 0.95 || workload.distinct > first_seen * 1.05) {
+		fprintf(stderr, "workload stats don't add up\n");
+		exit(1);
+	}
 	uap_parser_destroy(ua_parser);
+
 	return 0;
 }
@@ -0,0 +1,303 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/executor.h"
+#include "uap/uap.h"
+
+// Don't bother spreading tiny batches across threads
+#define BATCH_MIN_ROWS_PER_THREAD 256
+
+
+struct batch_field_buffer {
+	size_t used;
+	size_t capacity;
+	char *data;
+};
+
+
+// A contiguous range of rows parsed by one task. Offsets are written
+// straight into the output columns relative to the chunk's own buffers, and
+// rebased once every chunk's size is known.
+struct batch_chunk {
+	const struct uap_parser *ua_parser;
+	const struct uap_string_column *input;
+	struct uap_result_columns *output;
+	size_t begin;
+	size_t end;
+	struct batch_field_buffer fields[UAP_NUM_FIELDS];
+	bool failed;
+};
+
+
+static bool _batch_field_append(struct batch_field_buffer *buffer, const char *str, const size_t length) {
+	if (length == 0) {
+		return true;
+	}
+
+	if (buffer->used + length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+		while (capacity < buffer->used + length) {
+			capacity *= 2;
+		}
+
+		char *data = realloc(buffer->data, capacity);
+		if (!data) {
+			return false;
+		}
+
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->used, str, length);
+	buffer->used += length;
+	return true;
+}
+
+
+static bool _batch_row_valid(const struct uap_string_column *input, const size_t row) {
+	return !input->validity || (input->validity[row / 8] >> (row % 8)) & 1;
+}
+
+
+static void _batch_info_fields(const struct uap_useragent_info *info, const char *fields[UAP_NUM_FIELDS]) {
+	fields[0]  = info->user_agent.family;
+	fields[1]  = info->user_agent.major;
+	fields[2]  = info->user_agent.minor;
+	fields[3]  = info->user_agent.patch;
+	fields[4]  = info->os.family;
+	fields[5]  = info->os.major;
+	fields[6]  = info->os.minor;
+	fields[7]  = info->os.patch;
+	fields[8]  = info->os.patchMinor;
+	fields[9]  = info->device.family;
+	fields[10] = info->device.brand;
+	fields[11] = info->device.model;
+}
+
+
+static void _batch_chunk_parse(void *arg, const size_t index) {
+	struct batch_chunk *chunk = (struct batch_chunk *)arg + index;
+	const struct uap_string_column *input = chunk->input;
+
+	// What a user agent which matches nothing at all parses to
+	static const char *const unmatched[UAP_NUM_FIELDS] = {
+		"Other", "", "", "",
+		"Other", "", "", "", "",
+		"Other", "", "",
+	};
+	static const size_t unmatched_lengths[UAP_NUM_FIELDS] = { 5, 0, 0, 0, 5, 0, 0, 0, 0, 5, 0, 0 };
+
+	struct uap_useragent_info info;
+	uap_useragent_info_init(&info);
+
+	const char *matched[UAP_NUM_FIELDS];
+
+	for (size_t row = chunk->begin; row < chunk->end && !chunk->failed; row++) {
+		const char *const *fields = unmatched;
+		const size_t *lengths = unmatched_lengths;
+
+		if (_batch_row_valid(input, row)) {
+			const char *ua = input->data + input->offsets[row];
+			const size_t length = input->offsets[row + 1] - input->offsets[row];
+
+			if (uap_parser_parse_string_length(chunk->ua_parser, &info, ua, length) > 0) {
+				_batch_info_fields(&info, matched);
+				fields = matched;
+				lengths = info.length;
+			}
+		} else {
+			fields = NULL;
+		}
+
+		for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+			struct batch_field_buffer *buffer = &chunk->fields[field];
+
+			if (fields && !_batch_field_append(buffer, fields[field], lengths[field])) {
+				chunk->failed = true;
+			}
+
+			chunk->output->offsets[field][row + 1] = (int32_t)buffer->used;
+		}
+	}
+
+	uap_useragent_info_cleanup(&info);
+}
+
+
+static int _batch_thread_count(const struct uap_executor *executor, const size_t rows, int num_threads) {
+	if (num_threads <= 0) {
+		num_threads = executor_concurrency(executor);
+	}
+
+	const size_t useful = (rows + BATCH_MIN_ROWS_PER_THREAD - 1) / BATCH_MIN_ROWS_PER_THREAD;
+	if (useful < (size_t)num_threads) {
+		num_threads = useful > 0 ? (int)useful : 1;
+	}
+
+	return num_threads;
+}
+
+
+int uap_parser_parse_batch(
+		const struct uap_parser *ua_parser,
+		const struct uap_string_column *input,
+		struct uap_result_columns *output,
+		int num_threads)
+{
+	memset(output, 0, sizeof(struct uap_result_columns));
+	output->length = input->length;
+
+	for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+		output->offsets[field] = malloc((input->length + 1) * sizeof(int32_t));
+		if (!output->offsets[field]) {
+			uap_result_columns_cleanup(output);
+			return 0;
+		}
+		output->offsets[field][0] = 0;
+	}
+
+	const struct uap_executor *executor = ua_parser_executor(ua_parser);
+	num_threads = _batch_thread_count(executor, input->length, num_threads);
+
+	struct batch_chunk *chunks = calloc(num_threads, sizeof(struct batch_chunk));
+
+	if (!chunks) {
+		uap_result_columns_cleanup(output);
+		return 0;
+	}
+
+	const size_t rows_per_chunk = input->length / num_threads;
+	const size_t remainder = input->length % num_threads;
+	size_t begin = 0;
+
+	for (int i = 0; i < num_threads; i++) {
+		chunks[i].ua_parser = ua_parser;
+		chunks[i].input     = input;
+		chunks[i].output    = output;
+		chunks[i].begin     = begin;
+		chunks[i].end       = begin + rows_per_chunk + ((size_t)i < remainder ? 1 : 0);
+		begin = chunks[i].end;
+	}
+
+	executor_parallel_for(executor, num_threads, num_threads, &_batch_chunk_parse, chunks);
+
+	// Stitch the chunks together and rebase their offsets
+	bool failed = false;
+
+	for (int field = 0; field < UAP_NUM_FIELDS && !failed; field++) {
+		size_t total = 0;
+		for (int i = 0; i < num_threads; i++) {
+			failed = failed || chunks[i].failed;
+			total += chunks[i].fields[field].used;
+		}
+
+		if (failed || total > INT32_MAX || !(output->data[field] = malloc(total + 1))) {
+			failed = true;
+			break;
+		}
+
+		size_t base = 0;
+		for (int i = 0; i < num_threads; i++) {
+			const struct batch_field_buffer *buffer = &chunks[i].fields[field];
+
+			if (buffer->used) {
+				memcpy(output->data[field] + base, buffer->data, buffer->used);
+			}
+
+			if (base) {
+				for (size_t row = chunks[i].begin; row < chunks[i].end; row++) {
+					output->offsets[field][row + 1] += (int32_t)base;
+				}
+			}
+
+			base += buffer->used;
+		}
+	}
+
+	if (!failed && input->validity) {
+		const size_t bytes = (input->length + 7) / 8;
+		output->validity = malloc(bytes ? bytes : 1);
+		if (output->validity) {
+			memcpy(output->validity, input->validity, bytes);
+		} else {
+			failed = true;
+		}
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+			free(chunks[i].fields[field].data);
+		}
+	}
+	free(chunks);
+
+	if (failed) {
+		uap_result_columns_cleanup(output);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+int uap_parser_parse_dictionary(
+		const struct uap_parser *ua_parser,
+		const struct uap_dictionary_column *input,
+		struct uap_result_columns *output,
+		int num_threads)
+{
+	const size_t dictionary_length = input->dictionary.length;
+	uint8_t *referenced = calloc((dictionary_length + 7) / 8 + 1, 1);
+
+	if (!referenced) {
+		memset(output, 0, sizeof(struct uap_result_columns));
+		return 0;
+	}
+
+	// Only values some row refers to are worth parsing, e.g. a slice of a
+	// column keeps the whole column's dictionary
+	for (size_t row = 0; row < input->length; row++) {
+		if (!input->validity || (input->validity[row / 8] >> (row % 8)) & 1) {
+			const int32_t index = input->indices[row];
+
+			if (index < 0 || (size_t)index >= dictionary_length) {
+				free(referenced);
+				memset(output, 0, sizeof(struct uap_result_columns));
+				return 0;
+			}
+
+			referenced[index / 8] |= 1 << (index % 8);
+		}
+	}
+
+	if (input->dictionary.validity) {
+		for (size_t i = 0; i < (dictionary_length + 7) / 8; i++) {
+			referenced[i] &= input->dictionary.validity[i];
+		}
+	}
+
+	struct uap_string_column dictionary = input->dictionary;
+	dictionary.validity = referenced;
+
+	const int ok = uap_parser_parse_batch(ua_parser, &dictionary, output, num_threads);
+
+	free(referenced);
+	return ok;
+}
+
+
+void uap_result_columns_cleanup(struct uap_result_columns *columns) {
+	for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+		free(columns->offsets[field]);
+		free(columns->data[field]);
+		columns->offsets[field] = NULL;
+		columns->data[field] = NULL;
+	}
+
+	free(columns->validity);
+	columns->validity = NULL;
+}
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "uap/executor.h"
+#include "uap/uap.h"
+
+
+// One parallel_for() call. Every task, including the caller, claims indices
+// until none are left. Queued tasks may start long after the work is done,
+// so the job is freed by whichever holder drops the last reference.
+struct executor_job {
+	void (*fn)(void *arg, size_t index);
+	void *arg;
+	size_t count;
+	size_t next; // next index to claim
+	size_t done; // indices finished
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+};
+
+
+bool executor_present(const struct uap_executor *executor) {
+	return executor && (executor->parallel_for || executor->submit);
+}
+
+
+int executor_concurrency(const struct uap_executor *executor) {
+	if (executor && executor->concurrency > 0) {
+		return executor->concurrency;
+	}
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (int)cpus : 1;
+}
+
+
+static void _job_release(struct executor_job *job) {
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_cond_destroy(&job->finished);
+		pthread_mutex_destroy(&job->lock);
+		free(job);
+	}
+}
+
+
+static void _job_work(struct executor_job *job) {
+	size_t index;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		job->fn(job->arg, index);
+
+		if (__atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL) == job->count) {
+			pthread_mutex_lock(&job->lock);
+			pthread_cond_broadcast(&job->finished);
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+}
+
+
+static void _job_task(void *arg) {
+	_job_work(arg);
+	_job_release(arg);
+}
+
+
+static void *_job_thread(void *arg) {
+	_job_work(arg);
+	return NULL;
+}
+
+
+void executor_parallel_for(
+		const struct uap_executor *executor,
+		const size_t count,
+		size_t max_tasks,
+		void (*fn)(void *arg, size_t index),
+		void *arg)
+{
+	if (count == 0) {
+		return;
+	}
+
+	if (executor && executor->parallel_for) {
+		executor->parallel_for(executor->context, count, fn, arg);
+		return;
+	}
+
+	if (max_tasks > count) {
+		max_tasks = count;
+	}
+
+	struct executor_job *job = malloc(sizeof(struct executor_job));
+	pthread_t *threads = NULL;
+	size_t started = 0;
+
+	if (job) {
+		job->fn    = fn;
+		job->arg   = arg;
+		job->count = count;
+		job->next  = 0;
+		job->done  = 0;
+		job->refs  = 1;
+		pthread_mutex_init(&job->lock, NULL);
+		pthread_cond_init(&job->finished, NULL);
+	}
+
+	if (!job || max_tasks < 2) {
+		// Nothing to share the work with
+		for (size_t i = 0; i < count; i++) {
+			fn(arg, i);
+		}
+
+		if (job) {
+			_job_release(job);
+		}
+		return;
+	}
+
+	if (executor && executor->submit) {
+		for (size_t i = 1; i < max_tasks; i++) {
+			__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+
+			if (!executor->submit(executor->context, &_job_task, job)) {
+				__atomic_sub_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	} else {
+		threads = malloc((max_tasks - 1) * sizeof(pthread_t));
+
+		for (size_t i = 1; threads && i < max_tasks; i++) {
+			if (pthread_create(&threads[started], NULL, &_job_thread, job) != 0) {
+				break;
+			}
+			started++;
+		}
+	}
+
+	// Whatever the other tasks haven't claimed gets done here, so this only
+	// ever waits for calls already running elsewhere.
+	_job_work(job);
+
+	pthread_mutex_lock(&job->lock);
+	while (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) < count) {
+		pthread_cond_wait(&job->finished, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	_job_release(job);
+}
@@ -0,0 +1,146 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/negative_cache.h"
+
+#define NEGATIVE_CACHE_SLOTS 4            // slots per bucket, 32 bytes
+#define NEGATIVE_CACHE_MAX_BUCKETS (1 << 24) // bucket index bits must not overlap the fingerprint
+#define NEGATIVE_CACHE_LENGTH_BITS 24
+
+
+struct negative_cache_bucket {
+	uint64_t slots[NEGATIVE_CACHE_SLOTS];
+};
+
+
+struct negative_cache_t {
+	struct negative_cache_bucket *buckets;
+	size_t mask;
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t inserts;
+};
+
+
+struct negative_cache_t *negative_cache_create(size_t entries) {
+	size_t buckets = 1;
+	while (buckets * NEGATIVE_CACHE_SLOTS < entries && buckets < NEGATIVE_CACHE_MAX_BUCKETS) {
+		buckets <<= 1;
+	}
+
+	struct negative_cache_t *cache = calloc(1, sizeof(struct negative_cache_t));
+	if (!cache) {
+		return NULL;
+	}
+
+	cache->buckets = calloc(buckets, sizeof(struct negative_cache_bucket));
+	if (!cache->buckets) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->mask = buckets - 1;
+	return cache;
+}
+
+
+void negative_cache_destroy(struct negative_cache_t *cache) {
+	if (cache) {
+		free(cache->buckets);
+		free(cache);
+	}
+}
+
+
+void negative_cache_clear(struct negative_cache_t *cache) {
+	memset(cache->buckets, 0, (cache->mask + 1) * sizeof(struct negative_cache_bucket));
+	cache->lookups = 0;
+	cache->hits = 0;
+	cache->inserts = 0;
+}
+
+
+// The fingerprint takes the hash bits above any possible bucket index, and
+// the low bits hold the length. Zero marks an empty slot, so it's remapped.
+static uint64_t _negative_cache_entry(const uint64_t hash, const size_t length) {
+	const uint64_t length_mask = ((uint64_t)1 << NEGATIVE_CACHE_LENGTH_BITS) - 1;
+	const uint64_t entry = (hash & ~length_mask) | (length & length_mask);
+	return entry ? entry : 1;
+}
+
+
+// Partial-key cuckoo hashing: the second bucket is derived from the first
+// and the fingerprint alone.
+static void _negative_cache_buckets(const struct negative_cache_t *cache, const uint64_t hash, size_t buckets[2]) {
+	buckets[0] = hash & cache->mask;
+	buckets[1] = (buckets[0] ^ ((hash >> NEGATIVE_CACHE_LENGTH_BITS) * 0x5bd1e995)) & cache->mask;
+}
+
+
+bool negative_cache_contains(struct negative_cache_t *cache, const uint64_t hash, const size_t length, const bool count) {
+	const uint64_t entry = _negative_cache_entry(hash, length);
+	size_t buckets[2];
+	_negative_cache_buckets(cache, hash, buckets);
+
+	bool found = false;
+	for (int b = 0; b < 2 && !found; b++) {
+		const uint64_t *slots = cache->buckets[buckets[b]].slots;
+		for (int i = 0; i < NEGATIVE_CACHE_SLOTS; i++) {
+			if (__atomic_load_n(&slots[i], __ATOMIC_RELAXED) == entry) {
+				found = true;
+				break;
+			}
+		}
+	}
+
+	if (count) {
+		__atomic_fetch_add(&cache->lookups, 1, __ATOMIC_RELAXED);
+		if (found) {
+			__atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return found;
+}
+
+
+void negative_cache_insert(struct negative_cache_t *cache, const uint64_t hash, const size_t length, const bool count) {
+	const uint64_t entry = _negative_cache_entry(hash, length);
+	size_t buckets[2];
+	_negative_cache_buckets(cache, hash, buckets);
+
+	if (count) {
+		__atomic_fetch_add(&cache->inserts, 1, __ATOMIC_RELAXED);
+	}
+
+	for (int b = 0; b < 2; b++) {
+		uint64_t *slots = cache->buckets[buckets[b]].slots;
+		for (int i = 0; i < NEGATIVE_CACHE_SLOTS; i++) {
+			uint64_t expected = 0;
+			if (__atomic_compare_exchange_n(&slots[i], &expected, entry, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+					|| expected == entry) {
+				return;
+			}
+		}
+	}
+
+	// Both buckets are full, so overwrite one of the eight residents, picked
+	// by the hash so the same user agent always lands in the same slot.
+	const unsigned int victim = (hash >> 60) & (2 * NEGATIVE_CACHE_SLOTS - 1);
+	__atomic_store_n(&cache->buckets[buckets[victim / NEGATIVE_CACHE_SLOTS]].slots[victim % NEGATIVE_CACHE_SLOTS], entry, __ATOMIC_RELAXED);
+}
+
+
+size_t negative_cache_capacity(const struct negative_cache_t *cache) {
+	return (cache->mask + 1) * NEGATIVE_CACHE_SLOTS;
+}
+
+
+void negative_cache_stats(const struct negative_cache_t *cache, uint64_t *lookups, uint64_t *hits, uint64_t *inserts, size_t *bytes) {
+	*lookups = __atomic_load_n(&cache->lookups, __ATOMIC_RELAXED);
+	*hits    = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+	*inserts = __atomic_load_n(&cache->inserts, __ATOMIC_RELAXED);
+	*bytes   = sizeof(struct negative_cache_t) + (cache->mask + 1) * sizeof(struct negative_cache_bucket);
+}
@@ -0,0 +1,107 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "uap/pattern.h"
+
+
+bool pattern_ascii(const char *pattern) {
+	for (const char *c = pattern; *c; c++) {
+		if (*c & 0x80) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+bool pattern_lowercase(char *out, const char *pattern) {
+	// Escapes whose meaning doesn't depend on the letter case of the subject
+	static const char safe_escapes[] = "dDwWsSbBAzZhHvVRKntrfea";
+	bool in_class = false;
+
+	for (const char *c = pattern; *c; c++) {
+		const unsigned char ch = (unsigned char)*c;
+
+		if (ch & 0x80) {
+			return false;
+		}
+
+		if (ch == '\\') {
+			const unsigned char next = (unsigned char)c[1];
+
+			if (next == '\0' || next & 0x80 || isdigit(next) || (isalpha(next) && !strchr(safe_escapes, next))) {
+				return false;
+			}
+
+			// An escape starting a range, e.g. "[\!-Z]"
+			if (in_class && c[2] == '-' && c[3] && c[3] != ']') {
+				return false;
+			}
+
+			*out++ = *c++;
+			*out++ = *c;
+			continue;
+		}
+
+		if (in_class) {
+			if (ch == ']') {
+				in_class = false;
+			} else if (ch == '[' && c[1] == ':') {
+				return false;
+			} else if (c[1] == '-' && c[2] && c[2] != ']') {
+				// Range: letters must stay letters of one case, anything
+				// else mustn't include letters at all.
+				const unsigned char end = (unsigned char)c[2];
+
+				if (end == '\\' || end & 0x80) {
+					return false;
+				}
+
+				if (isalpha(ch) || isalpha(end)) {
+					if (!(islower(ch) && islower(end)) && !(isupper(ch) && isupper(end))) {
+						return false;
+					}
+				} else if (ch <= 'z' && end >= 'A') {
+					return false;
+				}
+
+				*out++ = (char)tolower(ch);
+				*out++ = '-';
+				*out++ = (char)tolower(end);
+				c += 2;
+				continue;
+			}
+		} else if (ch == '[') {
+			in_class = true;
+			*out++ = *c;
+
+			// A leading ']' (after an optional '^') is a literal
+			if (c[1] == '^') *out++ = *++c;
+			if (c[1] == ']') *out++ = *++c;
+			continue;
+		} else if (ch == '(' && c[1] == '?') {
+			// Plain groupings and assertions only
+			if (!c[2] || (!strchr(":=!>|", c[2]) && !(c[2] == '<' && (c[3] == '=' || c[3] == '!')))) {
+				return false;
+			}
+		} else if (ch == '(' && c[1] == '*') {
+			// Only a merged expression's (*MARK:n), kept as it is
+			const size_t digits = strncmp(c, "(*MARK:", 7) == 0 ? strspn(c + 7, "0123456789") : 0;
+
+			if (digits == 0 || c[7 + digits] != ')') {
+				return false;
+			}
+
+			memcpy(out, c, 8 + digits);
+			out += 8 + digits;
+			c += 7 + digits;
+			continue;
+		}
+
+		*out++ = (char)tolower(ch);
+	}
+
+	*out = '\0';
+	return !in_class;
+}
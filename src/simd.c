@@ -0,0 +1,1062 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/simd.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_X86 1
+#include <immintrin.h>
+
+#define TARGET_SSE42  __attribute__((target("sse4.2")))
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+#define BYTES(_b) ((uint64_t)(_b) * 0x0101010101010101ULL)
+#define BYTESET_HAS(_set, _c) (((_set)->bits[(unsigned char)(_c) >> 6] >> ((unsigned char)(_c) & 63)) & 1)
+
+
+struct simd_kernels {
+	const char *name;
+	bool (*is_ascii)(const char *, size_t);
+	bool (*ascii_lowercase)(char *, const char *, size_t);
+	const char *(*memmem)(const char *, size_t, const char *, size_t);
+	const char *(*memmem_caseless)(const char *, size_t, const char *, size_t);
+	size_t (*find_byteset)(const char *, size_t, const struct simd_byteset *);
+	size_t (*span_byteset)(const char *, size_t, const struct simd_byteset *);
+	size_t (*span_byteset_end)(const char *, size_t, const struct simd_byteset *);
+	void (*byte_presence)(const char *, size_t, uint64_t *);
+};
+
+
+///###############################
+//# Scalar kernels, a word at a time where possible
+///###############################
+
+static bool _scalar_is_ascii(const char *str, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, str + i, 8);
+
+		if (word & BYTES(0x80)) {
+			return false;
+		}
+	}
+
+	for (; i < length; i++) {
+		if (str[i] & 0x80) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static bool _scalar_ascii_lowercase(char *dst, const char *src, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, src + i, 8);
+
+		if (word & BYTES(0x80)) {
+			return false;
+		}
+
+		// High bit of each byte is set for 'A'...'Z'
+		const uint64_t at_least_a = word + BYTES(0x80 - 'A');
+		const uint64_t above_z    = word + BYTES(0x80 - 'Z' - 1);
+		const uint64_t upper      = (at_least_a ^ above_z) & BYTES(0x80);
+
+		word |= upper >> 2; // 0x80 >> 2 == 0x20, the ASCII case bit
+		memcpy(dst + i, &word, 8);
+	}
+
+	for (; i < length; i++) {
+		const unsigned char c = (unsigned char)src[i];
+
+		if (c & 0x80) {
+			return false;
+		}
+
+		dst[i] = (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : (char)c;
+	}
+
+	dst[length] = '\0';
+	return true;
+}
+
+
+static inline unsigned char _fold(const unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+
+static bool _caseless_equal(const char *a, const char *b, const size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		if (_fold((unsigned char)a[i]) != _fold((unsigned char)b[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static const char *_scalar_memmem(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	if (!needle_length) {
+		return haystack;
+	}
+	if (needle_length > haystack_length) {
+		return NULL;
+	}
+
+	// Candidates start in [haystack, end)
+	const char *end = haystack + haystack_length - needle_length + 1;
+
+	for (const char *c = haystack; c < end && (c = memchr(c, needle[0], end - c)); c++) {
+		if (!memcmp(c + 1, needle + 1, needle_length - 1)) {
+			return c;
+		}
+	}
+
+	return NULL;
+}
+
+
+static const char *_scalar_memmem_caseless(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	if (!needle_length) {
+		return haystack;
+	}
+	if (needle_length > haystack_length) {
+		return NULL;
+	}
+
+	const unsigned char first = _fold((unsigned char)needle[0]);
+
+	for (size_t i = 0; i + needle_length <= haystack_length; i++) {
+		if (_fold((unsigned char)haystack[i]) == first && _caseless_equal(haystack + i + 1, needle + 1, needle_length - 1)) {
+			return haystack + i;
+		}
+	}
+
+	return NULL;
+}
+
+
+static size_t _scalar_find_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	for (size_t i = 0; i < length; i++) {
+		if (BYTESET_HAS(set, str[i])) {
+			return i;
+		}
+	}
+	return length;
+}
+
+
+static size_t _scalar_span_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	for (size_t i = 0; i < length; i++) {
+		if (!BYTESET_HAS(set, str[i])) {
+			return i;
+		}
+	}
+	return length;
+}
+
+
+// Length of `str` left once the bytes in `set` are stripped from its end
+static size_t _scalar_span_byteset_end(const char *str, size_t length, const struct simd_byteset *set) {
+	while (length > 0 && BYTESET_HAS(set, str[length - 1])) {
+		length--;
+	}
+	return length;
+}
+
+
+// Adds the bytes of `str` to `bits`, and the ASCII ones to the nibble table
+// `low_nibbles` (as in struct simd_byteset) when it's given.
+static void _mark_bytes(const char *str, const size_t length, uint64_t bits[4], uint8_t *low_nibbles) {
+	for (size_t i = 0; i < length; i++) {
+		const unsigned char c = (unsigned char)str[i];
+		bits[c >> 6] |= (uint64_t)1 << (c & 63);
+
+		if (low_nibbles && c < 0x80) {
+			low_nibbles[c & 0x0f] |= (uint8_t)(1 << (c >> 4));
+		}
+	}
+}
+
+
+static void _scalar_byte_presence(const char *str, const size_t length, uint64_t bits[4]) {
+	_mark_bytes(str, length, bits, NULL);
+}
+
+
+#ifdef SIMD_X86
+///###############################
+//# SSE4.2 kernels, 16 bytes at a time
+///###############################
+
+TARGET_SSE42 static bool _sse42_is_ascii(const char *str, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + i)))) {
+			return false;
+		}
+	}
+
+	return _scalar_is_ascii(str + i, length - i);
+}
+
+
+// 0x20 in each byte holding an ASCII uppercase letter. Bytes with the high bit
+// set compare as negative, so they're never letters.
+TARGET_SSE42 static inline __m128i _sse42_upper_bits(const __m128i v) {
+	const __m128i upper = _mm_and_si128(
+			_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+			_mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_and_si128(upper, _mm_set1_epi8(0x20));
+}
+
+
+TARGET_SSE42 static bool _sse42_ascii_lowercase(char *dst, const char *src, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (_mm_movemask_epi8(v)) {
+			return false;
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(v, _sse42_upper_bits(v)));
+	}
+
+	return _scalar_ascii_lowercase(dst + i, src + i, length - i);
+}
+
+
+// Compare the first and last needle bytes against 16 candidate positions at
+// once, and only check the rest of the needle where both match.
+TARGET_SSE42 static const char *_sse42_memmem_impl(
+		const char *haystack,
+		const size_t haystack_length,
+		const char *needle,
+		const size_t needle_length,
+		const bool caseless)
+{
+	if (needle_length < 2 || needle_length > haystack_length) {
+		return caseless
+			? _scalar_memmem_caseless(haystack, haystack_length, needle, needle_length)
+			: _scalar_memmem(haystack, haystack_length, needle, needle_length);
+	}
+
+	const char first_byte = caseless ? (char)_fold((unsigned char)needle[0]) : needle[0];
+	const char last_byte  = caseless ? (char)_fold((unsigned char)needle[needle_length - 1]) : needle[needle_length - 1];
+	const __m128i first = _mm_set1_epi8(first_byte);
+	const __m128i last  = _mm_set1_epi8(last_byte);
+	size_t i = 0;
+
+	for (; i + needle_length - 1 + 16 <= haystack_length; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+		__m128i block_last  = _mm_loadu_si128((const __m128i *)(haystack + i + needle_length - 1));
+
+		if (caseless) {
+			block_first = _mm_or_si128(block_first, _sse42_upper_bits(block_first));
+			block_last  = _mm_or_si128(block_last, _sse42_upper_bits(block_last));
+		}
+
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(block_first, first),
+				_mm_cmpeq_epi8(block_last, last)));
+
+		while (mask) {
+			const char *candidate = haystack + i + __builtin_ctz(mask);
+
+			if (caseless
+					? _caseless_equal(candidate + 1, needle + 1, needle_length - 2)
+					: !memcmp(candidate + 1, needle + 1, needle_length - 2)) {
+				return candidate;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+
+	return caseless
+		? _scalar_memmem_caseless(haystack + i, haystack_length - i, needle, needle_length)
+		: _scalar_memmem(haystack + i, haystack_length - i, needle, needle_length);
+}
+
+
+TARGET_SSE42 static const char *_sse42_memmem(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _sse42_memmem_impl(haystack, haystack_length, needle, needle_length, false);
+}
+
+
+TARGET_SSE42 static const char *_sse42_memmem_caseless(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _sse42_memmem_impl(haystack, haystack_length, needle, needle_length, true);
+}
+
+
+// 0xff in each byte which isn't in the set: the low nibble picks a bitmap of
+// high nibbles from the table, which must include the byte's high nibble.
+TARGET_SSE42 static inline __m128i _sse42_not_in_set(const __m128i v, const __m128i low_table, const __m128i high_table) {
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i low  = _mm_shuffle_epi8(low_table, _mm_and_si128(v, nibble));
+	const __m128i high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	return _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+}
+
+
+TARGET_SSE42 static size_t _sse42_scan_byteset(const char *str, const size_t length, const struct simd_byteset *set, const bool in_set) {
+	const __m128i low_table  = _mm_loadu_si128((const __m128i *)set->low_nibbles);
+	const __m128i high_table = _mm_loadu_si128((const __m128i *)set->high_nibbles);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+		unsigned int mask = _mm_movemask_epi8(_sse42_not_in_set(v, low_table, high_table));
+
+		if (in_set) {
+			mask = ~mask & 0xffff;
+		}
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + (in_set
+		? _scalar_find_byteset(str + i, length - i, set)
+		: _scalar_span_byteset(str + i, length - i, set));
+}
+
+
+TARGET_SSE42 static size_t _sse42_find_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _sse42_scan_byteset(str, length, set, true) : _scalar_find_byteset(str, length, set);
+}
+
+
+TARGET_SSE42 static size_t _sse42_span_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _sse42_scan_byteset(str, length, set, false) : _scalar_span_byteset(str, length, set);
+}
+
+
+// The last byte not in the set is the highest bit of the block's mask
+TARGET_SSE42 static size_t _sse42_scan_byteset_end(const char *str, size_t length, const struct simd_byteset *set) {
+	const __m128i low_table  = _mm_loadu_si128((const __m128i *)set->low_nibbles);
+	const __m128i high_table = _mm_loadu_si128((const __m128i *)set->high_nibbles);
+
+	for (; length >= 16; length -= 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(str + length - 16));
+		const unsigned int mask = _mm_movemask_epi8(_sse42_not_in_set(v, low_table, high_table));
+
+		if (mask) {
+			return length - 16 + (32 - __builtin_clz(mask));
+		}
+	}
+
+	return _scalar_span_byteset_end(str, length, set);
+}
+
+
+TARGET_SSE42 static size_t _sse42_span_byteset_end(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _sse42_scan_byteset_end(str, length, set) : _scalar_span_byteset_end(str, length, set);
+}
+
+
+// User agents draw on a small alphabet, so once its bytes have been seen
+// most blocks hold nothing new and are skipped after a set lookup against
+// the bytes seen so far.
+TARGET_SSE42 static void _sse42_byte_presence(const char *str, const size_t length, uint64_t bits[4]) {
+	struct simd_byteset seen;
+	simd_byteset_init(&seen, "");
+
+	__m128i low_table = _mm_setzero_si128();
+	const __m128i high_table = _mm_loadu_si128((const __m128i *)seen.high_nibbles);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+
+		if (_mm_movemask_epi8(v) || _mm_movemask_epi8(_sse42_not_in_set(v, low_table, high_table))) {
+			_mark_bytes(str + i, 16, bits, seen.low_nibbles);
+			low_table = _mm_loadu_si128((const __m128i *)seen.low_nibbles);
+		}
+	}
+
+	_mark_bytes(str + i, length - i, bits, NULL);
+}
+
+
+///###############################
+//# AVX2 kernels, 32 bytes at a time
+///###############################
+
+TARGET_AVX2 static bool _avx2_is_ascii(const char *str, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(str + i)))) {
+			return false;
+		}
+	}
+
+	return _sse42_is_ascii(str + i, length - i);
+}
+
+
+TARGET_AVX2 static inline __m256i _avx2_upper_bits(const __m256i v) {
+	const __m256i upper = _mm256_and_si256(
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+	return _mm256_and_si256(upper, _mm256_set1_epi8(0x20));
+}
+
+
+TARGET_AVX2 static bool _avx2_ascii_lowercase(char *dst, const char *src, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		if (_mm256_movemask_epi8(v)) {
+			return false;
+		}
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(v, _avx2_upper_bits(v)));
+	}
+
+	return _sse42_ascii_lowercase(dst + i, src + i, length - i);
+}
+
+
+TARGET_AVX2 static const char *_avx2_memmem_impl(
+		const char *haystack,
+		const size_t haystack_length,
+		const char *needle,
+		const size_t needle_length,
+		const bool caseless)
+{
+	if (needle_length < 2 || needle_length > haystack_length) {
+		return _sse42_memmem_impl(haystack, haystack_length, needle, needle_length, caseless);
+	}
+
+	const char first_byte = caseless ? (char)_fold((unsigned char)needle[0]) : needle[0];
+	const char last_byte  = caseless ? (char)_fold((unsigned char)needle[needle_length - 1]) : needle[needle_length - 1];
+	const __m256i first = _mm256_set1_epi8(first_byte);
+	const __m256i last  = _mm256_set1_epi8(last_byte);
+	size_t i = 0;
+
+	for (; i + needle_length - 1 + 32 <= haystack_length; i += 32) {
+		__m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+		__m256i block_last  = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_length - 1));
+
+		if (caseless) {
+			block_first = _mm256_or_si256(block_first, _avx2_upper_bits(block_first));
+			block_last  = _mm256_or_si256(block_last, _avx2_upper_bits(block_last));
+		}
+
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(block_first, first),
+				_mm256_cmpeq_epi8(block_last, last)));
+
+		while (mask) {
+			const char *candidate = haystack + i + __builtin_ctz(mask);
+
+			if (caseless
+					? _caseless_equal(candidate + 1, needle + 1, needle_length - 2)
+					: !memcmp(candidate + 1, needle + 1, needle_length - 2)) {
+				return candidate;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+
+	return _sse42_memmem_impl(haystack + i, haystack_length - i, needle, needle_length, caseless);
+}
+
+
+TARGET_AVX2 static const char *_avx2_memmem(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _avx2_memmem_impl(haystack, haystack_length, needle, needle_length, false);
+}
+
+
+TARGET_AVX2 static const char *_avx2_memmem_caseless(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _avx2_memmem_impl(haystack, haystack_length, needle, needle_length, true);
+}
+
+
+TARGET_AVX2 static size_t _avx2_scan_byteset(const char *str, const size_t length, const struct simd_byteset *set, const bool in_set) {
+	const __m256i low_table  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->low_nibbles));
+	const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->high_nibbles));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+		const __m256i low  = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+		const __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256()));
+
+		if (in_set) {
+			mask = ~mask;
+		}
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + _sse42_scan_byteset(str + i, length - i, set, in_set);
+}
+
+
+TARGET_AVX2 static size_t _avx2_find_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx2_scan_byteset(str, length, set, true) : _scalar_find_byteset(str, length, set);
+}
+
+
+TARGET_AVX2 static size_t _avx2_span_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx2_scan_byteset(str, length, set, false) : _scalar_span_byteset(str, length, set);
+}
+
+
+TARGET_AVX2 static inline __m256i _avx2_not_in_set(const __m256i v, const __m256i low_table, const __m256i high_table) {
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i low  = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+	const __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+	return _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+}
+
+
+TARGET_AVX2 static size_t _avx2_scan_byteset_end(const char *str, size_t length, const struct simd_byteset *set) {
+	const __m256i low_table  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->low_nibbles));
+	const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->high_nibbles));
+
+	for (; length >= 32; length -= 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(str + length - 32));
+		const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_avx2_not_in_set(v, low_table, high_table));
+
+		if (mask) {
+			return length - 32 + (32 - __builtin_clz(mask));
+		}
+	}
+
+	return _sse42_scan_byteset_end(str, length, set);
+}
+
+
+TARGET_AVX2 static size_t _avx2_span_byteset_end(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx2_scan_byteset_end(str, length, set) : _scalar_span_byteset_end(str, length, set);
+}
+
+
+TARGET_AVX2 static void _avx2_byte_presence(const char *str, const size_t length, uint64_t bits[4]) {
+	struct simd_byteset seen;
+	simd_byteset_init(&seen, "");
+
+	__m256i low_table = _mm256_setzero_si256();
+	const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)seen.high_nibbles));
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+
+		if (_mm256_movemask_epi8(v) || _mm256_movemask_epi8(_avx2_not_in_set(v, low_table, high_table))) {
+			_mark_bytes(str + i, 32, bits, seen.low_nibbles);
+			low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)seen.low_nibbles));
+		}
+	}
+
+	_mark_bytes(str + i, length - i, bits, NULL);
+}
+
+
+///###############################
+//# AVX-512 kernels, 64 bytes at a time with masked tails
+///###############################
+
+static inline __mmask64 _avx512_tail_mask(const size_t remaining) {
+	return remaining >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << remaining) - 1);
+}
+
+
+TARGET_AVX512 static bool _avx512_is_ascii(const char *str, const size_t length) {
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		if (_mm512_movepi8_mask(_mm512_loadu_si512((const void *)(str + i)))) {
+			return false;
+		}
+	}
+
+	const __m512i tail = _mm512_maskz_loadu_epi8(_avx512_tail_mask(length - i), str + i);
+	return !_mm512_movepi8_mask(tail);
+}
+
+
+TARGET_AVX512 static inline __m512i _avx512_fold(const __m512i v) {
+	const __mmask64 upper = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, _mm512_set1_epi8('A')), _mm512_set1_epi8(26));
+	return _mm512_mask_add_epi8(v, upper, v, _mm512_set1_epi8(0x20));
+}
+
+
+TARGET_AVX512 static bool _avx512_ascii_lowercase(char *dst, const char *src, const size_t length) {
+	size_t i = 0;
+
+	for (; i < length; i += 64) {
+		const __mmask64 mask = _avx512_tail_mask(length - i);
+		const __m512i v = _mm512_maskz_loadu_epi8(mask, src + i);
+
+		if (_mm512_movepi8_mask(v)) {
+			return false;
+		}
+
+		_mm512_mask_storeu_epi8(dst + i, mask, _avx512_fold(v));
+	}
+
+	dst[length] = '\0';
+	return true;
+}
+
+
+TARGET_AVX512 static const char *_avx512_memmem_impl(
+		const char *haystack,
+		const size_t haystack_length,
+		const char *needle,
+		const size_t needle_length,
+		const bool caseless)
+{
+	if (needle_length < 2 || needle_length > haystack_length) {
+		return _avx2_memmem_impl(haystack, haystack_length, needle, needle_length, caseless);
+	}
+
+	const char first_byte = caseless ? (char)_fold((unsigned char)needle[0]) : needle[0];
+	const char last_byte  = caseless ? (char)_fold((unsigned char)needle[needle_length - 1]) : needle[needle_length - 1];
+	const __m512i first = _mm512_set1_epi8(first_byte);
+	const __m512i last  = _mm512_set1_epi8(last_byte);
+	size_t i = 0;
+
+	for (; i + needle_length - 1 + 64 <= haystack_length; i += 64) {
+		__m512i block_first = _mm512_loadu_si512((const void *)(haystack + i));
+		__m512i block_last  = _mm512_loadu_si512((const void *)(haystack + i + needle_length - 1));
+
+		if (caseless) {
+			block_first = _avx512_fold(block_first);
+			block_last  = _avx512_fold(block_last);
+		}
+
+		uint64_t mask = _mm512_cmpeq_epi8_mask(block_first, first) & _mm512_cmpeq_epi8_mask(block_last, last);
+
+		while (mask) {
+			const char *candidate = haystack + i + __builtin_ctzll(mask);
+
+			if (caseless
+					? _caseless_equal(candidate + 1, needle + 1, needle_length - 2)
+					: !memcmp(candidate + 1, needle + 1, needle_length - 2)) {
+				return candidate;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+
+	return _avx2_memmem_impl(haystack + i, haystack_length - i, needle, needle_length, caseless);
+}
+
+
+TARGET_AVX512 static const char *_avx512_memmem(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _avx512_memmem_impl(haystack, haystack_length, needle, needle_length, false);
+}
+
+
+TARGET_AVX512 static const char *_avx512_memmem_caseless(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _avx512_memmem_impl(haystack, haystack_length, needle, needle_length, true);
+}
+
+
+TARGET_AVX512 static size_t _avx512_scan_byteset(const char *str, const size_t length, const struct simd_byteset *set, const bool in_set) {
+	const __m512i low_table  = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->low_nibbles));
+	const __m512i high_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->high_nibbles));
+	const __m512i nibble = _mm512_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		const __m512i v = _mm512_loadu_si512((const void *)(str + i));
+		const __m512i low  = _mm512_shuffle_epi8(low_table, _mm512_and_si512(v, nibble));
+		const __m512i high = _mm512_shuffle_epi8(high_table, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+		const uint64_t mask = in_set ? _mm512_test_epi8_mask(low, high) : _mm512_testn_epi8_mask(low, high);
+
+		if (mask) {
+			return i + __builtin_ctzll(mask);
+		}
+	}
+
+	return i + _avx2_scan_byteset(str + i, length - i, set, in_set);
+}
+
+
+TARGET_AVX512 static size_t _avx512_find_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx512_scan_byteset(str, length, set, true) : _scalar_find_byteset(str, length, set);
+}
+
+
+TARGET_AVX512 static size_t _avx512_span_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx512_scan_byteset(str, length, set, false) : _scalar_span_byteset(str, length, set);
+}
+
+
+// Mask of the bytes of `v` which aren't in the set
+TARGET_AVX512 static inline uint64_t _avx512_not_in_set(const __m512i v, const __m512i low_table, const __m512i high_table) {
+	const __m512i nibble = _mm512_set1_epi8(0x0f);
+	const __m512i low  = _mm512_shuffle_epi8(low_table, _mm512_and_si512(v, nibble));
+	const __m512i high = _mm512_shuffle_epi8(high_table, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+	return _mm512_testn_epi8_mask(low, high);
+}
+
+
+TARGET_AVX512 static size_t _avx512_scan_byteset_end(const char *str, size_t length, const struct simd_byteset *set) {
+	const __m512i low_table  = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->low_nibbles));
+	const __m512i high_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)set->high_nibbles));
+
+	for (; length >= 64; length -= 64) {
+		const __m512i v = _mm512_loadu_si512((const void *)(str + length - 64));
+		const uint64_t mask = _avx512_not_in_set(v, low_table, high_table);
+
+		if (mask) {
+			return length - 64 + (64 - __builtin_clzll(mask));
+		}
+	}
+
+	return _avx2_scan_byteset_end(str, length, set);
+}
+
+
+TARGET_AVX512 static size_t _avx512_span_byteset_end(const char *str, const size_t length, const struct simd_byteset *set) {
+	return set->ascii ? _avx512_scan_byteset_end(str, length, set) : _scalar_span_byteset_end(str, length, set);
+}
+
+
+TARGET_AVX512 static void _avx512_byte_presence(const char *str, const size_t length, uint64_t bits[4]) {
+	struct simd_byteset seen;
+	simd_byteset_init(&seen, "");
+
+	__m512i low_table = _mm512_setzero_si512();
+	const __m512i high_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)seen.high_nibbles));
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		const __m512i v = _mm512_loadu_si512((const void *)(str + i));
+
+		if (_mm512_movepi8_mask(v) || _avx512_not_in_set(v, low_table, high_table)) {
+			_mark_bytes(str + i, 64, bits, seen.low_nibbles);
+			low_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)seen.low_nibbles));
+		}
+	}
+
+	_mark_bytes(str + i, length - i, bits, NULL);
+}
+#endif // SIMD_X86
+
+
+///###############################
+//# Dispatch
+///###############################
+
+static const struct simd_kernels simd_kernels_by_level[] = {
+	{
+		"scalar",
+		&_scalar_is_ascii,
+		&_scalar_ascii_lowercase,
+		&_scalar_memmem,
+		&_scalar_memmem_caseless,
+		&_scalar_find_byteset,
+		&_scalar_span_byteset,
+		&_scalar_span_byteset_end,
+		&_scalar_byte_presence,
+	},
+#ifdef SIMD_X86
+	{
+		"sse4.2",
+		&_sse42_is_ascii,
+		&_sse42_ascii_lowercase,
+		&_sse42_memmem,
+		&_sse42_memmem_caseless,
+		&_sse42_find_byteset,
+		&_sse42_span_byteset,
+		&_sse42_span_byteset_end,
+		&_sse42_byte_presence,
+	},
+	{
+		"avx2",
+		&_avx2_is_ascii,
+		&_avx2_ascii_lowercase,
+		&_avx2_memmem,
+		&_avx2_memmem_caseless,
+		&_avx2_find_byteset,
+		&_avx2_span_byteset,
+		&_avx2_span_byteset_end,
+		&_avx2_byte_presence,
+	},
+	{
+		"avx512",
+		&_avx512_is_ascii,
+		&_avx512_ascii_lowercase,
+		&_avx512_memmem,
+		&_avx512_memmem_caseless,
+		&_avx512_find_byteset,
+		&_avx512_span_byteset,
+		&_avx512_span_byteset_end,
+		&_avx512_byte_presence,
+	},
+#endif
+};
+
+static const struct simd_kernels *simd_active = NULL;
+
+
+// Highest level the CPU supports
+static int _simd_cpu_level() {
+	int level = 0;
+
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.2")) {
+		level = 1;
+	}
+	if (level == 1 && __builtin_cpu_supports("avx2")) {
+		level = 2;
+	}
+	if (level == 2 && __builtin_cpu_supports("avx512bw")) {
+		level = 3;
+	}
+#endif
+
+	return level;
+}
+
+
+static const struct simd_kernels *_simd_resolve() {
+	int level = _simd_cpu_level();
+
+	const char *cap = getenv("UAP_SIMD");
+	for (int i = 0; cap && i < level; i++) {
+		if (!strcmp(cap, simd_kernels_by_level[i].name)) {
+			level = i;
+		}
+	}
+
+	return &simd_kernels_by_level[level];
+}
+
+
+// Every thread resolves to the same table, so racing first calls are harmless.
+static inline const struct simd_kernels *_simd() {
+	const struct simd_kernels *kernels = __atomic_load_n(&simd_active, __ATOMIC_ACQUIRE);
+
+	if (!kernels) {
+		kernels = _simd_resolve();
+		__atomic_store_n(&simd_active, kernels, __ATOMIC_RELEASE);
+	}
+
+	return kernels;
+}
+
+
+const char *simd_level_name() {
+	return _simd()->name;
+}
+
+
+int simd_level_count() {
+	return _simd_cpu_level() + 1;
+}
+
+
+int simd_set_level(const int level) {
+	const struct simd_kernels *previous = _simd();
+
+	if (level >= 0 && level < simd_level_count()) {
+		__atomic_store_n(&simd_active, &simd_kernels_by_level[level], __ATOMIC_RELEASE);
+	}
+
+	return (int)(previous - simd_kernels_by_level);
+}
+
+
+bool simd_is_ascii(const char *str, const size_t length) {
+	return _simd()->is_ascii(str, length);
+}
+
+
+bool simd_ascii_lowercase(char *dst, const char *src, const size_t length) {
+	return _simd()->ascii_lowercase(dst, src, length);
+}
+
+
+const char *simd_memmem(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _simd()->memmem(haystack, haystack_length, needle, needle_length);
+}
+
+
+const char *simd_memmem_caseless(const char *haystack, const size_t haystack_length, const char *needle, const size_t needle_length) {
+	return _simd()->memmem_caseless(haystack, haystack_length, needle, needle_length);
+}
+
+
+void simd_byteset_init(struct simd_byteset *set, const char *bytes) {
+	memset(set, 0, sizeof(struct simd_byteset));
+	set->ascii = true;
+
+	for (int h = 0; h < 8; h++) {
+		set->high_nibbles[h] = (uint8_t)(1 << h);
+	}
+
+	for (const unsigned char *c = (const unsigned char *)bytes; *c; c++) {
+		set->bits[*c >> 6] |= (uint64_t)1 << (*c & 63);
+
+		if (*c & 0x80) {
+			set->ascii = false;
+		} else {
+			set->low_nibbles[*c & 0x0f] |= (uint8_t)(1 << (*c >> 4));
+		}
+	}
+}
+
+
+size_t simd_find_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return _simd()->find_byteset(str, length, set);
+}
+
+
+size_t simd_span_byteset(const char *str, const size_t length, const struct simd_byteset *set) {
+	return _simd()->span_byteset(str, length, set);
+}
+
+
+void simd_byte_presence(const char *str, const size_t length, uint64_t bits[4]) {
+	memset(bits, 0, 4 * sizeof(uint64_t));
+	_simd()->byte_presence(str, length, bits);
+}
+
+
+size_t simd_trim(const char *str, const size_t length, const struct simd_byteset *set, size_t *start) {
+	const struct simd_kernels *kernels = _simd();
+	const size_t begin = kernels->span_byteset(str, length, set);
+
+	*start = begin;
+	return kernels->span_byteset_end(str + begin, length - begin, set);
+}
+
+
+///###############################
+//# XXH64, by Yann Collet
+///###############################
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+
+static inline uint64_t _rotl64(const uint64_t x, const int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t _read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+
+static inline uint32_t _read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+
+static inline uint64_t _xxh64_round(uint64_t acc, const uint64_t input) {
+	acc += input * XXH_PRIME64_2;
+	acc = _rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+
+static inline uint64_t _xxh64_merge(uint64_t acc, const uint64_t value) {
+	acc ^= _xxh64_round(0, value);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+uint64_t simd_hash64(const char *str, const size_t length, const uint64_t seed) {
+	const unsigned char *p = (const unsigned char *)str;
+	const unsigned char *end = p + length;
+	uint64_t h;
+
+	if (length >= 32) {
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = _xxh64_round(v1, _read64(p));
+			v2 = _xxh64_round(v2, _read64(p + 8));
+			v3 = _xxh64_round(v3, _read64(p + 16));
+			v4 = _xxh64_round(v4, _read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+		h = _xxh64_merge(h, v1);
+		h = _xxh64_merge(h, v2);
+		h = _xxh64_merge(h, v3);
+		h = _xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += length;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= _xxh64_round(0, _read64(p));
+		h = _rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)_read32(p) * XXH_PRIME64_1;
+		h = _rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = _rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
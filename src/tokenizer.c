@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uap/simd.h"
+#include "uap/uap.h"
+
+
+static struct simd_byteset blanks;      // " \t"
+static struct simd_byteset delimiters;  // " \t()", ends a product token
+static struct simd_byteset parentheses; // "()"
+static pthread_once_t bytesets_once = PTHREAD_ONCE_INIT;
+
+
+static void _bytesets_init() {
+	simd_byteset_init(&blanks, " \t");
+	simd_byteset_init(&delimiters, " \t()");
+	simd_byteset_init(&parentheses, "()");
+}
+
+
+// Offset just past the parenthesis closing the comment opened before `pos`,
+// or `length` if it's never closed. Nested parentheses stay in the comment.
+static size_t _comment_end(const char *str, const size_t length, size_t pos, size_t *content_end) {
+	unsigned int depth = 1;
+
+	while ((pos += simd_find_byteset(str + pos, length - pos, &parentheses)) < length) {
+		if (str[pos++] == '(') {
+			depth++;
+		} else if (--depth == 0) {
+			*content_end = pos - 1;
+			return pos;
+		}
+	}
+
+	*content_end = length;
+	return length;
+}
+
+
+size_t uap_tokenize(const char *user_agent, size_t length, struct uap_token *tokens, const size_t max_tokens) {
+	size_t count = 0;
+	size_t pos = 0;
+
+	pthread_once(&bytesets_once, &_bytesets_init);
+
+	// Offsets are 32 bits wide; nothing past them is tokenized
+	if (length > UINT32_MAX) {
+		length = UINT32_MAX;
+	}
+
+	while ((pos += simd_span_byteset(user_agent + pos, length - pos, &blanks)) < length) {
+		struct uap_token token;
+
+		if (user_agent[pos] == '(') {
+			size_t content_end;
+			const size_t start = pos + 1;
+			pos = _comment_end(user_agent, length, start, &content_end);
+
+			token.type           = UAP_TOKEN_COMMENT;
+			token.start          = (uint32_t)start;
+			token.length         = (uint32_t)(content_end - start);
+			token.name_length    = token.length;
+			token.version_start  = 0;
+			token.version_length = 0;
+		} else if (user_agent[pos] == ')') {
+			// Stray closing parenthesis, not part of any token
+			pos++;
+			continue;
+		} else {
+			const size_t start = pos;
+			pos += simd_find_byteset(user_agent + pos, length - pos, &delimiters);
+
+			const char *slash = memchr(user_agent + start, '/', pos - start);
+
+			token.type   = UAP_TOKEN_PRODUCT;
+			token.start  = (uint32_t)start;
+			token.length = (uint32_t)(pos - start);
+
+			if (slash) {
+				token.name_length    = (uint32_t)(slash - (user_agent + start));
+				token.version_start  = token.start + token.name_length + 1;
+				token.version_length = token.length - token.name_length - 1;
+			} else {
+				token.name_length    = token.length;
+				token.version_start  = 0;
+				token.version_length = 0;
+			}
+		}
+
+		if (count < max_tokens) {
+			tokens[count] = token;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+
+const struct uap_token *uap_token_find_product(
+		const char *user_agent,
+		const struct uap_token *tokens,
+		const size_t count,
+		const char *name)
+{
+	const size_t name_length = strlen(name);
+
+	for (size_t i = 0; i < count; i++) {
+		if (tokens[i].type == UAP_TOKEN_PRODUCT &&
+				tokens[i].name_length == name_length &&
+				memcmp(user_agent + tokens[i].start, name, name_length) == 0) {
+			return &tokens[i];
+		}
+	}
+
+	return NULL;
+}
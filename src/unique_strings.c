@@ -3,10 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "uap/simd.h"
 #include "uap/unique_strings.h"
 
 #define UNIQUE_STRING_BUCKETS 32
-#define MURMUR_SEED 0xf9a025a4 // random
+#define UNIQUE_STRING_SEED 0xf9a025a4 // random
 
 
 struct buffer_t {
@@ -73,53 +74,11 @@ static void buffer_compact(struct buffer_t *buffer) {
 }
 
 
-static uint32_t hash_murmur2(const char *data, int len, uint32_t seed) {
-	const uint32_t m = 0x5bd1e995;
-	const int r = 24;
-
-	uint32_t h = seed ^ len;
-
-	while (len >= 4) {
-		uint32_t k = *(uint32_t*)data;
-
-		k *= m;
-		k ^= k >> r;
-		k *= m;
-
-		h *= m;
-		h ^= k;
-
-		data += 4;
-		len -= 4;
-	}
-
-	switch (len) {
-		case 3:
-			h ^= data[2] << 16;
-			// FALLTHRU
-		case 2:
-			h ^= data[1] << 8;
-			// FALLTHRU
-		case 1:
-			h ^= data[0];
-			// FALLTHRU
-		default:
-			h *= m;
-	}
-
-	h ^= h >> 13;
-	h *= m;
-	h ^= h >> 15;
-
-	return h;
-}
-
-
 // Copies the string pointer to the string_hash_pair_t and generates
 // a hash from it. Also returns the hash.
 static uint32_t _string_hash_pair_prepare(struct string_hash_pair_t *shp, const char *str) {
 	shp->str = str;
-	shp->hash = hash_murmur2(str, strlen(str), MURMUR_SEED);
+	shp->hash = (uint32_t)simd_hash64(str, strlen(str), UNIQUE_STRING_SEED);
 	return shp->hash;
 }
 
@@ -266,6 +225,22 @@ const char * unique_strings_get(const struct unique_string_handle_t *handle) {
 }
 
 
+size_t unique_strings_bytes(const struct unique_strings_t *us) {
+	size_t bytes = sizeof(struct unique_strings_t) + us->buffer.capacity;
+
+	if (us->buckets) {
+		bytes += UNIQUE_STRING_BUCKETS * sizeof(struct unique_string_node *);
+		for (unsigned int i = 0; i < UNIQUE_STRING_BUCKETS; i++) {
+			for (const struct unique_string_node *node = us->buckets[i]; node; node = node->next) {
+				bytes += sizeof(struct unique_string_node);
+			}
+		}
+	}
+
+	return bytes;
+}
+
+
 bool unique_strings_owns(struct unique_strings_t *us, const char* str) {
 	return str >= us->buffer.data && str < (us->buffer.data + us->buffer.used);
 }
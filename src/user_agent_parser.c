@@ -1,16 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
 #define NDEBUG
 #include <assert.h>
+#include <ctype.h>
 #include <pcre.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <yaml.h>
 
+#include "uap/executor.h"
+#include "uap/negative_cache.h"
+#include "uap/pattern.h"
+#include "uap/simd.h"
 #include "uap/unique_strings.h"
 #include "uap/uap.h"
+#include "uap/workload.h"
 
 #define MAX_PATTERN_MATCHES (32)
 #define SUBSTRING_VEC_COUNT (MAX_PATTERN_MATCHES*2)
+#define DFA_WORKSPACE_SIZE (256)
+#define LOWERCASE_STACK_SIZE (512)
+#define IOV_STACK_SIZE (512)
+#define IOV_SCRATCH_MIN_SIZE (4096)
+#define IOV_SCRATCH_MAX_SIZE (65536)
+#define IOV_SCRATCH_SLOTS (8)
+#define INFO_STRINGS_MIN_SIZE (128)
+#define PROFILE_FINGERPRINT_SEED 0x7561702d70726f66 // random
 
 struct ua_replacement {
 	union {
@@ -42,6 +63,7 @@ struct ua_replacement {
 
 	bool has_placeholders; // pattern contains $1, etc.
 	struct unique_string_handle_t value;
+	size_t length; // of value
 	struct ua_replacement *next;
 };
 
@@ -78,26 +100,135 @@ struct ua_parse_state {
 	} device;
 
 	const char *buffer;
+
+	// Length of each field above, in uap_useragent_info order, recorded as
+	// it's set so results can be copied out without measuring them again
+	size_t length[UAP_NUM_FIELDS];
+};
+
+// Index into ua_parse_state.length of a group's first field
+#define STATE_FIELD_INDEX(_group) (offsetof(struct ua_parse_state, _group) / sizeof(const char *))
+
+#define OTHER_FAMILY "Other"
+
+
+// A user agent string prepared once per parse and shared by every group.
+struct ua_subject {
+	const char *string;
+	size_t length;
+	const char *lowercase; // ASCII-lowercased copy, NULL unless string is pure ASCII
+	bool ascii;            // string is known to be pure ASCII
+	uint64_t hash;         // simd_hash64(), only set when caches are enabled
+	struct uap_parse_cost *cost; // NULL unless the caller asked for the parse's cost
+	struct uap_rule_subject *rule_subject; // NULL unless there are native rules
+	struct uap_provenance *provenance; // NULL unless the caller asked where the results came from
+};
+
+
+// How an expression is run, chosen per expression by uap_parser_autotune().
+// Whether PCRE uses JIT code is down to the study data.
+enum ua_strategy {
+	UA_STRATEGY_PCRE = 0, // pcre_exec()
+	UA_STRATEGY_DFA,      // pcre_dfa_exec(), for expressions whose captures aren't used
+	UA_STRATEGY_LITERAL,  // simd_memmem() for an expression of plain text, on ASCII subjects
+};
+
+
+// An expression compiled on first use, published as a whole so parsing
+// threads never see half of it.
+struct ua_lazy_regex {
+	pcre *regex; // NULL if the expression failed to compile
+	pcre_extra *pcre_extra;
+};
+
+
+// One of the expressions folded into a merged expression, whose branch
+// for it ends with (*MARK:n), n being its position in the table.
+struct ua_merged_rule {
+	unsigned int index;
+	uint64_t fingerprint;
+	uint64_t hits; // times this expression produced the group's match
 };
 
 
 struct ua_expression_pair {
-	pcre *regex;
+	pcre *regex;            // NULL until first use if compiled lazily
 	pcre_extra *pcre_extra;
+	struct ua_lazy_regex *lazy;
+
+	// Case-sensitive rewrite of a caseless expression, matched against the
+	// lowercased subject. Only present when the rewrite is exact.
+	pcre *lowercase_regex;
+	pcre_extra *lowercase_pcre_extra;
+
+	// Byte-mode (non-UTF-8) compile of an ASCII-only expression, matched
+	// against pure ASCII user agents.
+	pcre *ascii_regex;
+	pcre_extra *ascii_pcre_extra;
+
 	struct ua_replacement *replacements;
 	struct ua_expression_pair *next;
+
+	struct unique_string_handle_t pattern; // source expression from regexes.yaml
+	char regex_flag;                        // regex_flag from regexes.yaml ('i' or '\0')
+	unsigned int index;                     // position within the group in regexes.yaml, or
+	                                        // for native rules the position they were added at
+	unsigned int merged;                    // following expressions folded into this one
+	struct ua_merged_rule *merged_rules;    // merged + 1 of them, if merged
+
+	// Merged as plain alternation, which finds the leftmost match of any
+	// branch rather than the first expression's. When it matters which
+	// expression matched, the branches are tried one after another instead,
+	// compiled from in_order_pattern on first use.
+	bool has_in_order;
+	struct unique_string_handle_t in_order_pattern;
+	struct ua_lazy_regex *in_order;
+	uint64_t hits;                          // times this pair produced the group's match
+	uint64_t attempts;                      // times this pair was tried
+	bool compile_lazily;                    // profile says it's never tried
+
+	enum ua_strategy strategy;
+	char *literal;                          // UA_STRATEGY_LITERAL: the text to find
+	unsigned int literal_length;
+	bool literal_capture;                   // the text is all in capture 1
+
+	// Callback from uap_parser_add_rule(), run instead of an expression
+	int (*native)(void *context, struct uap_rule_subject *subject, struct uap_rule_fields *fields);
+	void *native_context;
 };
 
 
 struct ua_parser_group {
 	struct ua_expression_pair* expression_pairs;
+	unsigned int rule_count;
+	int num_fields; // result fields filled by this group
+	struct negative_cache_t *negative_cache; // user agents matching nothing here, or NULL
+	struct ua_expression_pair *pending_rules; // native rules awaiting the expressions, by position
+	size_t state_offset; // of the group's fields in ua_parse_state
+	size_t provenance_offset; // of the group's entry in uap_provenance
+	int number; // 0 to 2, identifying the group in fingerprints
 	void (*apply_replacements_cb)(
 			struct ua_parse_state*,
 			const char *ua_string,
 			struct ua_expression_pair*,
 			const int *matches_vector, // SUBSTRING_VEC_COUNT
-			const int num_matches,
-			pcre *replacement_re);
+			const int num_matches);
+};
+
+
+// Buffers for joining split user agents too long for the stack. A parse
+// takes one out of a slot and puts it back after, so no two threads share
+// one. Buffers are grown as needed; ones grown past IOV_SCRATCH_MAX_SIZE,
+// or with no empty slot to go back to, are freed after use.
+struct ua_scratch {
+	size_t capacity;
+	char data[];
+};
+
+struct ua_scratch_pool {
+	struct ua_scratch *slots[IOV_SCRATCH_SLOTS]; // NULL if empty
+	size_t bytes; // held in the slots
+	size_t headroom; // the budget leaves for slots and deferred expressions, SIZE_MAX if unlimited
 };
 
 
@@ -107,10 +238,126 @@ struct uap_parser {
 	struct ua_parser_group device_parser_group;
 	struct unique_strings_t *strings;
 	struct unique_string_handle_t string_handle_other; // handle -> "Other"
-	pcre *replacement_re;
+	unsigned int flags; // UAP_PARSER_* options
+	struct uap_executor executor; // all NULL unless the options gave one
+	size_t memory_budget; // bytes, 0 for no limit
+	struct workload_t *workload; // traffic measurements, or NULL
+	bool collect_rule_stats;
+	bool has_rule_stats; // counts were collected or loaded from a profile
+	bool has_lowercase_rules;
+	bool has_ascii_rules;
+	bool has_literal_rules;
+	bool has_native_rules;
+	struct ua_profile_entry *profile; // loaded ahead of the expressions, sorted by fingerprint
+	size_t profile_count;
+	uint64_t generation; // unique to this parser, for memos
+	struct ua_scratch_pool *scratch; // for uap_parser_parse_iov(), NULL if it couldn't be allocated
 };
 
 
+// Last generation handed out. Parsers can come and go at the same address,
+// so memos compare generations rather than pointers.
+static uint64_t parser_generations = 0;
+
+
+static struct ua_scratch *_scratch_take(struct ua_scratch_pool *pool, const size_t size) {
+	struct ua_scratch *scratch = NULL;
+
+	if (!pool) {
+		return NULL;
+	}
+
+	for (int i = 0; i < IOV_SCRATCH_SLOTS && !scratch; i++) {
+		if (__atomic_load_n(&pool->slots[i], __ATOMIC_RELAXED)) {
+			scratch = __atomic_exchange_n(&pool->slots[i], NULL, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	if (scratch) {
+		__atomic_sub_fetch(&pool->bytes, sizeof(struct ua_scratch) + scratch->capacity, __ATOMIC_RELAXED);
+	}
+
+	if (!scratch || scratch->capacity < size) {
+		size_t capacity = scratch ? scratch->capacity * 2 : IOV_SCRATCH_MIN_SIZE;
+		while (capacity < size) {
+			capacity *= 2;
+		}
+
+		struct ua_scratch *grown = realloc(scratch, sizeof(struct ua_scratch) + capacity);
+		if (!grown) {
+			free(scratch);
+			return NULL;
+		}
+
+		grown->capacity = capacity;
+		scratch = grown;
+	}
+
+	return scratch;
+}
+
+
+static void _scratch_give(struct ua_scratch_pool *pool, struct ua_scratch *scratch) {
+	const size_t bytes = sizeof(struct ua_scratch) + scratch->capacity;
+
+	if (scratch->capacity <= IOV_SCRATCH_MAX_SIZE &&
+			__atomic_load_n(&pool->bytes, __ATOMIC_RELAXED) + bytes <= __atomic_load_n(&pool->headroom, __ATOMIC_RELAXED)) {
+		// Counted before it's in a slot, so a taker never subtracts first
+		__atomic_add_fetch(&pool->bytes, bytes, __ATOMIC_RELAXED);
+
+		for (int i = 0; i < IOV_SCRATCH_SLOTS; i++) {
+			struct ua_scratch *empty = NULL;
+			if (__atomic_compare_exchange_n(&pool->slots[i], &empty, scratch, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				return;
+			}
+		}
+
+		__atomic_sub_fetch(&pool->bytes, bytes, __ATOMIC_RELAXED);
+	}
+
+	free(scratch);
+}
+
+
+// Frees the buffers sitting in the slots, not ones parses have out. Safe
+// while other threads parse. Returns the bytes freed.
+static size_t _scratch_release(struct ua_scratch_pool *pool) {
+	size_t freed = 0;
+
+	for (int i = 0; pool && i < IOV_SCRATCH_SLOTS; i++) {
+		struct ua_scratch *scratch = __atomic_exchange_n(&pool->slots[i], NULL, __ATOMIC_ACQUIRE);
+
+		if (scratch) {
+			const size_t bytes = sizeof(struct ua_scratch) + scratch->capacity;
+			__atomic_sub_fetch(&pool->bytes, bytes, __ATOMIC_RELAXED);
+			freed += bytes;
+			free(scratch);
+		}
+	}
+
+	return freed;
+}
+
+
+// Takes `bytes` parsing added (an expression compiled on first use) out of
+// the headroom, freeing the spare buffers if they no longer fit. Safe while
+// other threads parse.
+static void _scratch_charge(struct ua_scratch_pool *pool, const size_t bytes) {
+	if (!pool) {
+		return;
+	}
+
+	size_t headroom = __atomic_load_n(&pool->headroom, __ATOMIC_RELAXED);
+	while (headroom != SIZE_MAX && !__atomic_compare_exchange_n(
+			&pool->headroom, &headroom, headroom > bytes ? headroom - bytes : 0, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	if (__atomic_load_n(&pool->bytes, __ATOMIC_RELAXED) > __atomic_load_n(&pool->headroom, __ATOMIC_RELAXED)) {
+		_scratch_release(pool);
+	}
+}
+
+
 static void ua_replacement_destroy(struct ua_replacement *replacement) {
 	struct ua_replacement *next;
 
@@ -130,38 +377,433 @@ static void ua_expression_pair_destroy(struct ua_expression_pair *pair) {
 
 		ua_replacement_destroy(pair->replacements);
 		pcre_free(pair->regex);
-		pcre_free(pair->pcre_extra);
+		pcre_free_study(pair->pcre_extra);
+		pcre_free(pair->lowercase_regex);
+		pcre_free_study(pair->lowercase_pcre_extra);
+		pcre_free(pair->ascii_regex);
+		pcre_free_study(pair->ascii_pcre_extra);
+
+		if (pair->lazy) {
+			pcre_free(pair->lazy->regex);
+			pcre_free_study(pair->lazy->pcre_extra);
+			free(pair->lazy);
+		}
+
+		if (pair->in_order) {
+			pcre_free(pair->in_order->regex);
+			pcre_free_study(pair->in_order->pcre_extra);
+			free(pair->in_order);
+		}
+
+		free(pair->literal);
+		free(pair->merged_rules);
 		free(pair);
 
 		pair = next;
 	}
 }
 
+static int _compile_options(const struct uap_parser *ua_parser, const char regex_flag) {
+	return 0
+		| PCRE_UTF8
+		| PCRE_EXTRA
+		| (regex_flag == 'i' ? PCRE_CASELESS : 0)
+		| (ua_parser->flags & UAP_PARSER_COUNT_STEPS ? PCRE_AUTO_CALLOUT : 0)
+		;
+}
+
+
+static size_t _regex_bytes(const pcre *regex, const pcre_extra *extra) {
+	size_t size = 0;
+	size_t study_size = 0;
+
+	if (regex) {
+		pcre_fullinfo(regex, NULL, PCRE_INFO_SIZE, &size);
+	}
+
+	if (regex && extra) {
+		pcre_fullinfo(regex, extra, PCRE_INFO_STUDYSIZE, &study_size);
+		size += sizeof(pcre_extra) + study_size;
+	}
+
+	return size;
+}
+
+
+// Compiles `pattern` into `*slot` the first time it's needed. Threads racing
+// to do so each compile it, and all but the first throw theirs away. NULL on
+// allocation failure.
+static const struct ua_lazy_regex *_compile_lazily(
+		const struct uap_parser *ua_parser,
+		struct ua_lazy_regex **slot,
+		const struct unique_string_handle_t *pattern,
+		const char regex_flag)
+{
+	struct ua_lazy_regex *lazy = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (lazy) {
+		return lazy;
+	}
+
+	lazy = calloc(1, sizeof(struct ua_lazy_regex));
+	if (!lazy) {
+		return NULL;
+	}
+
+	const char *error;
+	int erroffset;
+
+	lazy->regex = pcre_compile(
+			unique_strings_get(pattern),
+			_compile_options(ua_parser, regex_flag),
+			&error,
+			&erroffset,
+			NULL);
+
+	if (lazy->regex) {
+		lazy->pcre_extra = pcre_study(lazy->regex, 0, &error);
+	}
+
+	struct ua_lazy_regex *published = NULL;
+
+	if (!__atomic_compare_exchange_n(slot, &published, lazy, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pcre_free(lazy->regex);
+		pcre_free_study(lazy->pcre_extra);
+		free(lazy);
+		return published;
+	}
+
+	if (!lazy->regex) {
+		printf("pcre error: %d %s\n", erroffset, error);
+	}
+
+	// Parsing can't shed memory other threads may be using, so this only
+	// spends the room the budget left; uap_parser_warmup() sheds the rest
+	_scratch_charge(ua_parser->scratch, sizeof(struct ua_lazy_regex) + _regex_bytes(lazy->regex, lazy->pcre_extra));
+
+	return lazy;
+}
+
+
+// Compiles an expression a profile deferred the first time it's needed.
+static const struct ua_lazy_regex *_expression_pair_compile_lazily(
+		const struct uap_parser *ua_parser,
+		struct ua_expression_pair *pair)
+{
+	return _compile_lazily(ua_parser, &pair->lazy, &pair->pattern, pair->regex_flag);
+}
+
+
+// Identifies an expression across versions of regexes.yaml: its group, flag
+// and source text. Profiles and provenance use the fingerprints of a merged
+// expression's originals, kept in its merged_rules, rather than its own.
+static uint64_t _expression_pair_fingerprint(const int group, const struct ua_expression_pair *pair) {
+	const char *pattern = unique_strings_get(&pair->pattern);
+	const uint64_t seed = PROFILE_FINGERPRINT_SEED ^ ((uint64_t)group << 8) ^ (unsigned char)pair->regex_flag;
+	return simd_hash64(pattern, strlen(pattern), seed);
+}
+
+
+// Runs a native rule, copying whatever it found into the group's fields.
+static bool _native_rule_exec(
+		const struct uap_parser *ua_parser,
+		const struct ua_parser_group *group,
+		struct ua_expression_pair *pair,
+		struct ua_parse_state *state,
+		const struct ua_subject *subject)
+{
+	struct uap_rule_fields found;
+	memset(&found, 0, sizeof(struct uap_rule_fields));
+
+	if (ua_parser->collect_rule_stats) {
+		__atomic_fetch_add(&pair->attempts, 1, __ATOMIC_RELAXED);
+	}
+
+	if (subject->cost) {
+		subject->cost->rules_tried++;
+	}
+
+	if (!pair->native(pair->native_context, subject->rule_subject, &found)) {
+		return false;
+	}
+
+	if (ua_parser->collect_rule_stats) {
+		__atomic_fetch_add(&pair->hits, 1, __ATOMIC_RELAXED);
+	}
+
+	const char **fields = (const char **)((char *)state + group->state_offset);
+	size_t *lengths = &state->length[group->state_offset / sizeof(const char *)];
+
+	for (int i = 0; i < group->num_fields; i++) {
+		if (found.value[i]) {
+			char *out = malloc(found.length[i] + 1);
+			if (out) {
+				memcpy(out, found.value[i], found.length[i]);
+				out[found.length[i]] = '\0';
+			}
+			fields[i] = out;
+			lengths[i] = out ? found.length[i] : 0;
+		}
+	}
+
+	return true;
+}
+
+
+// Finds a UA_STRATEGY_LITERAL expression's text, filling in the match and
+// capture as pcre_exec() would. ASCII subjects only: PCRE's caseless
+// matching folds some other characters into ASCII letters.
+static int _literal_exec(const struct ua_expression_pair *pair, const char *str, const size_t length, int *matches_vector) {
+	const char *found = pair->regex_flag == 'i'
+		? simd_memmem_caseless(str, length, pair->literal, pair->literal_length)
+		: simd_memmem(str, length, pair->literal, pair->literal_length);
+
+	if (!found) {
+		return PCRE_ERROR_NOMATCH;
+	}
+
+	matches_vector[0] = matches_vector[2] = (int)(found - str);
+	matches_vector[1] = matches_vector[3] = (int)(found - str) + (int)pair->literal_length;
+
+	return pair->literal_capture ? 2 : 1;
+}
+
+
+// Runs a UA_STRATEGY_DFA expression. Only whether it matched counts, so the
+// result is 1 however many ways it matched.
+static int _dfa_exec(
+		const pcre *regex,
+		const pcre_extra *extra,
+		const char *str,
+		const size_t length,
+		const int options,
+		int *matches_vector)
+{
+	int workspace[DFA_WORKSPACE_SIZE];
+	const int result = pcre_dfa_exec(
+			regex, extra, str, (int)length, 0, options, matches_vector, SUBSTRING_VEC_COUNT, workspace, DFA_WORKSPACE_SIZE);
+
+	if (result >= 0) {
+		return 1;
+	} else if (result == PCRE_ERROR_NOMATCH) {
+		return result;
+	}
+
+	// Out of workspace and the like; backtracking always gets there
+	return pcre_exec(regex, extra, str, (int)length, 0, options, matches_vector, SUBSTRING_VEC_COUNT);
+}
+
+
+// The original expression a merged expression's MARK names, or NULL.
+static struct ua_merged_rule *_merged_rule(const struct ua_expression_pair *pair, const unsigned char *mark) {
+	if (!pair->merged_rules || !mark) {
+		return NULL;
+	}
+
+	const unsigned long n = strtoul((const char *)mark, NULL, 10);
+	return n <= pair->merged ? &pair->merged_rules[n] : NULL;
+}
+
+
+// Fills in a group's provenance from the expression which matched. A merged
+// expression's MARK names the original expression.
+static void _provenance_record(
+		struct uap_match_provenance *provenance,
+		const struct ua_parser_group *group,
+		const struct ua_expression_pair *pair,
+		const unsigned char *mark,
+		const int *matches_vector, // SUBSTRING_VEC_COUNT
+		const int num_matches)
+{
+	const struct ua_merged_rule *merged_rule = _merged_rule(pair, mark);
+
+	provenance->matched = 1;
+
+	if (merged_rule) {
+		provenance->rule_index = merged_rule->index;
+		provenance->fingerprint = merged_rule->fingerprint;
+	} else {
+		provenance->rule_index = pair->index;
+		provenance->fingerprint = _expression_pair_fingerprint(group->number, pair);
+	}
+
+	provenance->num_spans = num_matches < UAP_MAX_CAPTURE_SPANS ? num_matches : UAP_MAX_CAPTURE_SPANS;
+
+	for (int i = 0; i < provenance->num_spans; i++) {
+		provenance->span[i].start = matches_vector[i * 2];
+		provenance->span[i].end   = matches_vector[i * 2 + 1];
+	}
+}
+
+
 static int ua_parser_group_exec(
+		const struct uap_parser *ua_parser,
 		const struct ua_parser_group *group,
 		struct ua_parse_state *state,
-		const char *ua_string,
-		pcre *replacement_re)
+		const struct ua_subject *subject)
 {
 	struct ua_expression_pair *pair = group->expression_pairs;
-	const size_t ua_string_length = strlen(ua_string);
+	const char *ua_string = subject->string;
 
 	// @TODO urldecode ua_string
 	int matches_vector[SUBSTRING_VEC_COUNT];
+	bool failed = false;
+
+	struct uap_match_provenance *provenance = subject->provenance
+		? (struct uap_match_provenance *)((char *)subject->provenance + group->provenance_offset)
+		: NULL;
+
+	if (group->negative_cache
+			&& negative_cache_contains(group->negative_cache, subject->hash, subject->length, ua_parser->collect_rule_stats)) {
+		return 0;
+	}
 
 	while (pair) {
-		int pcre_result = pcre_exec(
-				pair->regex,
-				pair->pcre_extra,
-				ua_string,
-				ua_string_length,
-				0,
-				0,
-				matches_vector,
-				SUBSTRING_VEC_COUNT);
+		if (pair->native) {
+			if (provenance) {
+				provenance->rules_tried++;
+			}
+
+			if (_native_rule_exec(ua_parser, group, pair, state, subject)) {
+				if (provenance) {
+					provenance->matched = 1;
+					provenance->rule_index = pair->index;
+				}
+				return 1;
+			}
+
+			pair = pair->next;
+			continue;
+		}
+
+		// Lowercasing an ASCII string doesn't move anything, so offsets
+		// matched in the lowercase copy are valid in the original string.
+		bool use_lowercase = pair->lowercase_regex && subject->lowercase;
+		const bool use_ascii = !use_lowercase && pair->ascii_regex && subject->ascii;
+
+		const pcre *regex = pair->regex;
+		const pcre_extra *extra = pair->pcre_extra;
+
+		if (use_lowercase) {
+			regex = pair->lowercase_regex;
+			extra = pair->lowercase_pcre_extra;
+		} else if (use_ascii) {
+			regex = pair->ascii_regex;
+			extra = pair->ascii_pcre_extra;
+		}
+
+		if (!regex) {
+			const struct ua_lazy_regex *lazy = _expression_pair_compile_lazily(ua_parser, pair);
+
+			if (!lazy || !lazy->regex) {
+				failed = true;
+				pair = pair->next;
+				continue;
+			}
+
+			regex = lazy->regex;
+			extra = lazy->pcre_extra;
+		}
+
+		// Provenance and rule stats name the expression which matched
+		const bool which_rule = pair->merged_rules && (provenance || ua_parser->collect_rule_stats);
+		const bool in_order = pair->has_in_order && which_rule;
+
+		if (in_order) {
+			const struct ua_lazy_regex *lazy = _compile_lazily(
+					ua_parser, &pair->in_order, &pair->in_order_pattern, pair->regex_flag);
+
+			if (!lazy || !lazy->regex) {
+				failed = true;
+				pair = pair->next;
+				continue;
+			}
+
+			regex = lazy->regex;
+			extra = lazy->pcre_extra;
+			use_lowercase = false;
+		}
+
+		if (ua_parser->collect_rule_stats) {
+			__atomic_fetch_add(&pair->attempts, 1, __ATOMIC_RELAXED);
+		}
+
+		// The shared study data can't carry per-parse callout data or MARK
+		// output, so counting match steps and provenance use a copy.
+		pcre_extra counted_extra;
+		const unsigned char *mark = NULL;
+
+		if (provenance) {
+			provenance->rules_tried++;
+		}
+
+		if (which_rule) {
+			if (extra) {
+				counted_extra = *extra;
+			} else {
+				memset(&counted_extra, 0, sizeof(pcre_extra));
+			}
+
+			counted_extra.flags |= PCRE_EXTRA_MARK;
+			counted_extra.mark = (unsigned char **)&mark;
+			extra = &counted_extra;
+		}
+
+		if (subject->cost) {
+			subject->cost->rules_tried++;
+
+			if (ua_parser->flags & UAP_PARSER_COUNT_STEPS) {
+				if (!extra) {
+					memset(&counted_extra, 0, sizeof(pcre_extra));
+				} else if (extra != &counted_extra) {
+					counted_extra = *extra;
+				}
+
+				counted_extra.flags |= PCRE_EXTRA_CALLOUT_DATA;
+				counted_extra.callout_data = &subject->cost->match_steps;
+				extra = &counted_extra;
+			}
+		}
+
+		// ASCII is valid UTF-8, so UTF-8 expressions can skip validating it
+		int pcre_result;
+
+		if (pair->strategy == UA_STRATEGY_LITERAL && subject->ascii) {
+			pcre_result = _literal_exec(pair, ua_string, subject->length, matches_vector);
+		} else if (pair->strategy == UA_STRATEGY_DFA && !which_rule) {
+			pcre_result = _dfa_exec(
+					regex,
+					extra,
+					use_lowercase ? subject->lowercase : ua_string,
+					subject->length,
+					subject->ascii ? PCRE_NO_UTF8_CHECK : 0,
+					matches_vector);
+		} else {
+			pcre_result = pcre_exec(
+					regex,
+					extra,
+					use_lowercase ? subject->lowercase : ua_string,
+					subject->length,
+					0,
+					subject->ascii ? PCRE_NO_UTF8_CHECK : 0,
+					matches_vector,
+					SUBSTRING_VEC_COUNT);
+		}
 
 		if (pcre_result > 0) {
-			group->apply_replacements_cb(state, ua_string, pair, &matches_vector[0], pcre_result, replacement_re);
+			if (ua_parser->collect_rule_stats) {
+				__atomic_fetch_add(&pair->hits, 1, __ATOMIC_RELAXED);
+
+				struct ua_merged_rule *merged_rule = _merged_rule(pair, mark);
+				if (merged_rule) {
+					__atomic_fetch_add(&merged_rule->hits, 1, __ATOMIC_RELAXED);
+				}
+			}
+
+			group->apply_replacements_cb(state, ua_string, pair, &matches_vector[0], pcre_result);
+
+			if (provenance) {
+				_provenance_record(provenance, group, pair, mark, matches_vector, pcre_result);
+			}
 
 			// Found a matching expression, all done.
 			return 1;
@@ -171,12 +813,18 @@ static int ua_parser_group_exec(
 			case PCRE_ERROR_NOMATCH: break;
 			default:
 				printf("PCRE Error %d\n", pcre_result);
+				failed = true;
 		}
 
 		pair = pair->next;
 	}
 
-	// Failed to match any expressions!
+	// Failed to match any expressions! Remember that, unless an error
+	// means a later attempt might do better.
+	if (group->negative_cache && !failed) {
+		negative_cache_insert(group->negative_cache, subject->hash, subject->length, ua_parser->collect_rule_stats);
+	}
+
 	return 0;
 }
 
@@ -187,8 +835,8 @@ static void ua_parse_state_destroy(struct ua_parse_state *state, struct unique_s
 	// ua_parse_state is just a bunch of const character pointers, so, this is fine.
 	char **field = (char**)state;
 
-	// the overall size of the structure, divided by the size of a const character pointer (size of each field)
-	const char **end = (const char**)field + (sizeof(struct ua_parse_state) / sizeof(const char*));
+	// every pointer ahead of the lengths, the fields and the buffer
+	const char **end = (const char**)field + (offsetof(struct ua_parse_state, length) / sizeof(const char*));
 
 	while ((const char**)field < end) {
 		if (!unique_strings_owns(strings, *field)) {
@@ -204,74 +852,82 @@ static void ua_parse_state_create_useragent_info(
 		struct uap_useragent_info *info,
 		struct ua_parse_state *state)
 {
-	// Calculate total buffer requirements for all info strings
-	size_t size = 0;
 	const char **src_field = (const char**)state;
-	const char **end = src_field + (sizeof(struct ua_parse_state) / sizeof(const char*));
+	const char **dst_field = (const char**)info;
 
-	// Total up all the string lengths plus null terminators
-	while (src_field != end) {
-		size += *src_field ? strlen(*src_field) + 1 : 0;
-		src_field++;
-	}
+	// The lengths recorded while the fields were set are kept in the info
+	// too. One byte more holds the empty string for fields left unset.
+	size_t size = 1;
 
-	// Allocate a new buffer to hold the strings, this will be
-	// attached to the user_agent_info structure which has a
-	// lifetime beyond this system, so it will need to be freed.
-	// (automatically handled by user_agent_info_free());
-	char *buffer = realloc((void*)info->strings, size);
+	for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+		info->length[i] = src_field[i] ? state->length[i] : 0;
+		size += src_field[i] ? info->length[i] + 1 : 0;
+	}
 
-	// Wipe the info entirely (overwriting info->strings as well,
-	// but we'll re-attach that near the end)
-	memset(info, '\0', sizeof(struct uap_useragent_info));
+	// The buffer belongs to the info, which outlives the parse, and is
+	// kept from one parse to the next. It only grows, geometrically so a
+	// stream of slightly longer results doesn't reallocate every time;
+	// uap_useragent_info_shrink() gives memory back.
+	if (size > info->strings_capacity) {
+		size_t capacity = info->strings_capacity * 2;
+		capacity = capacity < INFO_STRINGS_MIN_SIZE ? INFO_STRINGS_MIN_SIZE : capacity;
+		capacity = capacity < size ? size : capacity;
+
+		// Nothing in the old buffer is needed, so there's no point copying it
+		free((void*)info->strings);
+		info->strings = malloc(capacity);
+		info->strings_capacity = info->strings ? capacity : 0;
+	}
 
-	// Go back to the first field to begin copying to the buffer
-	{
-		char *write_ptr = buffer;
-		src_field = (const char**)state;
-		const char **dst_field = (const char**)info;
+	char *buffer = (char*)info->strings;
 
-		while (src_field != end) {
-			*dst_field = write_ptr;
+	if (!buffer) {
+		for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+			dst_field[i] = "";
+			info->length[i] = 0;
+		}
+		info->strings_used = 0;
+		return;
+	}
 
-			if (*src_field != NULL) {
-				const size_t len = strlen(*src_field) + 1;
-				memcpy(write_ptr, *src_field, len);
-				write_ptr += len;
-			} else {
-				// This will point to a null terminator, since it's
-				// at the end of the buffer.
-				*dst_field = &buffer[size-1];
-			}
+	char *write_ptr = buffer;
+	char *empty = &buffer[size - 1];
+	*empty = '\0';
 
-			src_field++;
-			dst_field++;
+	for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+		if (src_field[i]) {
+			memcpy(write_ptr, src_field[i], info->length[i] + 1);
+			dst_field[i] = write_ptr;
+			write_ptr += info->length[i] + 1;
+		} else {
+			dst_field[i] = empty;
 		}
 	}
 
-	// Store a pointer to the beginning of the buffer
-	info->strings = buffer;
+	info->strings_used = size;
+}
+
+
+// Replacement results are trimmed of spaces. Set up by the first parser
+// created, as replacements are only applied by parsers.
+static struct simd_byteset spaces;
+static pthread_once_t spaces_once = PTHREAD_ONCE_INIT;
+
+
+static void _spaces_init() {
+	simd_byteset_init(&spaces, " ");
 }
 
 
 static void _apply_replacements(
 		const char **state_fields,
+		size_t *state_lengths,
 		const char *ua_string,
 		struct ua_expression_pair *pair,
-		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		pcre *replacement_re)
+		const int *matches_vector) // SUBSTRING_VEC_COUNT
 {
 	struct ua_replacement *repl = pair->replacements;
 
-	{
-		int i = 0;
-		while (repl) {
-			repl = repl->next;
-			i++;
-		}
-	}
-	repl = pair->replacements;
-
 	while (repl) {
 		// state_fields points to the first field, so the repl->type enum
 		// can be used to adjust the pointer to the appropriate field.
@@ -282,137 +938,83 @@ static void _apply_replacements(
 		// is allocated for the field value rather than just
 		// assigned to the unique_strings buffer. This is fine.
 		if (repl->has_placeholders) {
-			const char* replacement_str = unique_strings_get(&repl->value);
-			int out_size = strlen(replacement_str) + 1;
-			int replacements_vector[SUBSTRING_VEC_COUNT];
-
+			const char *replacement_str = unique_strings_get(&repl->value);
+			const size_t replacement_length = strlen(replacement_str);
+			size_t out_size = replacement_length + 1;
+
+			// Collect the positions of the "$N" placeholders within the
+			// replacement string, and the capture each one refers to.
+			int placeholder_offsets[MAX_PATTERN_MATCHES];
+			int replacement_index[MAX_PATTERN_MATCHES];
+			int replacements_count = 0;
 
-			// At this phase we're scanning a replacement expression for the
-			// "$N" patterns and collecting their positions within the replacement string.
-			// These positions will determine where we inject the matched patterns from the
-			// original user agent string (identified by `substring_vec`)
-			//
+			const char *end = replacement_str + replacement_length;
+			for (const char *c = replacement_str;
+					replacements_count < MAX_PATTERN_MATCHES && c < end && (c = memchr(c, '$', end - c));
+					c++) {
+				if (!isdigit((unsigned char)c[1])) {
+					continue;
+				}
 
-			int replacements_count = 0;
-			{
-				int repl_vec[6]; // pattern only has one expression, at most 2 matches
-				int start_offset = 0;
-				const int replacement_strlen = strlen(replacement_str);
-
-				while (start_offset < replacement_strlen && replacements_count < MAX_PATTERN_MATCHES) {
-					const int pcre_res = pcre_exec(
-						replacement_re,
-						NULL, // Simple expression; doesn't utilize study data.
-						replacement_str,
-						replacement_strlen,
-						start_offset,
-						0, // No options.
-						repl_vec,
-						6);
-
-					// Found a match
-					if (pcre_res > 0) {
-						replacements_vector[replacements_count * 2]     = repl_vec[0];
-						replacements_vector[replacements_count * 2 + 1] = repl_vec[1];
-						replacements_count++;
-						start_offset = repl_vec[1];
-					} else {
-						// No matches, exit the loop
-						start_offset = replacement_strlen;
-					}
+				const int idx = c[1] - '0';
+				if (idx < 1) {
+					// Invalid replacement index, this is likely an input error of regexes.yaml
+					// and so we'll treat it as a fatal error, since it could cause a buffer overflow.
+					return;
 				}
+
+				placeholder_offsets[replacements_count] = (int)(c - replacement_str);
+				replacement_index[replacements_count] = idx;
+				replacements_count++;
+
+				// Swap the "$N" for the matched string
+				const int match_length = matches_vector[idx * 2 + 1] - matches_vector[idx * 2];
+				out_size += match_length > 0 ? match_length - 2 : 0;
+				c++;
 			}
 
 			// repl->has_placeholders is true, so this should always succeed.
 			if (replacements_count > 0) {
-				// lookup for ua_string/substring_vec[] positions
-				int replacement_index[MAX_PATTERN_MATCHES];
+				char *out = malloc(out_size);
+				size_t write_index = 0;
+				size_t read_index = 0;
 
-				// Iterate over replacement identifier matches
 				for (int i = 0; i < replacements_count; i++) {
-					// Convert the ASCII character to the matching integer
-					// "$1" becomes integer 1. We don't start with the 0-position pattern match
-					// because that is the overall PCRE match result.
-					replacement_index[i] = replacement_str[replacements_vector[i*2] + 1] - 48;
-					assert(replacement_index[i] > 0 && replacement_index[i] < 10);
-
-					if (replacement_index[i] < 1 || replacement_index[i] > 9) {
-						// Invalid replacement index, this is likely an input error of regexes.yaml
-						// and so we'll treat it as a fatal error, since it could cause a buffer overflow.
-						return;
-					}
+					// Copy everything from the replacement string leading up
+					// to the placeholder, then skip the "$N" itself.
+					const size_t literal_length = placeholder_offsets[i] - read_index;
+					memcpy(out + write_index, replacement_str + read_index, literal_length);
+					write_index += literal_length;
+					read_index = placeholder_offsets[i] + 2;
 
-					const int idx = replacement_index[i];
-					const int replacement_strlen = matches_vector[idx * 2 + 1] - matches_vector[idx * 2];
+					// Copy the matched pattern from the original user agent
+					// string, identified by `matches_vector`.
+					const int match_start = matches_vector[replacement_index[i] * 2];
+					const int match_end   = matches_vector[replacement_index[i] * 2 + 1];
 
-					// For each replacement match, we SUBTRACT 2 from the out_size (strlen("$1"))
-					// and then we ADD the size of the matches string that will be inserted
-					if (replacement_strlen > 0) {
-						out_size += (-2) + replacement_strlen;
+					if (match_end > match_start) {
+						memcpy(out + write_index, ua_string + match_start, match_end - match_start);
+						write_index += match_end - match_start;
 					}
 				}
 
-				// Allocate a new buffer for the output
-				char *out = calloc(1, out_size);
-
-				// Now combine matched user agent patterns with replacement patterns.
-				int write_index = 0; // to output.
-				int read_index = 0; // from replacement_str, eg: "Foo $5 Bar $2 Baz"
-
-				for (int i = 0; i < replacements_count; i++) {
+				// Copy any remaining replacement string data
+				memcpy(out + write_index, replacement_str + read_index, replacement_length - read_index);
+				write_index += replacement_length - read_index;
 
-					// Copy everything from the replacement string leading up
-					// to the point of the first match.
-					//
-					// "Foo $5 Bar $2 Baz"
-					//  ---^
-					while (read_index < replacements_vector[i * 2]) {
-						out[write_index++] = replacement_str[read_index++];
-					}
-
-					// Advance the read_index by 2 bytes to skip the "$N" which
-					// we should now be at.
-					//
-					// "Foo $5 Bar $2 Baz"
-					//  ------^
-					assert(replacement_str[read_index] == '$');
-					read_index += 2;
-
-					// Copy the matched pattern from the original user agent
-					// string, identified by `matches_vector`.
-					int match_start     = matches_vector[replacement_index[i] * 2];
-					const int match_end = matches_vector[replacement_index[i] * 2 + 1];
-
-					while (match_start < match_end) {
-						out[write_index++] = ua_string[match_start++];
-					}
-				}
-
-				// Copy any remaining replacement string data
-				while (replacement_str[read_index]) {
-					out[write_index++] = replacement_str[read_index++];
-				}
-
-				// Trim leading whitespace
-				{
-					int i = 0;
-					while (i < out_size && out[i] == ' ') { i++; }
-
-					for (int j = i; j < out_size; j++) {
-						out[j - i] = out[j];
-					}
-				}
-
-				// Trim trailing whitespace
-				while (write_index > 0 && out[--write_index] == ' ') {
-					out[write_index] = '\0';
-				}
+				// Trim leading and trailing whitespace
+				size_t start;
+				const size_t length = simd_trim(out, write_index, &spaces, &start);
+				memmove(out, out + start, length);
+				out[length] = '\0';
 
 				// All done
 				*dest = out;
+				state_lengths[repl->type] = length;
 			}
 		} else {
 			*dest = unique_strings_get(&repl->value);
+			state_lengths[repl->type] = repl->length;
 		}
 
 		repl = repl->next;
@@ -422,6 +1024,7 @@ static void _apply_replacements(
 
 static void _apply_defaults(
 		const char **field,
+		size_t *length,
 		const char *ua_string,
 		const int num_fields,
 		const int *matches_vector,
@@ -438,27 +1041,32 @@ static void _apply_defaults(
 			char *out = calloc(1, len + 1);
 			memcpy(out, &ua_string[matches_vector[mv_idx]], len);
 			*field = out;
+			*length = len;
 		}
 
 		++field;
+		++length;
 	}
 }
 
 
 static void _apply_defaults_for_device(
 		struct ua_parse_state_device *device,
+		size_t *device_lengths,
 		const char *ua_string,
 		const int *matches_vector,
 		const int num_matches)
 {
 	if (num_matches > 1) {
 		const char **fields[] = { &device->family, &device->model };
+		size_t *lengths[] = { &device_lengths[0], &device_lengths[2] };
 		for (int i = 0; i < 2; i++) {
 			// If the field is undefined, use the first matched pattern if available
 			if (!*fields[i]) {
 				const size_t len = matches_vector[2 + 1] - matches_vector[2];
 				*fields[i] = calloc(1, len + 1);
 				memcpy((void*)*fields[i], &ua_string[matches_vector[2]], len);
+				*lengths[i] = len;
 			}
 		}
 	}
@@ -470,11 +1078,11 @@ inline static void apply_replacements_user_agent(
 		const char *ua_string,
 		struct ua_expression_pair *pair,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->user_agent, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults((const char**)&state->user_agent, ua_string, 4, matches_vector, num_matches);
+	size_t *lengths = &state->length[STATE_FIELD_INDEX(user_agent)];
+	_apply_replacements((const char**)&state->user_agent, lengths, ua_string, pair, matches_vector);
+	_apply_defaults((const char**)&state->user_agent, lengths, ua_string, 4, matches_vector, num_matches);
 }
 
 
@@ -483,11 +1091,11 @@ inline static void apply_replacements_os(
 		const char *ua_string,
 		struct ua_expression_pair *pair,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->os, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults((const char**)&state->os, ua_string, 5, matches_vector, num_matches);
+	size_t *lengths = &state->length[STATE_FIELD_INDEX(os)];
+	_apply_replacements((const char**)&state->os, lengths, ua_string, pair, matches_vector);
+	_apply_defaults((const char**)&state->os, lengths, ua_string, 5, matches_vector, num_matches);
 }
 
 
@@ -496,34 +1104,99 @@ inline static void apply_replacements_device(
 		const char *ua_string,
 		struct ua_expression_pair *pair,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->device, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults_for_device(&state->device, ua_string, matches_vector, num_matches);
+	size_t *lengths = &state->length[STATE_FIELD_INDEX(device)];
+	_apply_replacements((const char**)&state->device, lengths, ua_string, pair, matches_vector);
+	_apply_defaults_for_device(&state->device, lengths, ua_string, matches_vector, num_matches);
+}
+
+
+// Called by PCRE before every item of an expression compiled with
+// PCRE_AUTO_CALLOUT, which makes it a count of match steps.
+static int _count_match_step(pcre_callout_block *block) {
+	if (block->callout_data) {
+		(*(uint64_t *)block->callout_data)++;
+	}
+	return 0;
 }
 
 
 struct uap_parser *uap_parser_create() {
+	return uap_parser_create_with_options(NULL);
+}
+
+
+struct uap_parser *uap_parser_create_with_options(const struct uap_parser_options *options) {
+	pthread_once(&spaces_once, &_spaces_init);
+
 	struct uap_parser *ua_parser = malloc(sizeof(struct uap_parser));
 
 	ua_parser->user_agent_parser_group.expression_pairs = NULL;
 	ua_parser->os_parser_group.expression_pairs         = NULL;
 	ua_parser->device_parser_group.expression_pairs     = NULL;
+	ua_parser->user_agent_parser_group.rule_count       = 0;
+	ua_parser->os_parser_group.rule_count               = 0;
+	ua_parser->device_parser_group.rule_count           = 0;
+	ua_parser->user_agent_parser_group.num_fields       = 4;
+	ua_parser->os_parser_group.num_fields               = 5;
+	ua_parser->device_parser_group.num_fields           = 3;
+	ua_parser->user_agent_parser_group.pending_rules    = NULL;
+	ua_parser->os_parser_group.pending_rules            = NULL;
+	ua_parser->device_parser_group.pending_rules        = NULL;
+	ua_parser->user_agent_parser_group.state_offset     = offsetof(struct ua_parse_state, user_agent);
+	ua_parser->os_parser_group.state_offset             = offsetof(struct ua_parse_state, os);
+	ua_parser->device_parser_group.state_offset         = offsetof(struct ua_parse_state, device);
+	ua_parser->user_agent_parser_group.provenance_offset = offsetof(struct uap_provenance, user_agent);
+	ua_parser->os_parser_group.provenance_offset        = offsetof(struct uap_provenance, os);
+	ua_parser->device_parser_group.provenance_offset    = offsetof(struct uap_provenance, device);
+	ua_parser->user_agent_parser_group.number           = 0;
+	ua_parser->os_parser_group.number                   = 1;
+	ua_parser->device_parser_group.number               = 2;
 	ua_parser->strings                                  = NULL;
+	ua_parser->flags                                    = options ? options->flags : 0;
+	ua_parser->memory_budget                            = options ? options->memory_budget : 0;
+
+	if (options) {
+		ua_parser->executor = options->executor;
+	} else {
+		memset(&ua_parser->executor, 0, sizeof(struct uap_executor));
+	}
+	ua_parser->collect_rule_stats                       = false;
+	ua_parser->has_rule_stats                           = false;
+	ua_parser->has_lowercase_rules                      = false;
+	ua_parser->has_ascii_rules                          = false;
+	ua_parser->has_literal_rules                        = false;
+	ua_parser->has_native_rules                         = false;
+	ua_parser->profile                                  = NULL;
+	ua_parser->profile_count                            = 0;
+	ua_parser->generation                               = __atomic_add_fetch(&parser_generations, 1, __ATOMIC_RELAXED);
+	ua_parser->scratch                                  = calloc(1, sizeof(struct ua_scratch_pool));
+
+	if (ua_parser->scratch) {
+		ua_parser->scratch->headroom = SIZE_MAX;
+	}
+
+	// Fall-through caches are only worth their memory when asked for
+	const size_t cache_entries = options ? options->negative_cache_entries : 0;
+	ua_parser->user_agent_parser_group.negative_cache = cache_entries ? negative_cache_create(cache_entries) : NULL;
+	ua_parser->os_parser_group.negative_cache         = cache_entries ? negative_cache_create(cache_entries) : NULL;
+	ua_parser->device_parser_group.negative_cache     = cache_entries ? negative_cache_create(cache_entries) : NULL;
+
+	ua_parser->workload = options && options->workload_sampling
+		? workload_create(options->workload_sampling, options->workload_window_seconds)
+		: NULL;
+
+	// pcre_callout is process-wide, but only expressions compiled for step
+	// counting ever call it.
+	if (ua_parser->flags & UAP_PARSER_COUNT_STEPS) {
+		pcre_callout = &_count_match_step;
+	}
 
 	ua_parser->user_agent_parser_group.apply_replacements_cb = &apply_replacements_user_agent;
 	ua_parser->os_parser_group.apply_replacements_cb         = &apply_replacements_os;
 	ua_parser->device_parser_group.apply_replacements_cb     = &apply_replacements_device;
 
-	// Compile expressions for finding $1...$9 in replacement strings
-	{
-		const char *error;
-		int error_offset;
-		ua_parser->replacement_re = pcre_compile("\\$\\d", PCRE_UTF8, &error, &error_offset, NULL);
-		assert(ua_parser->replacement_re);
-	}
-
 	return ua_parser;
 }
 
@@ -532,13 +1205,92 @@ void uap_parser_destroy(struct uap_parser *ua_parser) {
 	ua_expression_pair_destroy(ua_parser->user_agent_parser_group.expression_pairs);
 	ua_expression_pair_destroy(ua_parser->os_parser_group.expression_pairs);
 	ua_expression_pair_destroy(ua_parser->device_parser_group.expression_pairs);
+	ua_expression_pair_destroy(ua_parser->user_agent_parser_group.pending_rules);
+	ua_expression_pair_destroy(ua_parser->os_parser_group.pending_rules);
+	ua_expression_pair_destroy(ua_parser->device_parser_group.pending_rules);
+	negative_cache_destroy(ua_parser->user_agent_parser_group.negative_cache);
+	negative_cache_destroy(ua_parser->os_parser_group.negative_cache);
+	negative_cache_destroy(ua_parser->device_parser_group.negative_cache);
+	workload_destroy(ua_parser->workload);
 	unique_strings_destroy(ua_parser->strings);
-	pcre_free(ua_parser->replacement_re);
+	_scratch_release(ua_parser->scratch);
+	free(ua_parser->scratch);
+	free(ua_parser->profile);
 	free(ua_parser);
 }
 
 
-static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_parser_t *yaml_parser) {
+// Compile `pattern` and attach it to `pair`, along with any faster
+// equivalents. Only `pair` is modified, so expressions can be compiled in
+// parallel. Prints the PCRE error and returns false on failure.
+static bool ua_expression_pair_compile(
+		const struct uap_parser *ua_parser,
+		struct ua_expression_pair *pair,
+		const char *pattern,
+		const char regex_flag)
+{
+	const char *error;
+	int erroffset;
+	const int options = _compile_options(ua_parser, regex_flag);
+
+	// Compile the expression
+	pcre *re = pcre_compile(
+			pattern,
+			options,     // options
+			&error,      // error message
+			&erroffset,  // error offset
+			NULL);       // use default character tables
+
+	if (!re) {
+		printf("pcre error: %d %s\n", erroffset, error);
+		return false;
+	}
+
+	pair->regex = re;
+	pair->pcre_extra = pcre_study(re, 0, &error);
+
+	// Matched against pure ASCII subjects, an ASCII-only expression behaves
+	// the same in byte mode, without the cost of PCRE's UTF-8 handling.
+	const bool byte_mode = ua_parser->flags & UAP_PARSER_ASCII_RULES;
+
+	if (byte_mode && pattern_ascii(pattern)) {
+		pair->ascii_regex = pcre_compile(pattern, options & ~PCRE_UTF8, &error, &erroffset, NULL);
+
+		if (pair->ascii_regex) {
+			pair->ascii_pcre_extra = pcre_study(pair->ascii_regex, 0, &error);
+		}
+	}
+
+	// PCRE's caseless matching is slow and disables some of its
+	// start-of-match optimizations, so prepare a case-sensitive
+	// equivalent for use with pure ASCII user agents. The rewrite is
+	// always ASCII, so it can be byte mode too.
+	if (regex_flag == 'i') {
+		char *lowercase_pattern = malloc(strlen(pattern) + 1);
+
+		if (lowercase_pattern && pattern_lowercase(lowercase_pattern, pattern)) {
+			pair->lowercase_regex = pcre_compile(
+					lowercase_pattern,
+					options & ~(PCRE_CASELESS | (byte_mode ? PCRE_UTF8 : 0)),
+					&error,
+					&erroffset,
+					NULL);
+
+			if (pair->lowercase_regex) {
+				pair->lowercase_pcre_extra = pcre_study(pair->lowercase_regex, 0, &error);
+			}
+		}
+
+		free(lowercase_pattern);
+	}
+
+	pair->regex_flag = regex_flag;
+
+	return true;
+}
+
+
+static bool _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_parser_t *yaml_parser) {
 	// Structure to retain the active parsing state
 	struct {
 		enum {
@@ -580,10 +1332,18 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 	yaml_token_t token;
 	memset(&token, 0, sizeof(yaml_token_t));
 
+	bool valid = true;
+
 	// Parse. That. Yaml.
 	do {
 		yaml_token_delete(&token);
-		yaml_parser_scan(yaml_parser, &token);
+
+		// A broken document never reaches its end token
+		if (!yaml_parser_scan(yaml_parser, &token)) {
+			printf("yaml error: %zu %s\n", yaml_parser->problem_mark.line + 1, yaml_parser->problem);
+			valid = false;
+			break;
+		}
 
 		switch (token.type) {
 			case YAML_KEY_TOKEN: {
@@ -603,34 +1363,11 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 					// Commit the active item if present
 					//##################################
 					if (new_pair != NULL && state.regex_temp) {
-						const char *error;
-						int erroffset;
-
-						const int options = 0
-							| PCRE_UTF8
-							| PCRE_EXTRA
-							| (state.regex_flag == 'i' ? PCRE_CASELESS : 0)
-							;
-
-						// Compile the expression (handled here
-						pcre *re = pcre_compile(
-								state.regex_temp,
-								options,     // options - @toto handle regex_flag
-								&error,      // error message
-								&erroffset,  // error offset
-								NULL);       // use default character tables
-
-						// If the expression compiled successfully, attach it to
-						// the new expression_pair, otherwise free the new pair and continue
-						if (re) {
-							new_pair->regex = re;
-							new_pair->pcre_extra = pcre_study(re, 0, &error);
-							state.regex_flag = '\0';
-						} else {
-							printf("pcre error: %d %s\n", erroffset, error);
-							ua_expression_pair_destroy(new_pair);
-							break;
-						}
+						// Expressions are compiled once the whole file is read, see
+						// _user_agent_parser_compile()
+						new_pair->pattern = unique_strings_add(ua_parser->strings, state.regex_temp);
+						new_pair->regex_flag = state.regex_flag;
+						state.regex_flag = '\0';
 
 						int i = 0;
 						struct ua_replacement *repl = new_pair->replacements;
@@ -640,6 +1377,7 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 						}
 
 						if (state.current_expression_pair_insert) {
+							new_pair->index = state.current_parser_group->rule_count++;
 							*state.current_expression_pair_insert  = new_pair;
 							state.current_expression_pair_insert   = &(new_pair->next);
 						} else {
@@ -775,6 +1513,7 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 								struct ua_replacement *repl = malloc(sizeof(struct ua_replacement));
 								repl->value = unique_strings_add(ua_parser->strings, value);
 								repl->has_placeholders = strstr(unique_strings_get(&repl->value), "$") != NULL;
+								repl->length = strlen(value);
 								repl->type = state.current_replacement_type;
 
 								// Append the new ua_replacement to the current new_expression_pair
@@ -803,104 +1542,2313 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 
 	free(state.regex_temp);
 	yaml_token_delete(&token);
+
+	return valid;
 }
 
 
-static void _user_agent_parser_init(struct uap_parser *ua_parser, yaml_parser_t *parser) {
-	// Create unique_strings_t for string deduping/packing of replacement strings
-	ua_parser->strings = unique_strings_create();
+#define MAX_MERGED_EXPRESSIONS 32
 
-	// device.family should default to "Other" if nothing is parsed, so we'll
-	// add "Other" as a unique string and grab a handle for possible later user.
-	ua_parser->string_handle_other = unique_strings_add(ua_parser->strings, "Other");
+static bool _replacements_equal(const struct ua_replacement *a, const struct ua_replacement *b) {
+	int a_count = 0, b_count = 0;
+	for (const struct ua_replacement *repl = a; repl; repl = repl->next) a_count++;
+	for (const struct ua_replacement *repl = b; repl; repl = repl->next) b_count++;
 
-	_user_agent_parser_parse_yaml(ua_parser, parser);
+	if (a_count != b_count) {
+		return false;
+	}
 
-	// Free the YAML parser
-	yaml_parser_delete(parser);
+	for (const struct ua_replacement *repl = a; repl; repl = repl->next) {
+		const struct ua_replacement *other = b;
+		while (other && (other->type != repl->type ||
+				strcmp(unique_strings_get(&other->value), unique_strings_get(&repl->value)) != 0)) {
+			other = other->next;
+		}
+		if (!other) {
+			return false;
+		}
+	}
 
-	// Free look-up structures and shrink allocated space if necessary
-	unique_strings_freeze(ua_parser->strings);
+	return true;
 }
 
 
-int uap_parser_read_file(struct uap_parser *ua_parser, FILE *fd) {
-	yaml_parser_t parser;
+// True if the pair's result could depend on what its captures matched,
+// either through "$N" placeholders or default values taken from captures.
+static bool _result_uses_captures(const struct ua_parser_group *group, const struct ua_expression_pair *pair) {
+	unsigned int replaced = 0;
 
-	// Initialize YAML parser
-	if (!yaml_parser_initialize(&parser)) {
-		return 0;
+	for (const struct ua_replacement *repl = pair->replacements; repl; repl = repl->next) {
+		if (repl->has_placeholders) {
+			return true;
+		}
+		replaced |= 1u << repl->type;
 	}
 
-	yaml_parser_set_input_file(&parser, fd);
-	_user_agent_parser_init(ua_parser, &parser);
+	if (replaced == (1u << group->num_fields) - 1) {
+		return false;
+	}
 
-	return 1;
+	int captures = 0;
+	pcre_fullinfo(pair->regex, pair->pcre_extra, PCRE_INFO_CAPTURECOUNT, &captures);
+	return captures > 0;
 }
 
 
-int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *buffer, const size_t bufsize) {
-	yaml_parser_t parser;
+// Expressions which refer to groups by name or by absolute position from
+// elsewhere, or which use backtracking verbs, behave differently once they're
+// one branch of a larger expression.
+static bool _pattern_mergeable(const char *pattern) {
+	bool in_class = false;
+
+	for (const char *c = pattern; *c; c++) {
+		if (*c == '\\') {
+			if (!in_class && (c[1] == 'G' || c[1] == 'g' || c[1] == 'k')) return false;
+			if (!*++c) break;
+		} else if (in_class) {
+			in_class = *c != ']';
+		} else if (*c == '[') {
+			in_class = true;
+			if (c[1] == '^') c++;
+			if (c[1] == ']') c++;
+		} else if (*c == '(' && c[1] == '*') {
+			return false;
+		} else if (*c == '(' && c[1] == '?') {
+			if (!c[2] || (!strchr(":=!>|", c[2]) && !(c[2] == '<' && (c[3] == '=' || c[3] == '!')))) {
+				return false;
+			}
+		}
+	}
 
-	if (!yaml_parser_initialize(&parser)) {
-		return 0;
+	return true;
+}
+
+
+// Alternation of the `count` expressions starting at `run`, as described in
+// ua_parser_group_merge_run(). NULL on allocation failure.
+static char *_merged_pattern(const struct ua_expression_pair *run, const unsigned int count, const bool in_order) {
+	size_t size = 32;
+	const struct ua_expression_pair *pair = run;
+
+	for (unsigned int i = 0; i < count; i++, pair = pair->next) {
+		size += strlen(unique_strings_get(&pair->pattern)) + 32;
 	}
 
-	yaml_parser_set_input_string(&parser, buffer, bufsize);
-	_user_agent_parser_init(ua_parser, &parser);
+	char *pattern = malloc(size);
+	if (!pattern) {
+		return NULL;
+	}
 
-	return 1;
+	char *write_ptr = pattern;
+	write_ptr += sprintf(write_ptr, in_order ? "^(?|" : "(?|");
+
+	pair = run;
+	for (unsigned int i = 0; i < count; i++, pair = pair->next) {
+		write_ptr += sprintf(write_ptr, "%s%s(?:%s)(*MARK:%u)",
+				i ? "|" : "",
+				in_order ? "[\\s\\S]*?\\K" : "",
+				unique_strings_get(&pair->pattern),
+				i);
+	}
+	sprintf(write_ptr, ")");
+
+	return pattern;
 }
 
 
-int uap_parser_parse_string(const struct uap_parser *ua_parser, struct uap_useragent_info *info, const char* user_agent_string) {
-	struct ua_parse_state state;
-	memset(&state, 0, sizeof(struct ua_parse_state));
+// Folds the run of `count` expressions starting at `*first` into a single
+// expression.  Returns false (leaving the run alone) if it can't be compiled.
+static bool ua_parser_group_merge_run(
+		struct uap_parser *ua_parser,
+		const struct ua_parser_group *group,
+		struct ua_expression_pair **first,
+		const unsigned int count)
+{
+	struct ua_expression_pair *run = *first;
+	struct ua_expression_pair *last = NULL;
+	struct ua_expression_pair *pair = run;
+	bool uses_captures = false;
+
+	for (unsigned int i = 0; i < count; i++, pair = pair->next) {
+		uses_captures = uses_captures || _result_uses_captures(group, pair);
+		last = pair;
+	}
 
-	const int matched_groups = 0
-		+ ua_parser_group_exec(&ua_parser->user_agent_parser_group, &state, user_agent_string, ua_parser->replacement_re)
-		+ ua_parser_group_exec(&ua_parser->os_parser_group, &state, user_agent_string, ua_parser->replacement_re)
-		+ ua_parser_group_exec(&ua_parser->device_parser_group, &state, user_agent_string, ua_parser->replacement_re);
+	// A branch reset group numbers each alternative's captures from 1, so
+	// they line up with what the original expressions produced.
+	//
+	// If the result can't depend on the captures, plain alternation is enough.
+	// Otherwise every branch has to try every start position before the next
+	// branch gets a turn, just like trying the expressions one after another.
+	// \K then starts the overall match (group 0) where the expression's did.
+	// Plain alternation keeps that form as well, for when it matters which
+	// expression matched.
+	//
+	// Each branch ends with a MARK naming the expression, for provenance. At
+	// the start it would hide the branch's first characters from PCRE's
+	// start-of-match optimizations.
+	char *pattern = _merged_pattern(run, count, uses_captures);
+	char *in_order_pattern = uses_captures ? NULL : _merged_pattern(run, count, true);
+	struct ua_merged_rule *merged_rules = calloc(count, sizeof(struct ua_merged_rule));
+	if (!pattern || (!uses_captures && !in_order_pattern) || !merged_rules) {
+		free(pattern);
+		free(in_order_pattern);
+		free(merged_rules);
+		return false;
+	}
 
-	// Special case for family, if (null) then set to "Other"
-	const char **family[] = { &state.device.family, &state.os.family, &state.user_agent.family };
-	for (int i = 0; i < 3; i++) {
-		if (*family[i] == NULL) {
-			*family[i] = unique_strings_get(&ua_parser->string_handle_other);
+	pair = run;
+	for (unsigned int i = 0; i < count; i++, pair = pair->next) {
+		merged_rules[i].index       = pair->index;
+		merged_rules[i].fingerprint = _expression_pair_fingerprint(group->number, pair);
+		merged_rules[i].hits        = pair->hits;
+	}
+
+	struct ua_expression_pair *merged = calloc(1, sizeof(struct ua_expression_pair));
+	const bool compiled = merged && ua_expression_pair_compile(ua_parser, merged, pattern, run->regex_flag);
+
+	if (!compiled) {
+		free(pattern);
+		free(in_order_pattern);
+		free(merged_rules);
+		free(merged);
+		return false;
+	}
+
+	merged->pattern = unique_strings_add(ua_parser->strings, pattern);
+	free(pattern);
+
+	if (in_order_pattern) {
+		merged->has_in_order     = true;
+		merged->in_order_pattern = unique_strings_add(ua_parser->strings, in_order_pattern);
+		free(in_order_pattern);
+	}
+
+	merged->replacements = run->replacements;
+	merged->index        = run->index;
+	merged->attempts     = run->attempts;
+	merged->merged       = count - 1;
+	merged->merged_rules = merged_rules;
+	merged->next         = last->next;
+	run->replacements    = NULL;
+
+	for (pair = run; pair != merged->next; pair = pair->next) {
+		merged->hits += pair->hits;
+		merged->merged += pair->merged;
+	}
+
+	last->next = NULL;
+	ua_expression_pair_destroy(run);
+	*first = merged;
+
+	return true;
+}
+
+
+// Merges runs of adjacent expressions with identical replacements, so user
+// agents which match none of them cost one pcre_exec() instead of many.
+static void ua_parser_group_merge(struct uap_parser *ua_parser, struct ua_parser_group *group) {
+	struct ua_expression_pair **insert = &group->expression_pairs;
+
+	while (*insert) {
+		struct ua_expression_pair *first = *insert;
+		unsigned int count = 1;
+
+		// Lazily compiled expressions stay as they are
+		if (first->regex && _pattern_mergeable(unique_strings_get(&first->pattern))) {
+			for (struct ua_expression_pair *pair = first->next;
+					pair && count < MAX_MERGED_EXPRESSIONS &&
+					pair->regex &&
+					pair->regex_flag == first->regex_flag &&
+					_replacements_equal(pair->replacements, first->replacements) &&
+					_pattern_mergeable(unique_strings_get(&pair->pattern));
+					pair = pair->next)
+			{
+				count++;
+			}
+		}
+
+		if (count > 1) {
+			ua_parser_group_merge_run(ua_parser, group, insert, count);
 		}
+
+		insert = &(*insert)->next;
 	}
+}
 
-	if (matched_groups > 0) {
-		ua_parse_state_create_useragent_info(info, &state);
+
+//####################
+// Rule profiles
+//####################
+
+#define PROFILE_MAGIC "UAPP"
+#define PROFILE_VERSION 1
+#define PROFILE_HEADER_SIZE 16
+#define PROFILE_ENTRY_SIZE 24
+#define PROFILE_MAX_ENTRIES (1 << 20)
+#define PROFILE_JIT_MIN_SHARE 100 // JIT expressions tried by 1/100 of the group's parses
+
+struct ua_profile_entry {
+	uint64_t fingerprint;
+	uint64_t hits;
+	uint64_t attempts;
+};
+
+
+static int _compare_profile_entries(const void *a, const void *b) {
+	const uint64_t x = ((const struct ua_profile_entry *)a)->fingerprint;
+	const uint64_t y = ((const struct ua_profile_entry *)b)->fingerprint;
+	return (x > y) - (x < y);
+}
+
+
+static const struct ua_profile_entry *_profile_find(const struct uap_parser *ua_parser, const uint64_t fingerprint) {
+	if (!ua_parser->profile) {
+		return NULL;
 	}
 
-	ua_parse_state_destroy(&state, ua_parser->strings);
+	const struct ua_profile_entry key = { .fingerprint = fingerprint };
+	return bsearch(&key, ua_parser->profile, ua_parser->profile_count, sizeof(struct ua_profile_entry), &_compare_profile_entries);
+}
 
-	return matched_groups;
+
+// Swaps the study data of an expression for a JIT compiled version.
+static void _jit_compile(const pcre *regex, pcre_extra **extra) {
+	if (!regex || (*extra && ((*extra)->flags & PCRE_EXTRA_EXECUTABLE_JIT))) {
+		return;
+	}
+
+	const char *error;
+	pcre_extra *jit_extra = pcre_study(regex, PCRE_STUDY_JIT_COMPILE, &error);
+
+	if (jit_extra) {
+		pcre_free_study(*extra);
+		*extra = jit_extra;
+	}
 }
 
 
-struct uap_useragent_info * uap_useragent_info_create() {
-	struct uap_useragent_info *info = calloc(1, sizeof(struct uap_useragent_info));
-	return info;
+// Seeds a merged expression's counts from its originals' entries: each has
+// its own hits, and every parse reaching the merged expression tries the
+// first. Returns the number of originals found.
+static size_t _profile_apply_merged(const struct uap_parser *ua_parser, struct ua_expression_pair *pair) {
+	size_t found = 0;
+	uint64_t hits = 0;
+
+	for (unsigned int j = 0; j <= pair->merged; j++) {
+		const struct ua_profile_entry *entry = _profile_find(ua_parser, pair->merged_rules[j].fingerprint);
+
+		if (entry) {
+			pair->merged_rules[j].hits = entry->hits;
+			found++;
+
+			if (j == 0) {
+				pair->attempts = entry->attempts;
+			}
+		}
+
+		hits += pair->merged_rules[j].hits;
+	}
+
+	pair->hits = hits;
+	return found;
 }
 
 
-void uap_useragent_info_init(struct uap_useragent_info *info) {
-	memset(info, 0, sizeof(struct uap_useragent_info));
+// Seeds the hit counts from the profile, then reorders the groups and JIT
+// compiles every expression a good share of parses try. Returns the number
+// of expressions found in the profile.
+static size_t _profile_apply(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	size_t found = 0;
+
+	for (int i = 0; i < 3; i++) {
+		uint64_t most_attempts = 0;
+
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			if (pair->native) {
+				continue;
+			}
+
+			if (pair->merged_rules) {
+				found += _profile_apply_merged(ua_parser, pair);
+			} else {
+				const struct ua_profile_entry *entry = _profile_find(ua_parser, _expression_pair_fingerprint(i, pair));
+
+				if (entry) {
+					pair->hits = entry->hits;
+					pair->attempts = entry->attempts;
+					found++;
+				}
+			}
+
+			if (pair->attempts > most_attempts) {
+				most_attempts = pair->attempts;
+			}
+		}
+
+		// Nearly every parse reaching the group tries its busiest expression,
+		// so that stands in for the number of parses. Callouts rule out JIT.
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			if (pair->attempts > 0 && pair->attempts * PROFILE_JIT_MIN_SHARE >= most_attempts &&
+					!(ua_parser->flags & UAP_PARSER_COUNT_STEPS)) {
+				_jit_compile(pair->regex, &pair->pcre_extra);
+				_jit_compile(pair->lowercase_regex, &pair->lowercase_pcre_extra);
+				_jit_compile(pair->ascii_regex, &pair->ascii_pcre_extra);
+			}
+		}
+	}
+
+	ua_parser->has_rule_stats |= found > 0;
+
+	uap_parser_reorder_rules(ua_parser);
+	return found;
 }
 
 
-void uap_useragent_info_cleanup(struct uap_useragent_info *info) {
-	if (info != NULL) {
-		if (info->strings) {
-			free((void*)info->strings);
+// Note which kinds of subject preparation the expressions can use.
+static void _user_agent_parser_update_variants(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	ua_parser->has_lowercase_rules = false;
+	ua_parser->has_ascii_rules = false;
+	ua_parser->has_literal_rules = false;
+
+	for (int i = 0; i < 3; i++) {
+		for (const struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			ua_parser->has_lowercase_rules |= pair->lowercase_regex != NULL;
+			ua_parser->has_ascii_rules |= pair->ascii_regex != NULL;
+			ua_parser->has_literal_rules |= pair->strategy == UA_STRATEGY_LITERAL;
 		}
 	}
 }
 
 
-void uap_useragent_info_destroy(struct uap_useragent_info *info) {
-	uap_useragent_info_cleanup(info);
-	free(info);
+struct ua_compile_job {
+	const struct uap_parser *ua_parser;
+	struct ua_expression_pair **pairs;
+};
+
+
+static void _compile_job_run(void *arg, const size_t index) {
+	const struct ua_compile_job *job = arg;
+	struct ua_expression_pair *pair = job->pairs[index];
+
+	ua_expression_pair_compile(job->ua_parser, pair, unique_strings_get(&pair->pattern), pair->regex_flag);
+}
+
+
+// Compiles every expression read from regexes.yaml, on the executor when
+// there is one, then drops those which failed to compile. Expressions keep
+// their positions in regexes.yaml, gaps and all.
+static void _user_agent_parser_compile(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	// A profile loaded beforehand says which expressions traffic never
+	// reaches; those wait until they're first tried.
+	size_t count = 0;
+	for (int i = 0; i < 3; i++) {
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			if (!pair->regex && !pair->lazy && !pair->native) {
+				const struct ua_profile_entry *entry = _profile_find(ua_parser, _expression_pair_fingerprint(i, pair));
+				pair->compile_lazily = entry && entry->attempts == 0;
+				count += !pair->compile_lazily;
+			}
+		}
+	}
+
+	struct ua_compile_job job = {
+		.ua_parser = ua_parser,
+		.pairs     = malloc((count + 1) * sizeof(struct ua_expression_pair *)),
+	};
+
+	if (job.pairs) {
+		size_t n = 0;
+		for (int i = 0; i < 3; i++) {
+			for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+				if (!pair->regex && !pair->compile_lazily && !pair->native) {
+					job.pairs[n++] = pair;
+				}
+			}
+		}
+
+		if (executor_present(&ua_parser->executor)) {
+			const int tasks = executor_concurrency(&ua_parser->executor);
+			executor_parallel_for(&ua_parser->executor, count, tasks, &_compile_job_run, &job);
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				_compile_job_run(&job, i);
+			}
+		}
+
+		free(job.pairs);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		struct ua_expression_pair **insert = &groups[i]->expression_pairs;
+
+		while (*insert) {
+			struct ua_expression_pair *pair = *insert;
+
+			if (pair->regex || pair->compile_lazily || pair->native) {
+				insert = &pair->next;
+			} else {
+				*insert = pair->next;
+				pair->next = NULL;
+				ua_expression_pair_destroy(pair);
+			}
+		}
+	}
+
+	_user_agent_parser_update_variants(ua_parser);
+}
+
+
+// Moves the group's pending native rules in among the expressions just read,
+// whose indexes are still their positions in regexes.yaml.
+static void _native_rules_insert(struct ua_parser_group *group) {
+	struct ua_expression_pair **insert = &group->expression_pairs;
+
+	while (group->pending_rules) {
+		struct ua_expression_pair *rule = group->pending_rules;
+
+		while (*insert && ((*insert)->native || (*insert)->index < rule->index)) {
+			insert = &(*insert)->next;
+		}
+
+		group->pending_rules = rule->next;
+		rule->next = *insert;
+		*insert = rule;
+		insert = &rule->next;
+	}
+}
+
+
+// Load the rules and compile them. Returns false if the YAML was broken, in
+// which case the rules before the break are still loaded.
+static bool _user_agent_parser_init(struct uap_parser *ua_parser, yaml_parser_t *parser) {
+	// Create unique_strings_t for string deduping/packing of replacement strings
+	ua_parser->strings = unique_strings_create();
+
+	// device.family should default to "Other" if nothing is parsed, so we'll
+	// add "Other" as a unique string and grab a handle for possible later user.
+	ua_parser->string_handle_other = unique_strings_add(ua_parser->strings, OTHER_FAMILY);
+
+	const bool valid = _user_agent_parser_parse_yaml(ua_parser, parser);
+
+	// Free the YAML parser
+	yaml_parser_delete(parser);
+
+	_native_rules_insert(&ua_parser->user_agent_parser_group);
+	_native_rules_insert(&ua_parser->os_parser_group);
+	_native_rules_insert(&ua_parser->device_parser_group);
+
+	_user_agent_parser_compile(ua_parser);
+
+	if (ua_parser->flags & UAP_PARSER_MERGE_RULES) {
+		ua_parser_group_merge(ua_parser, &ua_parser->user_agent_parser_group);
+		ua_parser_group_merge(ua_parser, &ua_parser->os_parser_group);
+		ua_parser_group_merge(ua_parser, &ua_parser->device_parser_group);
+		_user_agent_parser_update_variants(ua_parser);
+	}
+
+	if (ua_parser->profile) {
+		_profile_apply(ua_parser);
+		free(ua_parser->profile);
+		ua_parser->profile = NULL;
+		ua_parser->profile_count = 0;
+	}
+
+	// Free look-up structures and shrink allocated space if necessary
+	unique_strings_freeze(ua_parser->strings);
+
+	// New expressions may match what used to fall through
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+	for (int i = 0; i < 3; i++) {
+		if (groups[i]->negative_cache) {
+			negative_cache_clear(groups[i]->negative_cache);
+		}
+	}
+
+	uap_parser_set_memory_budget(ua_parser, ua_parser->memory_budget);
+
+	return valid;
+}
+
+
+int uap_parser_read_file(struct uap_parser *ua_parser, FILE *fd) {
+	yaml_parser_t parser;
+
+	// Initialize YAML parser
+	if (!yaml_parser_initialize(&parser)) {
+		return 0;
+	}
+
+	yaml_parser_set_input_file(&parser, fd);
+	return _user_agent_parser_init(ua_parser, &parser);
+}
+
+
+int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *buffer, const size_t bufsize) {
+	yaml_parser_t parser;
+
+	if (!yaml_parser_initialize(&parser)) {
+		return 0;
+	}
+
+	yaml_parser_set_input_string(&parser, buffer, bufsize);
+	return _user_agent_parser_init(ua_parser, &parser);
+}
+
+
+int uap_parser_parse_string(const struct uap_parser *ua_parser, struct uap_useragent_info *info, const char* user_agent_string) {
+	return uap_parser_parse_string_length(ua_parser, info, user_agent_string, strlen(user_agent_string));
+}
+
+
+// Runs every group over the user agent, leaving the results in `state`,
+// which the caller must release with ua_parse_state_destroy().
+static int _user_agent_parser_match(
+		const struct uap_parser *ua_parser,
+		struct ua_parse_state *state,
+		const char *user_agent_string,
+		const size_t length,
+		struct uap_parse_cost *cost,
+		struct uap_provenance *provenance)
+{
+	memset(state, 0, sizeof(struct ua_parse_state));
+
+	struct ua_subject subject = {
+		.string    = user_agent_string,
+		.length    = length,
+		.lowercase = NULL,
+		.ascii     = false,
+		.hash      = 0,
+		.cost      = cost,
+		.rule_subject = NULL,
+		.provenance   = provenance,
+	};
+
+	if (ua_parser->user_agent_parser_group.negative_cache
+			|| ua_parser->os_parser_group.negative_cache
+			|| ua_parser->device_parser_group.negative_cache
+			|| ua_parser->workload) {
+		subject.hash = simd_hash64(subject.string, subject.length, 0);
+	}
+
+	if (ua_parser->workload) {
+		workload_record(ua_parser->workload, subject.hash);
+	}
+
+	// Caseless expressions which have a case-sensitive rewrite run against a
+	// lowercase copy, made once here rather than by PCRE for every expression.
+	char lowercase_stack[LOWERCASE_STACK_SIZE];
+	char *lowercase = NULL;
+
+	bool ascii_checked = false;
+
+	if (ua_parser->has_lowercase_rules) {
+		lowercase = subject.length < LOWERCASE_STACK_SIZE ? lowercase_stack : malloc(subject.length + 1);
+
+		if (lowercase) {
+			subject.ascii = simd_ascii_lowercase(lowercase, subject.string, subject.length);
+			subject.lowercase = subject.ascii ? lowercase : NULL;
+			ascii_checked = true;
+		}
+	}
+
+	if ((ua_parser->has_ascii_rules || ua_parser->has_literal_rules) && !ascii_checked) {
+		subject.ascii = simd_is_ascii(subject.string, subject.length);
+	}
+
+	// Tokens are only split if a native rule asks for them
+	struct uap_rule_subject rule_subject;
+
+	if (ua_parser->has_native_rules) {
+		rule_subject.user_agent = subject.string;
+		rule_subject.length     = subject.length;
+		rule_subject.lowercase  = subject.lowercase;
+		rule_subject.ascii      = subject.ascii;
+		rule_subject.tokenized  = 0;
+		subject.rule_subject    = &rule_subject;
+	}
+
+	const int matched_groups = 0
+		+ ua_parser_group_exec(ua_parser, &ua_parser->user_agent_parser_group, state, &subject)
+		+ ua_parser_group_exec(ua_parser, &ua_parser->os_parser_group, state, &subject)
+		+ ua_parser_group_exec(ua_parser, &ua_parser->device_parser_group, state, &subject);
+
+	if (lowercase != lowercase_stack) {
+		free(lowercase);
+	}
+
+	// Special case for family, if (null) then set to "Other"
+	const char **family[] = { &state->device.family, &state->os.family, &state->user_agent.family };
+	const size_t family_index[] = { STATE_FIELD_INDEX(device), STATE_FIELD_INDEX(os), STATE_FIELD_INDEX(user_agent) };
+	for (int i = 0; i < 3; i++) {
+		if (*family[i] == NULL) {
+			*family[i] = unique_strings_get(&ua_parser->string_handle_other);
+			state->length[family_index[i]] = sizeof(OTHER_FAMILY) - 1;
+		}
+	}
+
+	return matched_groups;
+}
+
+
+static int _user_agent_parser_parse(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		const size_t length,
+		struct uap_parse_cost *cost,
+		struct uap_provenance *provenance)
+{
+	struct ua_parse_state state;
+	const int matched_groups = _user_agent_parser_match(ua_parser, &state, user_agent_string, length, cost, provenance);
+
+	if (matched_groups > 0) {
+		ua_parse_state_create_useragent_info(info, &state);
+	}
+
+	ua_parse_state_destroy(&state, ua_parser->strings);
+
+	return matched_groups;
+}
+
+
+int uap_parser_parse_string_length(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		const size_t length)
+{
+	return _user_agent_parser_parse(ua_parser, info, user_agent_string, length, NULL, NULL);
+}
+
+
+int uap_parser_parse_string_cost(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		const size_t length,
+		struct uap_parse_cost *cost)
+{
+	memset(cost, 0, sizeof(struct uap_parse_cost));
+	return _user_agent_parser_parse(ua_parser, info, user_agent_string, length, cost, NULL);
+}
+
+
+int uap_parser_parse_string_provenance(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		const size_t length,
+		struct uap_provenance *provenance)
+{
+	memset(provenance, 0, sizeof(struct uap_provenance));
+	return _user_agent_parser_parse(ua_parser, info, user_agent_string, length, NULL, provenance);
+}
+
+
+int uap_parser_parse_inline(
+		const struct uap_parser *ua_parser,
+		struct uap_inline_info *info,
+		const char *user_agent_string,
+		const size_t length)
+{
+	struct ua_parse_state state;
+	const int matched_groups = _user_agent_parser_match(ua_parser, &state, user_agent_string, length, NULL, NULL);
+
+	const char **field = (const char **)&state;
+	uint16_t used = 1;
+
+	// Unset fields and fields which don't fit share the empty string at 0
+	memset(info, 0, sizeof(struct uap_inline_info));
+
+	for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+		const size_t len = field[i] ? state.length[i] : 0;
+
+		if (len == 0) {
+			continue;
+		}
+
+		if (len + 1 > sizeof(info->data) - used) {
+			info->overflow = 1;
+			continue;
+		}
+
+		memcpy(info->data + used, field[i], len + 1);
+		info->offset[i] = used;
+		info->length[i] = (uint16_t)len;
+		used += (uint16_t)(len + 1);
+	}
+
+	info->matched = (uint8_t)matched_groups;
+	info->used = used;
+
+	ua_parse_state_destroy(&state, ua_parser->strings);
+
+	return matched_groups;
+}
+
+
+int uap_parser_parse_iov(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const struct iovec *iov,
+		const int iovcnt)
+{
+	const struct iovec *only = NULL;
+	size_t length = 0;
+	int segments = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len) {
+			only = &iov[i];
+			length += iov[i].iov_len;
+			segments++;
+		}
+	}
+
+	if (segments <= 1) {
+		return _user_agent_parser_parse(ua_parser, info, only ? only->iov_base : "", length, NULL, NULL);
+	}
+
+	// Expressions need the subject in one piece
+	char stack[IOV_STACK_SIZE];
+	struct ua_scratch *scratch = length <= IOV_STACK_SIZE ? NULL : _scratch_take(ua_parser->scratch, length);
+	char *joined = scratch ? scratch->data : stack;
+
+	if (length > IOV_STACK_SIZE && !scratch) {
+		return -1;
+	}
+
+	size_t offset = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len) {
+			memcpy(joined + offset, iov[i].iov_base, iov[i].iov_len);
+			offset += iov[i].iov_len;
+		}
+	}
+
+	const int matched = _user_agent_parser_parse(ua_parser, info, joined, length, NULL, NULL);
+
+	if (scratch) {
+		_scratch_give(ua_parser->scratch, scratch);
+	}
+
+	return matched;
+}
+
+
+// Run by uap_parser_warmup() when the caller has no corpus: common
+// browsers, apps and crawlers across desktop, mobile and TV
+static const char *const warmup_user_agents[] = {
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36 Edg/120.0.0.0",
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) Gecko/20100101 Firefox/121.0",
+	"Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Safari/605.1.15",
+	"Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+	"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.1 Mobile/15E148 Safari/604.1",
+	"Mozilla/5.0 (iPad; CPU OS 16_6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) CriOS/120.0.6099.119 Mobile/15E148 Safari/604.1",
+	"Mozilla/5.0 (Linux; Android 10; K) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36",
+	"Mozilla/5.0 (Linux; Android 13; SM-S918B) AppleWebKit/537.36 (KHTML, like Gecko) SamsungBrowser/23.0 Chrome/115.0.0.0 Mobile Safari/537.36",
+	"Mozilla/5.0 (Linux; Android 12; M2101K6G Build/SKQ1.210908.001; wv) AppleWebKit/537.36 (KHTML, like Gecko) Version/4.0 Chrome/119.0.6045.193 Mobile Safari/537.36",
+	"Mozilla/5.0 (iPhone; CPU iPhone OS 16_5 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148 [FBAN/FBIOS;FBAV/436.0.0.35.101;FBBV/520145137]",
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36 OPR/106.0.0.0",
+	"Mozilla/5.0 (Windows NT 6.1; Trident/7.0; rv:11.0) like Gecko",
+	"Mozilla/5.0 (SMART-TV; Linux; Tizen 6.0) AppleWebKit/537.36 (KHTML, like Gecko) SamsungBrowser/4.0 Chrome/76.0.3809.146 TV Safari/537.36",
+	"Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)",
+	"Mozilla/5.0 (compatible; bingbot/2.0; +http://www.bing.com/bingbot.htm)",
+	"facebookexternalhit/1.1 (+http://www.facebook.com/externalhit_uatext.php)",
+	"curl/8.4.0",
+	"okhttp/4.12.0",
+	"Dalvik/2.1.0 (Linux; U; Android 11; Pixel 5 Build/RQ3A.211001.001)",
+	// Matching next to nothing, so most of every group's expressions run
+	"-",
+};
+
+
+static uint64_t _now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int uap_parser_warmup(
+		struct uap_parser *ua_parser,
+		const char *const *corpus,
+		size_t count,
+		const unsigned int budget_ms)
+{
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	// 0 for no deadline
+	const uint64_t deadline = budget_ms ? _now_ns() + (uint64_t)budget_ms * 1000000 : 0;
+	bool in_time = true;
+
+	// Expressions a profile deferred
+	for (int i = 0; i < 3 && in_time; i++) {
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair && in_time; pair = pair->next) {
+			if (pair->compile_lazily) {
+				in_time = !(deadline && _now_ns() >= deadline);
+				if (in_time) {
+					_expression_pair_compile_lazily(ua_parser, pair);
+				}
+			}
+		}
+	}
+
+	if (!corpus) {
+		corpus = warmup_user_agents;
+		count = sizeof(warmup_user_agents) / sizeof(warmup_user_agents[0]);
+	}
+
+	// Parsing faults in and caches the expressions, JIT code, replacements
+	// and strings which traffic will need
+	struct uap_useragent_info info;
+	uap_useragent_info_init(&info);
+
+	for (size_t i = 0; i < count && in_time; i++) {
+		in_time = !(deadline && _now_ns() >= deadline);
+		if (in_time) {
+			_user_agent_parser_parse(ua_parser, &info, corpus[i], strlen(corpus[i]), NULL, NULL);
+		}
+	}
+
+	uap_useragent_info_cleanup(&info);
+
+	// The expressions compiled on the way may have taken the parser over
+	if (ua_parser->memory_budget) {
+		uap_parser_set_memory_budget(ua_parser, ua_parser->memory_budget);
+	}
+
+	return in_time;
+}
+
+
+void uap_parse_memo_init(struct uap_parse_memo *memo) {
+	memset(memo, 0, sizeof(struct uap_parse_memo));
+}
+
+
+void uap_parse_memo_cleanup(struct uap_parse_memo *memo) {
+	uap_useragent_info_cleanup(&memo->info);
+	free(memo->user_agent);
+	uap_parse_memo_init(memo);
+}
+
+
+int uap_parser_parse_memo(
+		const struct uap_parser *ua_parser,
+		struct uap_parse_memo *memo,
+		const char *user_agent_string,
+		const size_t length)
+{
+	const uint64_t generation = ua_parser->generation;
+
+	if (memo->generation == generation && memo->length == length
+			&& memcmp(memo->user_agent, user_agent_string, length) == 0) {
+		return memo->matched;
+	}
+
+	memo->matched = _user_agent_parser_parse(ua_parser, &memo->info, user_agent_string, length, NULL, NULL);
+	memo->generation = 0;
+
+	if (length > memo->capacity || !memo->user_agent) {
+		const size_t capacity = length > memo->capacity * 2 ? length : memo->capacity * 2;
+		char *user_agent = realloc(memo->user_agent, capacity ? capacity : 1);
+
+		if (!user_agent) {
+			// Still a correct result, just not remembered
+			return memo->matched;
+		}
+
+		memo->user_agent = user_agent;
+		memo->capacity = capacity;
+	}
+
+	memcpy(memo->user_agent, user_agent_string, length);
+	memo->length = length;
+	memo->generation = generation;
+
+	return memo->matched;
+}
+
+
+struct uap_useragent_info * uap_useragent_info_create() {
+	struct uap_useragent_info *info = calloc(1, sizeof(struct uap_useragent_info));
+	return info;
+}
+
+
+void uap_useragent_info_init(struct uap_useragent_info *info) {
+	memset(info, 0, sizeof(struct uap_useragent_info));
+}
+
+
+void uap_useragent_info_cleanup(struct uap_useragent_info *info) {
+	if (info != NULL) {
+		if (info->strings) {
+			free((void*)info->strings);
+		}
+		info->strings = NULL;
+		info->strings_used = 0;
+		info->strings_capacity = 0;
+	}
+}
+
+
+void uap_useragent_info_shrink(struct uap_useragent_info *info) {
+	if (!info->strings || info->strings_used == info->strings_capacity) {
+		return;
+	}
+
+	size_t offsets[UAP_NUM_FIELDS];
+	const char **fields = (const char**)info;
+
+	for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+		offsets[i] = fields[i] - info->strings;
+	}
+
+	char *buffer = realloc((void*)info->strings, info->strings_used);
+	if (!buffer) {
+		return;
+	}
+
+	for (int i = 0; i < UAP_NUM_FIELDS; i++) {
+		fields[i] = buffer + offsets[i];
+	}
+
+	info->strings = buffer;
+	info->strings_capacity = info->strings_used;
+}
+
+
+void uap_useragent_info_destroy(struct uap_useragent_info *info) {
+	uap_useragent_info_cleanup(info);
+	free(info);
+}
+
+
+void uap_parser_collect_rule_stats(struct uap_parser *ua_parser, int enable) {
+	ua_parser->collect_rule_stats = enable != 0;
+	ua_parser->has_rule_stats |= ua_parser->collect_rule_stats;
+}
+
+
+// Extracts the literal text an expression requires at the very start of the
+// subject, e.g. "^(Opera)/" yields "Opera/".  Returns the prefix length, or -1
+// when the expression isn't anchored (or might not be, in which case we can't
+// reason about it).  Only plain ASCII characters are taken as literals, and
+// anything whose meaning isn't obvious ends the prefix.
+static int _pattern_anchored_prefix(const char *pattern, char *prefix, const int max_length) {
+	if (pattern[0] != '^') {
+		return -1;
+	}
+
+	// A top-level alternation means the anchor only applies to one branch.
+	{
+		int depth = 0;
+		bool in_class = false;
+
+		for (const char *c = pattern; *c; c++) {
+			if (*c == '\\') {
+				if (!*++c) break;
+			} else if (in_class) {
+				in_class = *c != ']';
+			} else if (*c == '[') {
+				in_class = true;
+				if (c[1] == ']' || (c[1] == '^' && c[2] == ']')) c += c[1] == '^' ? 2 : 1;
+			} else if (*c == '(') {
+				depth++;
+			} else if (*c == ')') {
+				depth--;
+			} else if (*c == '|' && depth == 0) {
+				return -1;
+			}
+		}
+	}
+
+#define MAX_PREFIX_GROUP_DEPTH 8
+	// Prefix length at the start of each open group, so an optional group or
+	// an alternation within it can be backed out of.
+	int group_starts[MAX_PREFIX_GROUP_DEPTH];
+	int depth = 0;
+
+	int length = 0;
+	const char *c = pattern + 1;
+
+	while (*c && length < max_length) {
+		char literal;
+
+		if (*c == '(') {
+			// Plain and non-capturing groups are transparent, anything
+			// else (assertions, options, named groups) ends the prefix.
+			if (depth == MAX_PREFIX_GROUP_DEPTH || (c[1] == '?' && c[2] != ':')) break;
+			group_starts[depth++] = length;
+			c += c[1] == '?' ? 3 : 1;
+			continue;
+		}
+
+		if (*c == ')') {
+			if (depth == 0) break;
+			depth--;
+			c += 1;
+			if (*c == '?' || *c == '*' || *c == '{') {
+				length = group_starts[depth];
+				break;
+			}
+			continue;
+		}
+
+		if (*c == '|') {
+			// Only reachable inside a group; each branch differs from here.
+			if (depth > 0) length = group_starts[0];
+			break;
+		}
+
+		if (*c == '\\') {
+			// Escaped punctuation is literal; escaped letters and digits are
+			// classes, assertions or back references.
+			const unsigned char next = (unsigned char)c[1];
+			if (next == '\0' || next >= 0x80 || isalnum(next)) break;
+			literal = c[1];
+			c += 2;
+		} else if ((unsigned char)*c < 0x80 && !strchr("^$.[?*+{", *c)) {
+			literal = *c;
+			c += 1;
+		} else {
+			break;
+		}
+
+		// A quantifier makes the preceding character optional or repeated.
+		if (*c == '?' || *c == '*' || *c == '{') break;
+
+		prefix[length++] = literal;
+	}
+
+	// Characters taken from a group which is still open could be followed by
+	// an alternative or a quantifier we haven't seen, so drop them.
+	if (depth > 0) {
+		length = group_starts[0];
+	}
+#undef MAX_PREFIX_GROUP_DEPTH
+
+	return length;
+}
+
+
+// Two expressions are only known not to overlap when both are anchored and
+// their literal prefixes disagree.  Everything else is assumed to overlap,
+// which keeps reordering conservative.
+static bool _prefixes_conflict(
+		const char *a, const int a_length, const bool a_caseless,
+		const char *b, const int b_length, const bool b_caseless)
+{
+	if (a_length < 0 || b_length < 0) {
+		return false;
+	}
+
+	const int length = a_length < b_length ? a_length : b_length;
+	const bool caseless = a_caseless || b_caseless;
+
+	for (int i = 0; i < length; i++) {
+		if (caseless ? tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]) : a[i] != b[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+#define RULE_PREFIX_MAX 32
+
+struct ua_rule_order_node {
+	struct ua_expression_pair *pair;
+	char prefix[RULE_PREFIX_MAX];
+	int prefix_length;
+	unsigned int in_degree; // overlapping rules that must still come first
+	bool placed;
+};
+
+
+static bool _rule_order_nodes_overlap(const struct ua_rule_order_node *a, const struct ua_rule_order_node *b) {
+	return !_prefixes_conflict(
+			a->prefix, a->prefix_length, a->pair->regex_flag == 'i',
+			b->prefix, b->prefix_length, b->pair->regex_flag == 'i');
+}
+
+
+// Reorders a group so frequently hit expressions are tried first.  Any two
+// expressions that could both match some input keep their relative order,
+// so the first match for every input is unchanged.  Returns the number of
+// expressions which changed position, or -1 on allocation failure.
+static int ua_parser_group_reorder(struct ua_parser_group *group) {
+	size_t count = 0;
+	for (struct ua_expression_pair *pair = group->expression_pairs; pair; pair = pair->next) {
+		count++;
+	}
+
+	if (count < 2) {
+		return 0;
+	}
+
+	struct ua_rule_order_node *nodes = calloc(count, sizeof(struct ua_rule_order_node));
+	if (!nodes) {
+		return -1;
+	}
+
+	{
+		size_t i = 0;
+		for (struct ua_expression_pair *pair = group->expression_pairs; pair; pair = pair->next, i++) {
+			// Native rules could match anything, so nothing passes them
+			nodes[i].pair = pair;
+			nodes[i].prefix_length = pair->native ? -1 : _pattern_anchored_prefix(
+					unique_strings_get(&pair->pattern), nodes[i].prefix, RULE_PREFIX_MAX);
+		}
+	}
+
+	// Build the overlap graph: an edge i -> j (i < j) for every pair of
+	// expressions that might share an input.
+	for (size_t j = 0; j < count; j++) {
+		for (size_t i = 0; i < j; i++) {
+			if (_rule_order_nodes_overlap(&nodes[i], &nodes[j])) {
+				nodes[j].in_degree++;
+			}
+		}
+	}
+
+	// Topological sort, always taking the most frequently hit expression
+	// among those whose predecessors are placed.  Ties keep the current order.
+	int moved = 0;
+	struct ua_expression_pair **insert = &group->expression_pairs;
+
+	for (size_t placed = 0; placed < count; placed++) {
+		size_t best = count;
+
+		for (size_t i = 0; i < count; i++) {
+			if (!nodes[i].placed && nodes[i].in_degree == 0 &&
+					(best == count || nodes[i].pair->hits > nodes[best].pair->hits)) {
+				best = i;
+			}
+		}
+
+		assert(best < count);
+		nodes[best].placed = true;
+		moved += best != placed;
+
+		*insert = nodes[best].pair;
+		insert = &nodes[best].pair->next;
+
+		for (size_t j = best + 1; j < count; j++) {
+			if (!nodes[j].placed && _rule_order_nodes_overlap(&nodes[best], &nodes[j])) {
+				nodes[j].in_degree--;
+			}
+		}
+	}
+
+	*insert = NULL;
+	free(nodes);
+
+	return moved;
+}
+
+
+int uap_parser_reorder_rules(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	int moved = 0;
+	for (int i = 0; i < 3; i++) {
+		const int group_moved = ua_parser_group_reorder(groups[i]);
+		if (group_moved < 0) {
+			return -1;
+		}
+		moved += group_moved;
+	}
+
+	return moved;
+}
+
+
+static int _emit_scalar(yaml_emitter_t *emitter, const char *value, yaml_scalar_style_t style) {
+	yaml_event_t event;
+	yaml_scalar_event_initialize(&event, NULL, NULL, (yaml_char_t*)value, -1, 1, 1, style);
+	return yaml_emitter_emit(emitter, &event);
+}
+
+
+static int _emit_group(
+		yaml_emitter_t *emitter,
+		const char *name,
+		const struct ua_parser_group *group,
+		const char *const *replacement_keys,
+		const int num_replacement_keys)
+{
+	yaml_event_t event;
+
+	if (!_emit_scalar(emitter, name, YAML_PLAIN_SCALAR_STYLE)) return 0;
+
+	yaml_sequence_start_event_initialize(&event, NULL, NULL, 1, YAML_BLOCK_SEQUENCE_STYLE);
+	if (!yaml_emitter_emit(emitter, &event)) return 0;
+
+	for (const struct ua_expression_pair *pair = group->expression_pairs; pair; pair = pair->next) {
+		if (pair->native) {
+			continue;
+		}
+
+		yaml_mapping_start_event_initialize(&event, NULL, NULL, 1, YAML_BLOCK_MAPPING_STYLE);
+		if (!yaml_emitter_emit(emitter, &event)) return 0;
+
+		if (!_emit_scalar(emitter, "regex", YAML_PLAIN_SCALAR_STYLE)) return 0;
+		if (!_emit_scalar(emitter, unique_strings_get(&pair->pattern), YAML_SINGLE_QUOTED_SCALAR_STYLE)) return 0;
+
+		if (pair->regex_flag) {
+			const char flag[2] = { pair->regex_flag, '\0' };
+			if (!_emit_scalar(emitter, "regex_flag", YAML_PLAIN_SCALAR_STYLE)) return 0;
+			if (!_emit_scalar(emitter, flag, YAML_SINGLE_QUOTED_SCALAR_STYLE)) return 0;
+		}
+
+		// Replacements are held in reverse order, so walk them by type to
+		// write them out in the same order regexes.yaml uses.
+		for (int type = 0; type < num_replacement_keys; type++) {
+			for (const struct ua_replacement *repl = pair->replacements; repl; repl = repl->next) {
+				if ((int)repl->type == type) {
+					if (!_emit_scalar(emitter, replacement_keys[type], YAML_PLAIN_SCALAR_STYLE)) return 0;
+					if (!_emit_scalar(emitter, unique_strings_get(&repl->value), YAML_SINGLE_QUOTED_SCALAR_STYLE)) return 0;
+				}
+			}
+		}
+
+		yaml_mapping_end_event_initialize(&event);
+		if (!yaml_emitter_emit(emitter, &event)) return 0;
+	}
+
+	yaml_sequence_end_event_initialize(&event);
+	return yaml_emitter_emit(emitter, &event);
+}
+
+
+int uap_parser_write_yaml(const struct uap_parser *ua_parser, FILE *fd) {
+	static const char *const user_agent_keys[] = {
+		"family_replacement", "v1_replacement", "v2_replacement", "v3_replacement",
+	};
+	static const char *const os_keys[] = {
+		"os_replacement", "os_v1_replacement", "os_v2_replacement", "os_v3_replacement", "os_v4_replacement",
+	};
+	static const char *const device_keys[] = {
+		"device_replacement", "brand_replacement", "model_replacement",
+	};
+
+	yaml_emitter_t emitter;
+	yaml_event_t event;
+
+	if (!yaml_emitter_initialize(&emitter)) {
+		return 0;
+	}
+
+	yaml_emitter_set_output_file(&emitter, fd);
+	yaml_emitter_set_unicode(&emitter, 1);
+	yaml_emitter_set_width(&emitter, -1);
+
+	int ok = 1;
+
+	yaml_stream_start_event_initialize(&event, YAML_UTF8_ENCODING);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	yaml_document_start_event_initialize(&event, NULL, NULL, NULL, 1);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	yaml_mapping_start_event_initialize(&event, NULL, NULL, 1, YAML_BLOCK_MAPPING_STYLE);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	ok = ok && _emit_group(&emitter, "user_agent_parsers", &ua_parser->user_agent_parser_group, user_agent_keys, 4);
+	ok = ok && _emit_group(&emitter, "os_parsers", &ua_parser->os_parser_group, os_keys, 5);
+	ok = ok && _emit_group(&emitter, "device_parsers", &ua_parser->device_parser_group, device_keys, 3);
+
+	yaml_mapping_end_event_initialize(&event);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	yaml_document_end_event_initialize(&event, 1);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	yaml_stream_end_event_initialize(&event);
+	ok = ok && yaml_emitter_emit(&emitter, &event);
+
+	ok = ok && yaml_emitter_flush(&emitter);
+	yaml_emitter_delete(&emitter);
+
+	return ok;
+}
+
+
+int uap_parser_negative_cache_stats(const struct uap_parser *ua_parser, struct uap_negative_cache_stats stats[3]) {
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	int enabled = 0;
+	memset(stats, 0, 3 * sizeof(struct uap_negative_cache_stats));
+
+	for (int i = 0; i < 3; i++) {
+		if (groups[i]->negative_cache) {
+			negative_cache_stats(groups[i]->negative_cache, &stats[i].lookups, &stats[i].hits, &stats[i].inserts, &stats[i].bytes);
+			enabled = 1;
+		}
+	}
+
+	return enabled;
+}
+
+
+int uap_parser_workload_stats(struct uap_parser *ua_parser, struct uap_workload_stats *stats) {
+	if (!ua_parser->workload) {
+		memset(stats, 0, sizeof(struct uap_workload_stats));
+		return 0;
+	}
+
+	workload_stats(ua_parser->workload, stats);
+	return 1;
+}
+
+
+//####################
+// Memory budget
+//####################
+
+#define NEGATIVE_CACHE_MIN_ENTRIES 256
+
+
+static size_t _regex_jit_bytes(const pcre *regex, const pcre_extra *extra) {
+	size_t size = 0;
+
+	if (regex && extra && (extra->flags & PCRE_EXTRA_EXECUTABLE_JIT)) {
+		pcre_fullinfo(regex, extra, PCRE_INFO_JITSIZE, &size);
+	}
+
+	return size;
+}
+
+
+static size_t _negative_caches_bytes(const struct uap_parser *ua_parser) {
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	size_t total = 0;
+
+	for (int i = 0; i < 3; i++) {
+		if (groups[i]->negative_cache) {
+			uint64_t lookups, hits, inserts;
+			size_t bytes;
+			negative_cache_stats(groups[i]->negative_cache, &lookups, &hits, &inserts, &bytes);
+			total += bytes;
+		}
+	}
+
+	return total;
+}
+
+
+int uap_parser_memory_usage(const struct uap_parser *ua_parser, struct uap_memory_usage *usage) {
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	memset(usage, 0, sizeof(struct uap_memory_usage));
+	usage->rules = sizeof(struct uap_parser);
+
+	for (int i = 0; i < 3; i++) {
+		for (const struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			usage->rules += sizeof(struct ua_expression_pair) + _regex_bytes(pair->regex, pair->pcre_extra);
+
+			const struct ua_lazy_regex *lazy = __atomic_load_n(&pair->lazy, __ATOMIC_ACQUIRE);
+			if (lazy) {
+				usage->rules += sizeof(struct ua_lazy_regex) + _regex_bytes(lazy->regex, lazy->pcre_extra);
+			}
+
+			const struct ua_lazy_regex *in_order = __atomic_load_n(&pair->in_order, __ATOMIC_ACQUIRE);
+			if (in_order) {
+				usage->variants += sizeof(struct ua_lazy_regex) + _regex_bytes(in_order->regex, in_order->pcre_extra);
+			}
+
+			for (const struct ua_replacement *repl = pair->replacements; repl; repl = repl->next) {
+				usage->rules += sizeof(struct ua_replacement);
+			}
+
+			if (pair->literal) {
+				usage->rules += pair->literal_length + 1;
+			}
+
+			if (pair->merged_rules) {
+				usage->rules += (pair->merged + 1) * sizeof(struct ua_merged_rule);
+			}
+
+			usage->variants += _regex_bytes(pair->lowercase_regex, pair->lowercase_pcre_extra);
+			usage->variants += _regex_bytes(pair->ascii_regex, pair->ascii_pcre_extra);
+
+			usage->jit += _regex_jit_bytes(pair->regex, pair->pcre_extra);
+			usage->jit += _regex_jit_bytes(pair->lowercase_regex, pair->lowercase_pcre_extra);
+			usage->jit += _regex_jit_bytes(pair->ascii_regex, pair->ascii_pcre_extra);
+		}
+	}
+
+	usage->caches = _negative_caches_bytes(ua_parser);
+	usage->workload = workload_bytes(ua_parser->workload);
+	usage->strings = ua_parser->strings ? unique_strings_bytes(ua_parser->strings) : 0;
+	usage->scratch = ua_parser->scratch ? __atomic_load_n(&ua_parser->scratch->bytes, __ATOMIC_RELAXED) : 0;
+	usage->total = usage->rules + usage->variants + usage->jit + usage->caches + usage->workload + usage->strings +
+		usage->scratch;
+	usage->budget = ua_parser->memory_budget;
+
+	return usage->budget == 0 || usage->total <= usage->budget;
+}
+
+
+// Halves the largest negative cache, or drops it once it's small. Returns
+// false if there are no caches left.
+static bool _shed_negative_cache(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	struct ua_parser_group *largest = NULL;
+
+	for (int i = 0; i < 3; i++) {
+		if (groups[i]->negative_cache && (!largest ||
+				negative_cache_capacity(groups[i]->negative_cache) > negative_cache_capacity(largest->negative_cache))) {
+			largest = groups[i];
+		}
+	}
+
+	if (!largest) {
+		return false;
+	}
+
+	const size_t entries = negative_cache_capacity(largest->negative_cache) / 2;
+	negative_cache_destroy(largest->negative_cache);
+	largest->negative_cache = entries >= NEGATIVE_CACHE_MIN_ENTRIES ? negative_cache_create(entries) : NULL;
+
+	return true;
+}
+
+
+// Replaces JIT compiled study data with plain study data. Returns the bytes
+// of JIT code freed.
+static size_t _drop_jit(const pcre *regex, pcre_extra **extra) {
+	const size_t size = _regex_jit_bytes(regex, *extra);
+
+	if (size) {
+		const char *error;
+		pcre_free_study(*extra);
+		*extra = pcre_study(regex, 0, &error);
+	}
+
+	return size;
+}
+
+
+static size_t _drop_variant(pcre **regex, pcre_extra **extra) {
+	const size_t size = _regex_bytes(*regex, *extra) + _regex_jit_bytes(*regex, *extra);
+
+	if (*extra) {
+		pcre_free_study(*extra);
+	}
+	pcre_free(*regex);
+	*regex = NULL;
+	*extra = NULL;
+
+	return size;
+}
+
+
+static int _compare_pair_coldness(const void *a, const void *b) {
+	const struct ua_expression_pair *x = *(struct ua_expression_pair *const *)a;
+	const struct ua_expression_pair *y = *(struct ua_expression_pair *const *)b;
+
+	if (x->hits != y->hits) {
+		return x->hits < y->hits ? -1 : 1;
+	}
+
+	return (x->index < y->index) - (x->index > y->index);
+}
+
+
+// Every expression in the parser, least hit first, ties going to the
+// expression furthest down its group. NULL on allocation failure.
+static struct ua_expression_pair **_pairs_by_coldness(struct uap_parser *ua_parser, size_t *count) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	*count = 0;
+	for (int i = 0; i < 3; i++) {
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			(*count)++;
+		}
+	}
+
+	struct ua_expression_pair **pairs = malloc((*count + 1) * sizeof(struct ua_expression_pair *));
+	if (!pairs) {
+		return NULL;
+	}
+
+	size_t n = 0;
+	for (int i = 0; i < 3; i++) {
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			pairs[n++] = pair;
+		}
+	}
+
+	qsort(pairs, *count, sizeof(struct ua_expression_pair *), &_compare_pair_coldness);
+	return pairs;
+}
+
+
+// Leaves parsing what the budget has room for beyond the memory held now,
+// besides spare buffers. Returns 1 if the parser fits the budget.
+static int _reset_headroom(struct uap_parser *ua_parser, const struct uap_memory_usage *usage) {
+	const size_t held = usage->total - usage->scratch;
+
+	if (ua_parser->scratch) {
+		__atomic_store_n(&ua_parser->scratch->headroom,
+			!usage->budget ? SIZE_MAX : held < usage->budget ? usage->budget - held : 0, __ATOMIC_RELAXED);
+	}
+
+	return usage->budget == 0 || usage->total <= usage->budget;
+}
+
+
+int uap_parser_set_memory_budget(struct uap_parser *ua_parser, const size_t budget) {
+	struct uap_memory_usage usage;
+	ua_parser->memory_budget = budget;
+
+	if (uap_parser_memory_usage(ua_parser, &usage)) {
+		return _reset_headroom(ua_parser, &usage);
+	}
+
+	// Cheapest to lose first: spare buffers are only saved allocations, and
+	// cache entries only save repeat work
+	size_t total = usage.total - _scratch_release(ua_parser->scratch);
+
+	while (total > budget) {
+		const size_t before = _negative_caches_bytes(ua_parser);
+		if (!_shed_negative_cache(ua_parser)) {
+			break;
+		}
+		total -= before - _negative_caches_bytes(ua_parser);
+	}
+
+	size_t count;
+	struct ua_expression_pair **pairs = total > budget ? _pairs_by_coldness(ua_parser, &count) : NULL;
+
+	if (pairs) {
+		for (size_t i = 0; i < count && total > budget; i++) {
+			total -= _drop_jit(pairs[i]->regex, &pairs[i]->pcre_extra);
+			total -= _drop_jit(pairs[i]->lowercase_regex, &pairs[i]->lowercase_pcre_extra);
+			total -= _drop_jit(pairs[i]->ascii_regex, &pairs[i]->ascii_pcre_extra);
+		}
+
+		for (size_t i = 0; i < count && total > budget; i++) {
+			if (pairs[i]->lowercase_regex) {
+				total -= _drop_variant(&pairs[i]->lowercase_regex, &pairs[i]->lowercase_pcre_extra);
+			}
+			if (pairs[i]->ascii_regex) {
+				total -= _drop_variant(&pairs[i]->ascii_regex, &pairs[i]->ascii_pcre_extra);
+			}
+		}
+
+		free(pairs);
+
+		// Skip preparing subjects for variants which are all gone
+		_user_agent_parser_update_variants(ua_parser);
+	}
+
+	uap_parser_memory_usage(ua_parser, &usage);
+	return _reset_headroom(ua_parser, &usage);
+}
+
+
+const struct uap_executor *ua_parser_executor(const struct uap_parser *ua_parser) {
+	return &ua_parser->executor;
+}
+
+
+static void _put_le64(unsigned char *out, const uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		out[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+
+static uint64_t _get_le64(const unsigned char *in) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t)in[i] << (8 * i);
+	}
+	return value;
+}
+
+
+static bool _write_profile_entry(FILE *fd, const uint64_t fingerprint, const uint64_t hits, const uint64_t attempts) {
+	unsigned char entry[PROFILE_ENTRY_SIZE];
+	_put_le64(entry, fingerprint);
+	_put_le64(entry + 8, hits);
+	_put_le64(entry + 16, attempts);
+
+	return fwrite(entry, PROFILE_ENTRY_SIZE, 1, fd) == 1;
+}
+
+
+int uap_parser_write_profile(const struct uap_parser *ua_parser, FILE *fd) {
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	// Counts of zero would read as expressions no traffic reaches
+	if (!ua_parser->has_rule_stats) {
+		return 0;
+	}
+
+	// Native rules have no expression to fingerprint. A merged expression
+	// writes an entry per original, so the profile suits any parser.
+	uint32_t count = 0;
+	for (int i = 0; i < 3; i++) {
+		for (const struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			count += pair->native ? 0 : pair->merged_rules ? pair->merged + 1 : 1;
+		}
+	}
+
+	// Little-endian throughout: magic, version, entry count, reserved
+	unsigned char header[PROFILE_HEADER_SIZE] = PROFILE_MAGIC;
+	_put_le64(header + 4, PROFILE_VERSION | (uint64_t)count << 32);
+
+	if (fwrite(header, PROFILE_HEADER_SIZE, 1, fd) != 1) {
+		return 0;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		for (const struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			if (pair->native) {
+				continue;
+			}
+
+			const uint64_t attempts = __atomic_load_n(&pair->attempts, __ATOMIC_RELAXED);
+
+			if (!pair->merged_rules) {
+				if (!_write_profile_entry(
+						fd, _expression_pair_fingerprint(i, pair), __atomic_load_n(&pair->hits, __ATOMIC_RELAXED), attempts)) {
+					return 0;
+				}
+				continue;
+			}
+
+			// An original is tried by every parse reaching the merged
+			// expression which the originals before it didn't match
+			uint64_t earlier_hits = 0;
+
+			for (unsigned int j = 0; j <= pair->merged; j++) {
+				const uint64_t hits = __atomic_load_n(&pair->merged_rules[j].hits, __ATOMIC_RELAXED);
+
+				if (!_write_profile_entry(fd, pair->merged_rules[j].fingerprint, hits,
+						attempts > earlier_hits ? attempts - earlier_hits : 0)) {
+					return 0;
+				}
+
+				earlier_hits += hits;
+			}
+		}
+	}
+
+	return fflush(fd) == 0;
+}
+
+
+int uap_parser_load_profile(struct uap_parser *ua_parser, FILE *fd) {
+	unsigned char header[PROFILE_HEADER_SIZE];
+
+	if (fread(header, PROFILE_HEADER_SIZE, 1, fd) != 1 || memcmp(header, PROFILE_MAGIC, 4) != 0) {
+		return -1;
+	}
+
+	const uint64_t version_count = _get_le64(header + 4);
+	const size_t count = (size_t)(version_count >> 32);
+
+	if ((uint32_t)version_count != PROFILE_VERSION || count > PROFILE_MAX_ENTRIES) {
+		return -1;
+	}
+
+	struct ua_profile_entry *entries = malloc((count + 1) * sizeof(struct ua_profile_entry));
+	if (!entries) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		unsigned char entry[PROFILE_ENTRY_SIZE];
+
+		if (fread(entry, PROFILE_ENTRY_SIZE, 1, fd) != 1) {
+			free(entries);
+			return -1;
+		}
+
+		entries[i].fingerprint = _get_le64(entry);
+		entries[i].hits        = _get_le64(entry + 8);
+		entries[i].attempts    = _get_le64(entry + 16);
+	}
+
+	qsort(entries, count, sizeof(struct ua_profile_entry), &_compare_profile_entries);
+
+	free(ua_parser->profile);
+	ua_parser->profile = entries;
+	ua_parser->profile_count = count;
+
+	// Without expressions yet, the profile waits for them to be read
+	if (!ua_parser->strings) {
+		return 0;
+	}
+
+	const size_t found = _profile_apply(ua_parser);
+
+	free(ua_parser->profile);
+	ua_parser->profile = NULL;
+	ua_parser->profile_count = 0;
+
+	uap_parser_set_memory_budget(ua_parser, ua_parser->memory_budget);
+	return (int)found;
+}
+
+
+//####################
+// Native rules
+//####################
+
+int uap_parser_add_rule(
+		struct uap_parser *ua_parser,
+		const int group,
+		const unsigned int position,
+		int (*fn)(void *context, struct uap_rule_subject *subject, struct uap_rule_fields *fields),
+		void *context)
+{
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	if (group < 0 || group > 2 || !fn || ua_parser->strings) {
+		return 0;
+	}
+
+	struct ua_expression_pair *rule = calloc(1, sizeof(struct ua_expression_pair));
+	if (!rule) {
+		return 0;
+	}
+
+	rule->native = fn;
+	rule->native_context = context;
+	rule->index = position;
+
+	// Keep the pending rules sorted, later additions after earlier ones
+	struct ua_expression_pair **insert = &groups[group]->pending_rules;
+	while (*insert && (*insert)->index <= position) {
+		insert = &(*insert)->next;
+	}
+
+	rule->next = *insert;
+	*insert = rule;
+	ua_parser->has_native_rules = true;
+
+	return 1;
+}
+
+
+size_t uap_rule_subject_tokens(struct uap_rule_subject *subject, const struct uap_token **tokens) {
+	if (!subject->tokenized) {
+		const size_t count = uap_tokenize(subject->user_agent, subject->length, subject->tokens, UAP_RULE_MAX_TOKENS);
+		subject->token_count = count < UAP_RULE_MAX_TOKENS ? count : UAP_RULE_MAX_TOKENS;
+		subject->tokenized = 1;
+	}
+
+	*tokens = subject->tokens;
+	return subject->token_count;
+}
+
+
+//####################
+// Autotuning
+//####################
+
+#define AUTOTUNE_ROUNDS 3
+#define AUTOTUNE_JIT_MARGIN 0.9 // JIT code costs memory, so it has to be clearly faster
+
+enum ua_tune_candidate {
+	TUNE_INTERPRETER = UAP_STRATEGY_INTERPRETER,
+	TUNE_JIT         = UAP_STRATEGY_JIT,
+	TUNE_DFA         = UAP_STRATEGY_DFA,
+	TUNE_LITERAL     = UAP_STRATEGY_LITERAL,
+	TUNE_CANDIDATES,
+};
+
+static const char *const tune_candidate_names[TUNE_CANDIDATES] = { "interpreter", "jit", "dfa", "literal" };
+static const char *const tune_group_names[3] = { "user_agent", "os", "device" };
+
+// Forms of an expression, as ua_parser_group_exec() picks between them
+enum ua_tune_variant {
+	TUNE_ORIGINAL,  // caseless UTF-8, for everything else
+	TUNE_LOWERCASE, // lowercase rewrite, for lowercased ASCII user agents
+	TUNE_ASCII,     // byte mode, for ASCII user agents
+	TUNE_VARIANTS,
+};
+
+static const char *const tune_variant_names[TUNE_VARIANTS] = { "original", "lowercase", "ascii" };
+
+
+// Extracts the text of an expression which is nothing but plain ASCII text,
+// possibly all in one capture, e.g. "(Konqueror)" or "Opera Mini\/". Returns
+// the text's length, or -1 if the expression is anything more.
+static int _pattern_literal(const char *pattern, char *literal, const int max_length, bool *capture) {
+	const size_t pattern_length = strlen(pattern);
+	const char *c = pattern;
+	const char *end = pattern + pattern_length;
+	int length = 0;
+
+	*capture = pattern_length > 2 && pattern[0] == '(' && pattern[1] != '?' && pattern[pattern_length - 1] == ')';
+	if (*capture) {
+		c++;
+		end--;
+	}
+
+	for (; c < end; c++) {
+		char ch = *c;
+
+		if (ch == '\\') {
+			// Escaped punctuation is literal; escaped letters and digits are classes and references
+			ch = *++c;
+			if (c == end || isalnum((unsigned char)ch)) {
+				return -1;
+			}
+		} else if (strchr("^$.|?*+()[]{}", ch)) {
+			return -1;
+		}
+
+		if ((ch & 0x80) || length == max_length) {
+			return -1;
+		}
+
+		literal[length++] = ch;
+	}
+
+	literal[length] = '\0';
+	return length > 0 ? length : -1;
+}
+
+
+// Whether any of the pair's replacements refers to a capture
+static bool _replacements_use_captures(const struct ua_expression_pair *pair) {
+	for (const struct ua_replacement *repl = pair->replacements; repl; repl = repl->next) {
+		if (repl->has_placeholders) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// The user agents to tune on, prepared as parsing prepares them
+struct ua_tune_corpus {
+	const char *const *strings;
+	const size_t *lengths;
+	const bool *ascii;
+	const char *const *lowercase; // lowercased copies of ASCII user agents, if the parser makes them
+	size_t count;
+};
+
+
+struct ua_tune_run {
+	const struct ua_expression_pair *pair;      // with the candidate's literal filled in
+	const pcre *regex[TUNE_VARIANTS];            // NULL for variants the pair doesn't have
+	const pcre_extra *extra[TUNE_VARIANTS];      // plain or JIT study data
+	int candidate;
+};
+
+
+// The variant ua_parser_group_exec() would run on user agent `i`
+static enum ua_tune_variant _tune_variant(const struct ua_tune_run *run, const struct ua_tune_corpus *corpus, const size_t i) {
+	if (run->regex[TUNE_LOWERCASE] && corpus->lowercase[i]) {
+		return TUNE_LOWERCASE;
+	} else if (run->regex[TUNE_ASCII] && corpus->ascii[i]) {
+		return TUNE_ASCII;
+	}
+	return TUNE_ORIGINAL;
+}
+
+
+// Runs one candidate over user agent `i` as parsing would
+static int _tune_exec(const struct ua_tune_run *run, const struct ua_tune_corpus *corpus, const size_t i, int *matches_vector) {
+	const enum ua_tune_variant variant = _tune_variant(run, corpus, i);
+	const char *str = variant == TUNE_LOWERCASE ? corpus->lowercase[i] : corpus->strings[i];
+	const size_t length = corpus->lengths[i];
+	const int options = corpus->ascii[i] ? PCRE_NO_UTF8_CHECK : 0;
+
+	if (run->candidate == TUNE_LITERAL && corpus->ascii[i]) {
+		return _literal_exec(run->pair, corpus->strings[i], length, matches_vector);
+	} else if (run->candidate == TUNE_DFA) {
+		return _dfa_exec(run->regex[variant], run->extra[variant], str, length, options, matches_vector);
+	}
+
+	return pcre_exec(run->regex[variant], run->extra[variant], str, (int)length, 0, options, matches_vector, SUBSTRING_VEC_COUNT);
+}
+
+
+// Whether a candidate agrees with the interpreter on every subject. DFA
+// candidates only need to agree on whether there's a match.
+static bool _tune_verify(
+		const struct ua_tune_run *run,
+		const struct ua_tune_run *baseline,
+		const struct ua_tune_corpus *corpus)
+{
+	int expected[SUBSTRING_VEC_COUNT];
+	int actual[SUBSTRING_VEC_COUNT];
+
+	for (size_t i = 0; i < corpus->count; i++) {
+		const int want = _tune_exec(baseline, corpus, i, expected);
+		const int got = _tune_exec(run, corpus, i, actual);
+
+		if (run->candidate == TUNE_DFA) {
+			if ((want > 0) != (got > 0) || (want <= 0 && want != got)) {
+				return false;
+			}
+		} else if (want != got || (want > 0 && memcmp(expected, actual, 2 * want * sizeof(int)) != 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// Nanoseconds the candidate takes over the subjects reaching the expression,
+// best of a few rounds
+static uint64_t _tune_time(const struct ua_tune_run *run, const struct ua_tune_corpus *corpus, const bool *reaching) {
+	int matches_vector[SUBSTRING_VEC_COUNT];
+	uint64_t best = UINT64_MAX;
+
+	for (int round = 0; round < AUTOTUNE_ROUNDS; round++) {
+		const uint64_t start = _now_ns();
+
+		for (size_t i = 0; i < corpus->count; i++) {
+			if (reaching[i]) {
+				_tune_exec(run, corpus, i, matches_vector);
+			}
+		}
+
+		const uint64_t elapsed = _now_ns() - start;
+		best = elapsed < best ? elapsed : best;
+	}
+
+	return best;
+}
+
+
+// Times every candidate able to run the pair, then switches the pair to the
+// fastest, or to `forced` if it's a candidate able to run it. Candidates
+// which can't run it, and all of them when forcing, are timed as UINT64_MAX.
+// Every variant of the expression is studied, and JIT compiled, for the
+// timings. Returns true if that changed how it runs.
+static bool _tune_pair(
+		struct ua_expression_pair *pair,
+		const struct ua_tune_corpus *corpus,
+		const bool *reaching,
+		const int forced,
+		uint64_t times[TUNE_CANDIDATES],
+		int *choice)
+{
+	const pcre *variants[TUNE_VARIANTS] = {
+		[TUNE_ORIGINAL]  = pair->regex,
+		[TUNE_LOWERCASE] = pair->lowercase_regex,
+		[TUNE_ASCII]     = pair->ascii_regex,
+	};
+
+	const char *error;
+	pcre_extra *plain[TUNE_VARIANTS] = { NULL };
+	pcre_extra *jit[TUNE_VARIANTS] = { NULL };
+	bool jit_compiled = true;
+
+	for (int v = 0; v < TUNE_VARIANTS; v++) {
+		if (!variants[v]) {
+			continue;
+		}
+
+		plain[v] = pcre_study(variants[v], 0, &error);
+		jit[v] = pcre_study(variants[v], PCRE_STUDY_JIT_COMPILE, &error);
+
+		if (!jit[v] || !(jit[v]->flags & PCRE_EXTRA_EXECUTABLE_JIT)) {
+			jit_compiled = false;
+		}
+	}
+
+	char literal[256];
+	int captures = 0;
+	pcre_fullinfo(pair->regex, plain[TUNE_ORIGINAL], PCRE_INFO_CAPTURECOUNT, &captures);
+
+	struct ua_expression_pair literal_pair = *pair;
+	const int literal_length = _pattern_literal(unique_strings_get(&pair->pattern), literal, sizeof(literal) - 1, &literal_pair.literal_capture);
+	literal_pair.literal = literal;
+	literal_pair.literal_length = literal_length > 0 ? (unsigned int)literal_length : 0;
+
+	// Merged expressions rely on which capture took part, so they only get
+	// PCRE's matchers
+	const bool eligible[TUNE_CANDIDATES] = {
+		[TUNE_INTERPRETER] = true,
+		[TUNE_JIT]         = jit_compiled,
+		[TUNE_DFA]         = !pair->merged && captures == 0 && !_replacements_use_captures(pair),
+		[TUNE_LITERAL]     = !pair->merged && literal_length > 0 && captures == literal_pair.literal_capture,
+	};
+
+	struct ua_tune_run baseline = { .pair = pair, .candidate = TUNE_INTERPRETER };
+	for (int v = 0; v < TUNE_VARIANTS; v++) {
+		baseline.regex[v] = variants[v];
+		baseline.extra[v] = plain[v];
+	}
+	*choice = TUNE_INTERPRETER;
+
+	for (int c = 0; c < TUNE_CANDIDATES; c++) {
+		struct ua_tune_run run = baseline;
+		run.pair = &literal_pair;
+		run.candidate = c;
+		for (int v = 0; v < TUNE_VARIANTS; v++) {
+			run.extra[v] = c == TUNE_JIT ? jit[v] : plain[v];
+		}
+		times[c] = UINT64_MAX;
+
+		if (!eligible[c] || (forced >= 0 && c != forced) || !_tune_verify(&run, &baseline, corpus)) {
+			continue;
+		}
+
+		if (forced >= 0) {
+			*choice = c;
+			continue;
+		}
+
+		times[c] = _tune_time(&run, corpus, reaching);
+
+		const double weight = c == TUNE_JIT ? 1 / AUTOTUNE_JIT_MARGIN : 1;
+		if (times[c] * weight < times[*choice]) {
+			*choice = c;
+		}
+	}
+
+	for (int v = 0; v < TUNE_VARIANTS; v++) {
+		pcre_free_study(plain[v]);
+		pcre_free_study(jit[v]);
+	}
+
+	// Apply the choice
+	const enum ua_strategy strategy = *choice == TUNE_DFA ? UA_STRATEGY_DFA
+		: *choice == TUNE_LITERAL ? UA_STRATEGY_LITERAL
+		: UA_STRATEGY_PCRE;
+	const bool had_jit = _regex_jit_bytes(pair->regex, pair->pcre_extra) > 0;
+	const bool changed = strategy != pair->strategy || had_jit != (*choice == TUNE_JIT);
+
+	if (*choice == TUNE_JIT) {
+		_jit_compile(pair->regex, &pair->pcre_extra);
+		_jit_compile(pair->lowercase_regex, &pair->lowercase_pcre_extra);
+		_jit_compile(pair->ascii_regex, &pair->ascii_pcre_extra);
+	} else {
+		_drop_jit(pair->regex, &pair->pcre_extra);
+		_drop_jit(pair->lowercase_regex, &pair->lowercase_pcre_extra);
+		_drop_jit(pair->ascii_regex, &pair->ascii_pcre_extra);
+	}
+
+	free(pair->literal);
+	pair->literal = NULL;
+	pair->literal_length = 0;
+
+	if (strategy == UA_STRATEGY_LITERAL) {
+		pair->literal = strdup(literal);
+		if (!pair->literal) {
+			pair->strategy = UA_STRATEGY_PCRE;
+			return changed;
+		}
+		pair->literal_length = literal_pair.literal_length;
+		pair->literal_capture = literal_pair.literal_capture;
+	}
+
+	pair->strategy = strategy;
+	return changed;
+}
+
+
+// Takes the subjects an expression matches out of the running for the
+// expressions after it
+static void _tune_drop_matched(
+		const pcre *regex,
+		const pcre_extra *extra,
+		const struct ua_tune_corpus *corpus,
+		bool *reaching)
+{
+	int matches_vector[SUBSTRING_VEC_COUNT];
+
+	for (size_t i = 0; i < corpus->count; i++) {
+		if (reaching[i]) {
+			reaching[i] = pcre_exec(
+					regex, extra, corpus->strings[i], (int)corpus->lengths[i], 0, 0, matches_vector, SUBSTRING_VEC_COUNT) < 0;
+		}
+	}
+}
+
+
+static int _autotune(
+		struct uap_parser *ua_parser,
+		const char *const *corpus,
+		const size_t count,
+		FILE *report,
+		const int forced)
+{
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group, &ua_parser->os_parser_group, &ua_parser->device_parser_group
+	};
+
+	// Step counting needs callouts, which only the interpreter makes
+	if (ua_parser->flags & UAP_PARSER_COUNT_STEPS) {
+		return 0;
+	}
+
+	size_t *lengths = malloc(count * sizeof(size_t) + 1);
+	bool *ascii = malloc(count * sizeof(bool) + 1);
+	bool *reaching = malloc(count * sizeof(bool) + 1);
+	const char **lowercase = calloc(count + 1, sizeof(const char *));
+	char *lowercase_buffer = NULL;
+
+	size_t total_length = 0;
+	for (size_t i = 0; lengths && i < count; i++) {
+		lengths[i] = strlen(corpus[i]);
+		total_length += lengths[i] + 1;
+	}
+
+	// Parsing makes lowercase copies only for parsers with lowercase variants
+	if (ua_parser->has_lowercase_rules) {
+		lowercase_buffer = malloc(total_length + 1);
+	}
+
+	if (!lengths || !ascii || !reaching || !lowercase || (ua_parser->has_lowercase_rules && !lowercase_buffer)) {
+		free(lengths);
+		free(ascii);
+		free(reaching);
+		free(lowercase);
+		free(lowercase_buffer);
+		return -1;
+	}
+
+	char *write_ptr = lowercase_buffer;
+	for (size_t i = 0; i < count; i++) {
+		if (lowercase_buffer) {
+			ascii[i] = simd_ascii_lowercase(write_ptr, corpus[i], lengths[i]);
+			write_ptr[lengths[i]] = '\0';
+			lowercase[i] = ascii[i] ? write_ptr : NULL;
+			write_ptr += lengths[i] + 1;
+		} else {
+			ascii[i] = simd_is_ascii(corpus[i], lengths[i]);
+		}
+	}
+
+	const struct ua_tune_corpus tune_corpus = { corpus, lengths, ascii, lowercase, count };
+
+	if (report) {
+		fprintf(report, "# group\tindex\tchoice\tvariant");
+		for (int c = 0; c < TUNE_CANDIDATES; c++) {
+			fprintf(report, "\t%s_ns", tune_candidate_names[c]);
+		}
+		fputc('\n', report);
+	}
+
+	int changed = 0;
+
+	for (int i = 0; i < 3; i++) {
+		// Subjects drop out as expressions match them, as in parsing.
+		// Native rules are passed over.
+		memset(reaching, true, count * sizeof(bool));
+
+		for (struct ua_expression_pair *pair = groups[i]->expression_pairs; pair; pair = pair->next) {
+			if (pair->native) {
+				continue;
+			}
+
+			// Lazily compiled expressions aren't tuned, but the subjects
+			// they match still mustn't reach the ones after them
+			if (!pair->regex) {
+				const struct ua_lazy_regex *lazy = _expression_pair_compile_lazily(ua_parser, pair);
+
+				if (lazy && lazy->regex) {
+					_tune_drop_matched(lazy->regex, lazy->pcre_extra, &tune_corpus, reaching);
+				}
+				continue;
+			}
+
+			uint64_t times[TUNE_CANDIDATES];
+			int choice;
+			changed += _tune_pair(pair, &tune_corpus, reaching, forced, times, &choice);
+
+			if (report) {
+				// The variant ASCII user agents ran; the rest run the original
+				const enum ua_tune_variant variant = pair->lowercase_regex && lowercase_buffer ? TUNE_LOWERCASE
+					: pair->ascii_regex ? TUNE_ASCII
+					: TUNE_ORIGINAL;
+
+				fprintf(report, "%s\t%u\t%s\t%s",
+						tune_group_names[i], pair->index, tune_candidate_names[choice], tune_variant_names[variant]);
+				for (int c = 0; c < TUNE_CANDIDATES; c++) {
+					if (times[c] != UINT64_MAX) {
+						fprintf(report, "\t%llu", (unsigned long long)times[c]);
+					} else {
+						fprintf(report, "\t-");
+					}
+				}
+				fputc('\n', report);
+			}
+
+			_tune_drop_matched(pair->regex, pair->pcre_extra, &tune_corpus, reaching);
+		}
+	}
+
+	free(lengths);
+	free(ascii);
+	free(reaching);
+	free(lowercase);
+	free(lowercase_buffer);
+
+	_user_agent_parser_update_variants(ua_parser);
+	uap_parser_set_memory_budget(ua_parser, ua_parser->memory_budget);
+
+	return changed;
+}
+
+
+int uap_parser_autotune(struct uap_parser *ua_parser, const char *const *corpus, const size_t count, FILE *report) {
+	return _autotune(ua_parser, corpus, count, report, -1);
+}
+
+
+int uap_parser_autotune_force(struct uap_parser *ua_parser, const char *const *corpus, const size_t count, const int strategy) {
+	if (strategy < 0 || strategy >= TUNE_CANDIDATES) {
+		return -1;
+	}
+
+	return _autotune(ua_parser, corpus, count, NULL, strategy);
 }
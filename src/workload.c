@@ -0,0 +1,424 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "uap/uap.h"
+#include "uap/workload.h"
+
+#define WORKLOAD_MAX_KEYS (1 << 14)                  // sampled user agents remembered
+#define WORKLOAD_TABLE_SLOTS (2 * WORKLOAD_MAX_KEYS) // hash table at most half full
+#define WORKLOAD_TIMES (4 * WORKLOAD_MAX_KEYS)       // timestamps before renumbering
+#define WORKLOAD_DISTANCE_BUCKETS 65
+#define WORKLOAD_DEFAULT_WINDOW 60
+
+#define WORKLOAD_PARSE_COUNTERS 16 // spread to keep parsing threads off each other's lines
+#define WORKLOAD_PENDING 1024      // sampled hashes queued for the lock holder
+#define WORKLOAD_DRAIN_BATCH 64    // sampled parses between draining the queue
+
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+
+struct workload_counter {
+	uint64_t count;
+	char padding[64 - sizeof(uint64_t)];
+};
+
+
+// A queue slot. Its sequence is its position while free, and the position
+// plus one once the hash has been written.
+struct workload_pending {
+	uint64_t sequence;
+	uint64_t hash;
+};
+
+
+struct workload_t {
+	uint64_t threshold;        // user agents hashing below this are sampled
+	unsigned int sampling;     // 1 in this many
+	uint64_t window_ns;
+
+	// Everything down to the distinct counters is guarded by the lock
+	pthread_mutex_t lock;
+
+	// Sampled user agents, by hash, and the time of their latest access.
+	// Linear probing, 0 marks an empty slot.
+	uint64_t keys[WORKLOAD_TABLE_SLOTS];
+	uint32_t key_times[WORKLOAD_TABLE_SLOTS];
+
+	// The user agent accessed at each time, or 0 if it's been accessed since
+	uint64_t time_keys[WORKLOAD_TIMES];
+
+	// Fenwick tree over times, 1 at each user agent's latest access, so the
+	// distinct user agents seen since a time is a difference of prefix sums
+	uint32_t fenwick[WORKLOAD_TIMES + 1];
+
+	uint32_t now;    // next time to hand out
+	uint32_t oldest; // no latest accesses before this
+	uint32_t live;   // user agents in the table
+
+	// Reuse distances, scaled by the sampling rate: bucket 0 holds distance
+	// 0, bucket k distances from 2^(k-1) up to 2^k
+	uint64_t distances[WORKLOAD_DISTANCE_BUCKETS];
+	uint64_t cold; // first accesses, or accesses after being forgotten
+	uint64_t sampled;
+
+	// HyperLogLog registers for the window in progress and the other one,
+	// updated without the lock
+	uint8_t registers[2][HLL_REGISTERS];
+	int current;
+	uint64_t window_start;
+	uint64_t distinct_last;
+
+	// Every parse, sampled or not, split by hash
+	struct workload_counter parses[WORKLOAD_PARSE_COUNTERS];
+
+	// Sampled hashes waiting to be recorded. Parses claim slots at the head
+	// without the lock; whoever holds the lock drains from the tail.
+	struct workload_pending pending[WORKLOAD_PENDING];
+	uint64_t pending_head;
+	uint64_t pending_tail;
+};
+
+
+static uint64_t _now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+struct workload_t *workload_create(const unsigned int sampling, const unsigned int window_seconds) {
+	struct workload_t *workload = calloc(1, sizeof(struct workload_t));
+	if (!workload) {
+		return NULL;
+	}
+
+	workload->sampling = sampling ? sampling : 1;
+	workload->threshold = workload->sampling == 1 ? UINT64_MAX : UINT64_MAX / workload->sampling;
+	workload->window_ns = (uint64_t)(window_seconds ? window_seconds : WORKLOAD_DEFAULT_WINDOW) * 1000000000;
+	workload->window_start = _now_ns();
+	for (uint64_t i = 0; i < WORKLOAD_PENDING; i++) {
+		workload->pending[i].sequence = i;
+	}
+	pthread_mutex_init(&workload->lock, NULL);
+
+	return workload;
+}
+
+
+void workload_destroy(struct workload_t *workload) {
+	if (workload) {
+		pthread_mutex_destroy(&workload->lock);
+		free(workload);
+	}
+}
+
+
+size_t workload_bytes(const struct workload_t *workload) {
+	return workload ? sizeof(struct workload_t) : 0;
+}
+
+
+//####################
+// Reuse distances
+//####################
+
+static void _fenwick_add(struct workload_t *workload, const uint32_t time, const int delta) {
+	for (uint32_t i = time + 1; i <= WORKLOAD_TIMES; i += i & -i) {
+		workload->fenwick[i] += delta;
+	}
+}
+
+
+// Latest accesses at or before `time`
+static uint32_t _fenwick_prefix(const struct workload_t *workload, const uint32_t time) {
+	uint32_t sum = 0;
+	for (uint32_t i = time + 1; i > 0; i -= i & -i) {
+		sum += workload->fenwick[i];
+	}
+	return sum;
+}
+
+
+// Slot holding `key`, or the empty slot where it belongs
+static size_t _table_find(const struct workload_t *workload, const uint64_t key) {
+	size_t slot = key & (WORKLOAD_TABLE_SLOTS - 1);
+
+	while (workload->keys[slot] && workload->keys[slot] != key) {
+		slot = (slot + 1) & (WORKLOAD_TABLE_SLOTS - 1);
+	}
+
+	return slot;
+}
+
+
+// Empty a slot, shifting back any entries which probed past it
+static void _table_remove(struct workload_t *workload, size_t hole) {
+	const size_t mask = WORKLOAD_TABLE_SLOTS - 1;
+
+	for (size_t next = (hole + 1) & mask; workload->keys[next]; next = (next + 1) & mask) {
+		const size_t home = workload->keys[next] & mask;
+
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			workload->keys[hole] = workload->keys[next];
+			workload->key_times[hole] = workload->key_times[next];
+			hole = next;
+		}
+	}
+
+	workload->keys[hole] = 0;
+}
+
+
+// Renumber the latest accesses from 0 once the times run out
+static void _renumber_times(struct workload_t *workload) {
+	uint32_t next = 0;
+
+	for (uint32_t time = workload->oldest; time < workload->now; time++) {
+		const uint64_t key = workload->time_keys[time];
+
+		if (key) {
+			workload->time_keys[next] = key;
+			workload->key_times[_table_find(workload, key)] = next;
+			next++;
+		}
+	}
+
+	memset(workload->time_keys + next, 0, (WORKLOAD_TIMES - next) * sizeof(uint64_t));
+
+	// Linear time build: every node passes its count up to its parent
+	memset(workload->fenwick, 0, sizeof(workload->fenwick));
+	for (uint32_t i = 1; i <= WORKLOAD_TIMES; i++) {
+		workload->fenwick[i] += i <= next;
+
+		const uint32_t parent = i + (i & -i);
+		if (parent <= WORKLOAD_TIMES) {
+			workload->fenwick[parent] += workload->fenwick[i];
+		}
+	}
+
+	workload->oldest = 0;
+	workload->now = next;
+}
+
+
+// Forget the least recently accessed user agent
+static void _forget_oldest(struct workload_t *workload) {
+	while (!workload->time_keys[workload->oldest]) {
+		workload->oldest++;
+	}
+
+	const uint32_t time = workload->oldest;
+	_table_remove(workload, _table_find(workload, workload->time_keys[time]));
+	_fenwick_add(workload, time, -1);
+	workload->time_keys[time] = 0;
+	workload->live--;
+}
+
+
+static void _record_sampled(struct workload_t *workload, const uint64_t hash) {
+	const uint64_t key = hash ? hash : 1;
+	size_t slot = _table_find(workload, key);
+
+	workload->sampled++;
+
+	if (workload->keys[slot]) {
+		// Distinct user agents accessed since this one was
+		const uint32_t time = workload->key_times[slot];
+		const uint64_t distance = _fenwick_prefix(workload, workload->now - 1) - _fenwick_prefix(workload, time);
+		const uint64_t scaled = distance * workload->sampling;
+
+		workload->distances[scaled ? 64 - __builtin_clzll(scaled) : 0]++;
+
+		_fenwick_add(workload, time, -1);
+		workload->time_keys[time] = 0;
+		workload->live--;
+	} else {
+		workload->cold++;
+		workload->keys[slot] = key;
+	}
+
+	if (workload->now == WORKLOAD_TIMES) {
+		_renumber_times(workload);
+	}
+
+	const uint32_t time = workload->now++;
+	workload->time_keys[time] = key;
+	workload->key_times[slot] = time;
+	_fenwick_add(workload, time, 1);
+	workload->live++;
+
+	if (workload->live > WORKLOAD_MAX_KEYS) {
+		_forget_oldest(workload);
+	}
+}
+
+
+//####################
+// Distinct counting
+//####################
+
+static uint64_t _hll_estimate(const uint8_t *registers) {
+	double sum = 0;
+	unsigned int zeros = 0;
+
+	for (int i = 0; i < HLL_REGISTERS; i++) {
+		const uint8_t rank = __atomic_load_n(&registers[i], __ATOMIC_RELAXED);
+		sum += ldexp(1.0, -rank);
+		zeros += rank == 0;
+	}
+
+	const double m = HLL_REGISTERS;
+	double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+	// Linear counting is more accurate while many registers are unused
+	if (estimate <= 2.5 * m && zeros) {
+		estimate = m * log(m / zeros);
+	}
+
+	return (uint64_t)(estimate + 0.5);
+}
+
+
+// Start a new window if the current one is over. Called with the lock held.
+static void _window_rotate(struct workload_t *workload, const uint64_t now) {
+	if (now - __atomic_load_n(&workload->window_start, __ATOMIC_RELAXED) < workload->window_ns) {
+		return;
+	}
+
+	const int current = __atomic_load_n(&workload->current, __ATOMIC_RELAXED);
+	workload->distinct_last = _hll_estimate(workload->registers[current]);
+
+	// Parses still writing to the old registers just count towards the
+	// window that ended
+	for (int i = 0; i < HLL_REGISTERS; i++) {
+		__atomic_store_n(&workload->registers[!current][i], 0, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&workload->current, !current, __ATOMIC_RELEASE);
+	__atomic_store_n(&workload->window_start, now, __ATOMIC_RELAXED);
+}
+
+
+//####################
+// Sample queue
+//####################
+
+// Queue a sampled hash, returning its position, or UINT64_MAX if the queue
+// is full
+static uint64_t _pending_push(struct workload_t *workload, const uint64_t hash) {
+	uint64_t pos = __atomic_load_n(&workload->pending_head, __ATOMIC_RELAXED);
+
+	while (true) {
+		struct workload_pending *slot = &workload->pending[pos % WORKLOAD_PENDING];
+		const uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == pos) {
+			if (__atomic_compare_exchange_n(&workload->pending_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				slot->hash = hash;
+				__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+				return pos;
+			}
+		} else if (sequence < pos) {
+			// Not drained since the last lap
+			return UINT64_MAX;
+		} else {
+			pos = __atomic_load_n(&workload->pending_head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+// Record the queued hashes, up to the first still being written. Called with
+// the lock held.
+static void _pending_drain(struct workload_t *workload) {
+	while (true) {
+		const uint64_t pos = workload->pending_tail;
+		struct workload_pending *slot = &workload->pending[pos % WORKLOAD_PENDING];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+			return;
+		}
+
+		_record_sampled(workload, slot->hash);
+		__atomic_store_n(&slot->sequence, pos + WORKLOAD_PENDING, __ATOMIC_RELEASE);
+		workload->pending_tail = pos + 1;
+	}
+}
+
+
+void workload_record(struct workload_t *workload, const uint64_t hash) {
+	// Register from the top bits, rank from the first set bit of the rest
+	const int current = __atomic_load_n(&workload->current, __ATOMIC_ACQUIRE);
+	uint8_t *reg = &workload->registers[current][hash >> (64 - HLL_BITS)];
+	const uint8_t rank = (uint8_t)(__builtin_clzll((hash << HLL_BITS) | ((uint64_t)1 << (HLL_BITS - 1))) + 1);
+
+	uint8_t seen = __atomic_load_n(reg, __ATOMIC_RELAXED);
+	while (seen < rank && !__atomic_compare_exchange_n(reg, &seen, rank, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	__atomic_fetch_add(&workload->parses[(hash >> 32) % WORKLOAD_PARSE_COUNTERS].count, 1, __ATOMIC_RELAXED);
+
+	if (hash >= workload->threshold && workload->threshold != UINT64_MAX) {
+		return;
+	}
+
+	// Only every WORKLOAD_DRAIN_BATCH-th sampled parse, one finding the queue
+	// full, or one ending the window takes the lock
+	const uint64_t pos = _pending_push(workload, hash);
+	const uint64_t now = _now_ns();
+	const bool window_over = now - __atomic_load_n(&workload->window_start, __ATOMIC_RELAXED) >= workload->window_ns;
+
+	if (pos == UINT64_MAX || (pos + 1) % WORKLOAD_DRAIN_BATCH == 0 || window_over) {
+		pthread_mutex_lock(&workload->lock);
+		_pending_drain(workload);
+		if (pos == UINT64_MAX) {
+			_record_sampled(workload, hash);
+		}
+		_window_rotate(workload, now);
+		pthread_mutex_unlock(&workload->lock);
+	}
+}
+
+
+void workload_stats(struct workload_t *workload, struct uap_workload_stats *stats) {
+	memset(stats, 0, sizeof(struct uap_workload_stats));
+
+	pthread_mutex_lock(&workload->lock);
+
+	const uint64_t now = _now_ns();
+	_pending_drain(workload);
+	_window_rotate(workload, now);
+
+	for (int i = 0; i < WORKLOAD_PARSE_COUNTERS; i++) {
+		stats->parses += __atomic_load_n(&workload->parses[i].count, __ATOMIC_RELAXED);
+	}
+	stats->sampled = workload->sampled;
+
+	// Whether a popular user agent makes the sample skews the sample's size
+	// away from the expected parses / sampling. Like SHARDS-adj, count the
+	// difference as reuses at distance 0, which every cache size hits.
+	const double expected = (double)stats->parses / workload->sampling;
+	const double total = expected > workload->sampled ? expected : workload->sampled;
+
+	// A cache of 2^i entries hits exactly the reuse distances below 2^i,
+	// which are the buckets up to i
+	uint64_t misses = workload->sampled;
+	for (int i = 0; i < UAP_MISS_RATIO_POINTS; i++) {
+		misses -= workload->distances[i];
+		stats->miss_ratio[i] = total > 0 ? misses / total : 0;
+	}
+
+	stats->distinct = _hll_estimate(workload->registers[__atomic_load_n(&workload->current, __ATOMIC_RELAXED)]);
+	stats->distinct_last = workload->distinct_last;
+	stats->window_elapsed = (now - workload->window_start) * 1e-9;
+
+	pthread_mutex_unlock(&workload->lock);
+}
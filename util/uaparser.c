@@ -1,19 +1,595 @@
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "uap/simd.h"
 #include "uap/uap.h"
 #include "regexes.yaml.h"
 
+// Pipeline mode (-p) parses the user agents of a log far larger than memory
+// in three passes, appending the parsed fields to every record:
+//  1. split the user agents into partition files by hash, so repeats of a
+//     user agent all land in the same partition
+//  2. parse the partitions on a pool of threads, each user agent once per
+//     partition as long as the partition's distinct user agents fit in the
+//     thread's share of the memory budget, writing one result line per user
+//     agent in partition order
+//  3. read the records again, and for each take the next result line from
+//     its user agent's partition, which keeps the input order
+// Input read from stdin is spilled to a file for the third pass.
+
+#define PIPELINE_MIN_PARTITIONS 16
+#define PIPELINE_MAX_PARTITIONS 512  // all open at once, mind the fd limit
+#define PIPELINE_STREAM_PARTITIONS 256 // input of unknown size
+#define PIPELINE_DEFAULT_MEMORY_MB 1024
+
+
+struct pipeline {
+	const struct uap_parser *ua_parser;
+	const char *input_path;     // NULL for stdin
+	int column;                 // 1-based tab-separated column, 0 for the whole line
+	size_t memory_budget;       // bytes, for the dedup tables of all threads
+	int threads;
+	int partitions;
+	char dir[PATH_MAX / 2];     // holds the spill files
+
+	int next_partition;         // handed out to the parse threads
+	bool failed;
+};
+
+
+// A distinct user agent and its result line
+struct dedup_entry {
+	uint64_t hash;
+	size_t length;              // of user_agent, which may hold NUL bytes
+	char *user_agent;           // 0 hash and NULL mark an empty slot
+	char *result;
+};
+
+
+struct dedup_table {
+	struct dedup_entry *slots;
+	size_t capacity;            // a power of 2
+	size_t count;
+	size_t bytes;
+	size_t limit;               // stop remembering user agents past this
+};
+
+
+// The user agent in a record, without its line ending
+static const char *_record_user_agent(const char *record, const size_t length, const int column, size_t *ua_length) {
+	const char *start = record;
+	const char *end = record + length;
+
+	while (end > start && (end[-1] == '\n' || end[-1] == '\r')) {
+		end--;
+	}
+
+	for (int i = 1; i < column && start < end; i++) {
+		const char *tab = memchr(start, '\t', end - start);
+		start = tab ? tab + 1 : end;
+	}
+
+	if (column > 0) {
+		const char *tab = memchr(start, '\t', end - start);
+		end = tab ? tab : end;
+	}
+
+	*ua_length = end - start;
+	return start;
+}
+
+
+static void _spill_path(const struct pipeline *pipeline, const char *kind, const int partition, char *path) {
+	snprintf(path, PATH_MAX, "%s/%s.%d", pipeline->dir, kind, partition);
+}
+
+
+static FILE **_open_spill_files(const struct pipeline *pipeline, const char *kind, const char *mode) {
+	FILE **files = calloc(pipeline->partitions, sizeof(FILE *));
+	char path[PATH_MAX];
+
+	for (int i = 0; files && i < pipeline->partitions; i++) {
+		_spill_path(pipeline, kind, i, path);
+
+		if (!(files[i] = fopen(path, mode))) {
+			fprintf(stderr, "unable to open %s\n", path);
+			while (i-- > 0) {
+				fclose(files[i]);
+			}
+			free(files);
+			return NULL;
+		}
+	}
+
+	return files;
+}
+
+
+static bool _close_spill_files(const struct pipeline *pipeline, FILE **files) {
+	bool ok = true;
+
+	for (int i = 0; i < pipeline->partitions; i++) {
+		ok = fclose(files[i]) == 0 && ok;
+	}
+
+	free(files);
+	return ok;
+}
+
+
+//####################
+// Pass 1: partition
+//####################
+
+static bool _pipeline_partition(struct pipeline *pipeline, FILE *input, FILE *records) {
+	FILE **parts = _open_spill_files(pipeline, "part", "w");
+	if (!parts) {
+		return false;
+	}
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	bool ok = true;
+
+	while (ok && (length = getline(&line, &capacity, input)) > 0) {
+		size_t ua_length;
+		const char *ua = _record_user_agent(line, length, pipeline->column, &ua_length);
+		FILE *part = parts[simd_hash64(ua, ua_length, 0) % pipeline->partitions];
+
+		ok = fwrite(ua, 1, ua_length, part) == ua_length && fputc('\n', part) != EOF;
+
+		if (records) {
+			ok = ok && fwrite(line, 1, length, records) == (size_t)length;
+		}
+	}
+
+	free(line);
+	ok = !ferror(input) && _close_spill_files(pipeline, parts) && ok;
+
+	if (!ok) {
+		fprintf(stderr, "unable to write the partition files\n");
+	}
+
+	return ok;
+}
+
+
+//####################
+// Pass 2: parse
+//####################
+
+// Tab-separated fields of a result, tabs and line breaks within them
+// blanked, in `out`, grown to fit. Returns the length, or 0 if out of memory.
+static size_t _format_result(const char *const values[UAP_NUM_FIELDS], const size_t lengths[UAP_NUM_FIELDS], char **out, size_t *capacity) {
+	size_t size = UAP_NUM_FIELDS + 1;
+
+	for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+		size += lengths[field];
+	}
+
+	if (size > *capacity) {
+		char *grown = realloc(*out, size);
+		if (!grown) {
+			return 0;
+		}
+		*out = grown;
+		*capacity = size;
+	}
+
+	size_t length = 0;
+
+	for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+		if (field > 0) {
+			(*out)[length++] = '\t';
+		}
+
+		for (size_t i = 0; i < lengths[field]; i++) {
+			const char c = values[field][i];
+			(*out)[length++] = c == '\t' || c == '\n' || c == '\r' ? ' ' : c;
+		}
+	}
+
+	(*out)[length++] = '\n';
+	(*out)[length] = '\0';
+	return length;
+}
+
+
+// Parses a user agent into its result line. Parsing into a uap_inline_info
+// allocates nothing, but results too long for one are parsed again in full.
+static size_t _parse_result(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *full_info,
+		const char *ua,
+		const size_t length,
+		char **out,
+		size_t *capacity)
+{
+	const char *values[UAP_NUM_FIELDS];
+	size_t lengths[UAP_NUM_FIELDS];
+	struct uap_inline_info info;
+
+	uap_parser_parse_inline(ua_parser, &info, ua, length);
+
+	if (info.overflow && uap_parser_parse_string_length(ua_parser, full_info, ua, length) > 0) {
+		for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+			values[field] = ((const char **)full_info)[field];
+			lengths[field] = full_info->length[field];
+		}
+	} else {
+		for (int field = 0; field < UAP_NUM_FIELDS; field++) {
+			values[field] = info.data + info.offset[field];
+			lengths[field] = info.length[field];
+		}
+	}
+
+	return _format_result(values, lengths, out, capacity);
+}
+
+
+static struct dedup_entry *_dedup_find(struct dedup_table *table, const uint64_t hash, const char *ua, const size_t length) {
+	size_t slot = hash & (table->capacity - 1);
+
+	while (table->slots[slot].user_agent) {
+		struct dedup_entry *entry = &table->slots[slot];
+
+		if (entry->hash == hash && entry->length == length && memcmp(entry->user_agent, ua, length) == 0) {
+			return entry;
+		}
+
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	return &table->slots[slot];
+}
+
+
+// Keeps the table at most half full. False if that would go over the limit.
+static bool _dedup_reserve(struct dedup_table *table) {
+	if ((table->count + 1) * 2 <= table->capacity) {
+		return true;
+	}
+
+	const size_t capacity = table->capacity * 2;
+	if (table->bytes + capacity * sizeof(struct dedup_entry) > table->limit) {
+		return false;
+	}
+
+	struct dedup_entry *slots = calloc(capacity, sizeof(struct dedup_entry));
+	if (!slots) {
+		return false;
+	}
+
+	struct dedup_entry *old = table->slots;
+	const size_t old_capacity = table->capacity;
+	table->slots = slots;
+	table->capacity = capacity;
+	table->bytes += (capacity - old_capacity) * sizeof(struct dedup_entry);
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old[i].user_agent) {
+			size_t slot = old[i].hash & (capacity - 1);
+			while (slots[slot].user_agent) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			slots[slot] = old[i];
+		}
+	}
+
+	free(old);
+	return true;
+}
+
+
+static void _dedup_clear(struct dedup_table *table) {
+	for (size_t i = 0; i < table->capacity; i++) {
+		free(table->slots[i].user_agent);
+	}
+
+	memset(table->slots, 0, table->capacity * sizeof(struct dedup_entry));
+	table->bytes = table->capacity * sizeof(struct dedup_entry);
+	table->count = 0;
+}
+
+
+static bool _pipeline_parse_partition(struct pipeline *pipeline, const int partition, struct dedup_table *table) {
+	char part_path[PATH_MAX], result_path[PATH_MAX];
+	_spill_path(pipeline, "part", partition, part_path);
+	_spill_path(pipeline, "result", partition, result_path);
+
+	FILE *part = fopen(part_path, "r");
+	FILE *results = fopen(result_path, "w");
+
+	if (!part || !results) {
+		fprintf(stderr, "unable to open the files of partition %d\n", partition);
+		if (part) {
+			fclose(part);
+		}
+		if (results) {
+			fclose(results);
+		}
+		return false;
+	}
+
+	struct uap_useragent_info full_info;
+	uap_useragent_info_init(&full_info);
+
+	char *result = NULL;
+	size_t result_capacity = 0;
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	bool ok = true;
+
+	while (ok && (length = getline(&line, &capacity, part)) > 0) {
+		const size_t ua_length = length - 1;
+		const uint64_t hash = simd_hash64(line, ua_length, 0);
+		struct dedup_entry *entry = _dedup_find(table, hash, line, ua_length);
+
+		if (entry->user_agent) {
+			ok = fputs(entry->result, results) != EOF;
+			continue;
+		}
+
+		const size_t result_length = _parse_result(pipeline->ua_parser, &full_info, line, ua_length, &result, &result_capacity);
+		ok = result_length > 0 && fwrite(result, 1, result_length, results) == result_length;
+
+		// Past the limit, user agents are parsed every time they come up
+		const size_t bytes = ua_length + result_length + 2;
+		if (table->bytes + bytes <= table->limit && _dedup_reserve(table)) {
+			entry = _dedup_find(table, hash, line, ua_length);
+			entry->user_agent = malloc(bytes);
+
+			if (entry->user_agent) {
+				memcpy(entry->user_agent, line, ua_length);
+				entry->user_agent[ua_length] = '\0';
+				entry->result = entry->user_agent + ua_length + 1;
+				memcpy(entry->result, result, result_length + 1);
+				entry->hash = hash;
+				entry->length = ua_length;
+				table->bytes += bytes;
+				table->count++;
+			}
+		}
+	}
+
+	free(line);
+	free(result);
+	uap_useragent_info_cleanup(&full_info);
+	ok = !ferror(part) && ok;
+	fclose(part);
+	ok = fclose(results) == 0 && ok;
+	remove(part_path);
+
+	_dedup_clear(table);
+	return ok;
+}
+
+
+static void *_pipeline_parse_thread(void *arg) {
+	struct pipeline *pipeline = arg;
+
+	struct dedup_table table = {
+		.capacity = 1024,
+		.limit    = pipeline->memory_budget / pipeline->threads,
+	};
+	table.slots = calloc(table.capacity, sizeof(struct dedup_entry));
+	table.bytes = table.capacity * sizeof(struct dedup_entry);
+
+	if (!table.slots) {
+		__atomic_store_n(&pipeline->failed, true, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	int partition;
+	while ((partition = __atomic_fetch_add(&pipeline->next_partition, 1, __ATOMIC_RELAXED)) < pipeline->partitions) {
+		if (!_pipeline_parse_partition(pipeline, partition, &table)) {
+			__atomic_store_n(&pipeline->failed, true, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	free(table.slots);
+	return NULL;
+}
+
+
+static bool _pipeline_parse(struct pipeline *pipeline) {
+	pthread_t *threads = calloc(pipeline->threads, sizeof(pthread_t));
+	if (!threads) {
+		return false;
+	}
+
+	int started = 0;
+	while (started < pipeline->threads && pthread_create(&threads[started], NULL, &_pipeline_parse_thread, pipeline) == 0) {
+		started++;
+	}
+
+	// Whatever threads did start finish the work between them
+	if (started == 0) {
+		_pipeline_parse_thread(pipeline);
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	return !pipeline->failed;
+}
+
+
+//####################
+// Pass 3: join
+//####################
+
+static bool _pipeline_join(struct pipeline *pipeline, FILE *records, FILE *output) {
+	FILE **results = _open_spill_files(pipeline, "result", "r");
+	if (!results) {
+		return false;
+	}
+
+	char *line = NULL, *result = NULL;
+	size_t capacity = 0, result_capacity = 0;
+	ssize_t length;
+	bool ok = true;
+
+	while (ok && (length = getline(&line, &capacity, records)) > 0) {
+		size_t ua_length;
+		const char *ua = _record_user_agent(line, length, pipeline->column, &ua_length);
+		FILE *partition = results[simd_hash64(ua, ua_length, 0) % pipeline->partitions];
+
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			length--;
+		}
+
+		ok = getline(&result, &result_capacity, partition) > 0 &&
+			fwrite(line, 1, length, output) == (size_t)length &&
+			fputc('\t', output) != EOF &&
+			fputs(result, output) != EOF;
+	}
+
+	if (!ok) {
+		fprintf(stderr, "unable to join the results onto the records\n");
+	}
+
+	free(line);
+	free(result);
+	_close_spill_files(pipeline, results);
+
+	char path[PATH_MAX];
+	for (int i = 0; i < pipeline->partitions; i++) {
+		_spill_path(pipeline, "result", i, path);
+		remove(path);
+	}
+
+	return ok && !ferror(records);
+}
+
+
+static int pipeline_main(const struct uap_parser *ua_parser, int argc, char **argv) {
+	struct pipeline pipeline = {
+		.ua_parser     = ua_parser,
+		.memory_budget = (size_t)PIPELINE_DEFAULT_MEMORY_MB << 20,
+		.threads       = (int)sysconf(_SC_NPROCESSORS_ONLN),
+	};
+	const char *spill_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	bool usage = false;
+	int opt;
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "pc:m:j:P:T:")) != -1) {
+		switch (opt) {
+			case 'p': break;
+			case 'c': pipeline.column = atoi(optarg); break;
+			case 'm': pipeline.memory_budget = strtoull(optarg, NULL, 10) << 20; break;
+			case 'j': pipeline.threads = atoi(optarg); break;
+			case 'P': pipeline.partitions = atoi(optarg); break;
+			case 'T': spill_dir = optarg; break;
+			default: usage = true; break;
+		}
+	}
+
+	if (usage || optind + 1 < argc || pipeline.column < 0 || pipeline.partitions < 0 ||
+			pipeline.partitions > PIPELINE_MAX_PARTITIONS) {
+		printf("usage: %s -p [-c column] [-m memory MB] [-j threads] [-P partitions] [-T spill dir] [log file]\n", argv[0]);
+		return -1;
+	}
+
+	pipeline.input_path = optind < argc ? argv[optind] : NULL;
+	pipeline.threads = pipeline.threads > 0 ? pipeline.threads : 1;
+
+	// Enough partitions for each one's user agents to fit a thread's share
+	// of the budget, which the whole input certainly does
+	struct stat st;
+	if (!pipeline.partitions && pipeline.input_path && stat(pipeline.input_path, &st) == 0) {
+		const size_t share = pipeline.memory_budget / pipeline.threads + 1;
+		const size_t needed = 2 * ((size_t)st.st_size / share + 1);
+		pipeline.partitions = needed < PIPELINE_MIN_PARTITIONS ? PIPELINE_MIN_PARTITIONS
+			: needed > PIPELINE_MAX_PARTITIONS ? PIPELINE_MAX_PARTITIONS
+			: (int)needed;
+	} else if (!pipeline.partitions) {
+		pipeline.partitions = PIPELINE_STREAM_PARTITIONS;
+	}
+
+	snprintf(pipeline.dir, sizeof(pipeline.dir), "%s/uaparser.XXXXXX", spill_dir);
+	if (!mkdtemp(pipeline.dir)) {
+		fprintf(stderr, "unable to create a spill directory in %s\n", spill_dir);
+		return -1;
+	}
+
+	FILE *input = pipeline.input_path ? fopen(pipeline.input_path, "r") : stdin;
+	char records_path[PATH_MAX];
+	snprintf(records_path, sizeof(records_path), "%s/records", pipeline.dir);
+	FILE *records = pipeline.input_path ? NULL : fopen(records_path, "w");
+
+	bool ok = input && (pipeline.input_path || records);
+	if (!ok) {
+		fprintf(stderr, "unable to open %s\n", input ? records_path : pipeline.input_path);
+	}
+
+	ok = ok && _pipeline_partition(&pipeline, input, records);
+
+	if (records) {
+		ok = fclose(records) == 0 && ok;
+	}
+	if (input && input != stdin) {
+		fclose(input);
+	}
+
+	ok = ok && _pipeline_parse(&pipeline);
+
+	if (ok) {
+		FILE *again = fopen(pipeline.input_path ? pipeline.input_path : records_path, "r");
+		ok = again && _pipeline_join(&pipeline, again, stdout);
+		if (again) {
+			fclose(again);
+		}
+	}
+
+	// Leftovers of a failed run
+	char path[PATH_MAX];
+	for (int i = 0; i < pipeline.partitions; i++) {
+		_spill_path(&pipeline, "part", i, path);
+		remove(path);
+		_spill_path(&pipeline, "result", i, path);
+		remove(path);
+	}
+	remove(records_path);
+	rmdir(pipeline.dir);
+
+	return ok && fflush(stdout) == 0 ? 0 : -1;
+}
+
+
 int main(int argc, char **argv) {
 
 	if (argc < 2) {
 		printf("usage: %s <user agent string>\n", argv[0]);
+		printf("       %s -p [-c column] [-m memory MB] [-j threads] [-P partitions] [-T spill dir] [log file]\n", argv[0]);
 		return -1;
 	}
 
 	struct uap_parser *ua_parser = uap_parser_create();
-	struct uap_useragent_info *ua_info = uap_useragent_info_create();
 
 	uap_parser_read_buffer(ua_parser, ___uap_core_regexes_yaml, ___uap_core_regexes_yaml_len);
 
+	if (strcmp(argv[1], "-p") == 0) {
+		const int status = pipeline_main(ua_parser, argc, argv);
+		uap_parser_destroy(ua_parser);
+		return status;
+	}
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+
 	if (uap_parser_parse_string(ua_parser, ua_info, argv[1])) {
 
 		printf("user_agent.family\t%s\n",  ua_info->user_agent.family);
@@ -25,7 +601,7 @@ int main(int argc, char **argv) {
 		printf("os.major\t%s\n",           ua_info->os.major);
 		printf("os.minor\t%s\n",           ua_info->os.minor);
 		printf("os.patch\t%s\n",           ua_info->os.patch);
-		printf("os.patchMinor\t%s\n",      ua_info->os.patch);
+		printf("os.patchMinor\t%s\n",      ua_info->os.patchMinor);
 
 		printf("device.family\t%s\n",      ua_info->device.family);
 		printf("device.brand\t%s\n",       ua_info->device.brand);
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "uap/uap.h"
+
+// Parse throughput benchmark. Loads a regexes.yaml, then parses every line of
+// a corpus of user agent strings a number of times. Also serves as the
+// training run for the profile-guided release build.
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static char **read_corpus(const char *path, size_t *count) {
+	FILE *fd = fopen(path, "rb");
+	if (!fd) {
+		return NULL;
+	}
+
+	size_t capacity = 1024;
+	char **lines = malloc(capacity * sizeof(char*));
+	char line[8192];
+	*count = 0;
+
+	while (lines && fgets(line, sizeof(line), fd)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0] || line[0] == '#') {
+			continue;
+		}
+		if (*count == capacity) {
+			capacity *= 2;
+			lines = realloc(lines, capacity * sizeof(char*));
+		}
+		if (lines) {
+			lines[(*count)++] = strdup(line);
+		}
+	}
+
+	fclose(fd);
+	return lines;
+}
+
+
+int main(int argc, char **argv) {
+	struct uap_parser_options options = { .flags = 0 };
+	int iterations = 10;
+	int loads = 1;
+	const char *profile_in = NULL;
+	const char *profile_out = NULL;
+	const char *tune_report = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:l:MAc:b:p:P:w:t:")) != -1) {
+		switch (opt) {
+			case 'n': iterations = atoi(optarg); break;
+			case 'l': loads = atoi(optarg); break;
+			case 'M': options.flags |= UAP_PARSER_MERGE_RULES; break;
+			case 'A': options.flags |= UAP_PARSER_ASCII_RULES; break;
+			case 'c': options.negative_cache_entries = strtoul(optarg, NULL, 10); break;
+			case 'b': options.memory_budget = strtoul(optarg, NULL, 10); break;
+			case 'p': profile_in = optarg; break;
+			case 'P': profile_out = optarg; break;
+			case 'w': options.workload_sampling = strtoul(optarg, NULL, 10); break;
+			case 't': tune_report = optarg; break;
+			default: optind = argc + 1; break;
+		}
+	}
+
+	if (optind + 2 != argc || iterations < 1 || loads < 1) {
+		printf("usage: %s [-n iterations] [-l loads] [-M] [-A] [-c cache entries] [-b memory budget] [-p profile] [-P profile out] [-w workload sampling] [-t autotune report] <regexes.yaml> <user agent corpus>\n", argv[0]);
+		return -1;
+	}
+
+	size_t count = 0;
+	char **corpus = read_corpus(argv[optind + 1], &count);
+	if (!corpus || count == 0) {
+		fprintf(stderr, "unable to read %s\n", argv[optind + 1]);
+		return -1;
+	}
+
+	struct uap_parser *ua_parser = NULL;
+	const double load_start = now_seconds();
+
+	for (int i = 0; i < loads; i++) {
+		FILE *fd = fopen(argv[optind], "rb");
+		if (!fd) {
+			fprintf(stderr, "unable to open %s\n", argv[optind]);
+			return -1;
+		}
+		if (ua_parser) {
+			uap_parser_destroy(ua_parser);
+		}
+		ua_parser = uap_parser_create_with_options(&options);
+
+		// Loaded first, so unused expressions are compiled lazily
+		FILE *profile_fd = profile_in ? fopen(profile_in, "rb") : NULL;
+		if (profile_fd) {
+			if (uap_parser_load_profile(ua_parser, profile_fd) < 0) {
+				fprintf(stderr, "invalid profile %s\n", profile_in);
+			}
+			fclose(profile_fd);
+		}
+
+		uap_parser_read_file(ua_parser, fd);
+		fclose(fd);
+	}
+
+	// Tuned on the corpus about to be timed, so take the results with a
+	// pinch of salt
+	FILE *report_fd = tune_report ? fopen(tune_report, "w") : NULL;
+	if (report_fd) {
+		printf("tuned\t%d expressions\n", uap_parser_autotune(ua_parser, (const char *const *)corpus, count, report_fd));
+		fclose(report_fd);
+	}
+
+	uap_parser_collect_rule_stats(ua_parser, profile_out != NULL);
+
+	const double load_time = (now_seconds() - load_start) / loads;
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	unsigned long matched = 0;
+	const double parse_start = now_seconds();
+
+	for (int i = 0; i < iterations; i++) {
+		for (size_t j = 0; j < count; j++) {
+			matched += uap_parser_parse_string(ua_parser, ua_info, corpus[j]);
+		}
+	}
+
+	const double parse_time = now_seconds() - parse_start;
+	const double parses = (double)iterations * count;
+
+	printf("load\t%.3f ms\n", load_time * 1e3);
+	printf("parse\t%.0f user agents in %.3f s, %.0f/s, %.2f us each\n",
+			parses, parse_time, parses / parse_time, parse_time * 1e6 / parses);
+	printf("groups\t%lu matched\n", matched);
+
+	FILE *profile_fd = profile_out ? fopen(profile_out, "wb") : NULL;
+	if (profile_fd) {
+		uap_parser_write_profile(ua_parser, profile_fd);
+		fclose(profile_fd);
+	}
+
+	struct uap_memory_usage usage;
+	uap_parser_memory_usage(ua_parser, &usage);
+	printf("memory\t%zu bytes: %zu rules, %zu variants, %zu jit, %zu caches, %zu workload, %zu strings, %zu scratch\n",
+			usage.total, usage.rules, usage.variants, usage.jit, usage.caches, usage.workload, usage.strings,
+			usage.scratch);
+
+	// Miss-ratio curve of the corpus, for sizing caches
+	struct uap_workload_stats workload;
+	if (uap_parser_workload_stats(ua_parser, &workload)) {
+		printf("distinct\t%llu user agents\n", (unsigned long long)workload.distinct);
+		for (int i = 0; i < UAP_MISS_RATIO_POINTS; i += 2) {
+			printf("lru\t%8lu entries, %.4f miss ratio\n", 1ul << i, workload.miss_ratio[i]);
+		}
+	}
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+
+	for (size_t j = 0; j < count; j++) {
+		free(corpus[j]);
+	}
+	free(corpus);
+
+	return 0;
+}
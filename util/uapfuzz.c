@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "uap/uap.h"
+
+// Cost-guided fuzzing harness for libFuzzer, searching for the user agents
+// which take the longest to parse (see `make fuzz`).
+//
+// Each parse's rule attempts and PCRE match steps are handed to libFuzzer as
+// extra coverage counters, bucketed logarithmically, so an input which costs
+// more than anything seen before counts as new coverage and gets kept and
+// mutated further. Every new worst case is written to $UAP_FUZZ_WORST
+// (default fuzz/worst), and its cost and median parse time are appended to
+// timings.tsv there. Times come from a second parser built without
+// UAP_PARSER_COUNT_STEPS, as the callouts which count steps slow PCRE down.
+//
+// Built with -DUAP_FUZZ_STANDALONE (`make uapfuzz-replay`), it instead
+// replays saved inputs and reports their cost, optionally failing if any
+// exceeds a step budget.
+
+#define COST_BUCKETS 256 // 64 powers of two, each split in four
+#define TIMING_RUNS 9
+
+static struct uap_parser *ua_parser = NULL;
+static struct uap_parser *timing_parser = NULL;
+static struct uap_useragent_info *ua_info = NULL;
+
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Measure the cost of parsing `data`, then parse it a few times without
+// counting steps, returning the median time in microseconds
+static double time_parse(const uint8_t *data, const size_t size, struct uap_parse_cost *cost) {
+	double times[TIMING_RUNS];
+
+	uap_parser_parse_string_cost(ua_parser, ua_info, (const char *)data, size, cost);
+
+	for (int i = 0; i < TIMING_RUNS; i++) {
+		const double start = now_seconds();
+		uap_parser_parse_string_length(timing_parser, ua_info, (const char *)data, size);
+		times[i] = (now_seconds() - start) * 1e6;
+	}
+
+	qsort(times, TIMING_RUNS, sizeof(double), &compare_doubles);
+	return times[TIMING_RUNS / 2];
+}
+
+
+static struct uap_parser *load_parser(const unsigned int flags) {
+	const char *regexes = getenv("UAP_FUZZ_REGEXES");
+	const char *extra_flags = getenv("UAP_FUZZ_FLAGS");
+
+	struct uap_parser_options options = {
+		.flags = flags | (extra_flags ? (unsigned int)strtoul(extra_flags, NULL, 0) : 0),
+	};
+
+	FILE *fd = fopen(regexes ? regexes : "../uap-core/regexes.yaml", "rb");
+	if (!fd) {
+		fprintf(stderr, "unable to open regexes, set UAP_FUZZ_REGEXES\n");
+		return NULL;
+	}
+
+	struct uap_parser *parser = uap_parser_create_with_options(&options);
+	const int loaded = uap_parser_read_file(parser, fd);
+	fclose(fd);
+
+	if (!loaded) {
+		uap_parser_destroy(parser);
+		return NULL;
+	}
+
+	return parser;
+}
+
+
+static int load_parsers() {
+	ua_parser = load_parser(UAP_PARSER_COUNT_STEPS);
+	timing_parser = load_parser(0);
+	ua_info = uap_useragent_info_create();
+
+	return ua_parser && timing_parser;
+}
+
+
+#ifndef UAP_FUZZ_STANDALONE
+
+// Scanned by libFuzzer after every run, alongside its own coverage counters
+__attribute__((used, section("__libfuzzer_extra_counters")))
+static uint8_t cost_counters[2][COST_BUCKETS];
+
+static uint64_t worst_steps = 0;
+
+
+static unsigned int cost_bucket(const uint64_t cost) {
+	if (cost < 4) {
+		return (unsigned int)cost;
+	}
+
+	const int msb = 63 - __builtin_clzll(cost);
+	return msb * 4 + ((cost >> (msb - 2)) & 3);
+}
+
+
+static void save_worst(const uint8_t *data, const size_t size) {
+	const char *dir = getenv("UAP_FUZZ_WORST");
+	if (!dir) {
+		dir = "fuzz/worst";
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		return;
+	}
+
+	struct uap_parse_cost cost;
+	const double usec = time_parse(data, size, &cost);
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/steps-%012llu", dir, (unsigned long long)cost.match_steps);
+
+	FILE *fd = fopen(path, "wb");
+	if (fd) {
+		fwrite(data, 1, size, fd);
+		fclose(fd);
+	}
+
+	char index_path[4096];
+	snprintf(index_path, sizeof(index_path), "%s/timings.tsv", dir);
+
+	fd = fopen(index_path, "a");
+	if (fd) {
+		fprintf(fd, "%llu\t%u\t%.2f\t%s\n",
+				(unsigned long long)cost.match_steps, cost.rules_tried, usec, path);
+		fclose(fd);
+	}
+}
+
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	(void)argc;
+	(void)argv;
+
+	if (!load_parsers()) {
+		exit(1);
+	}
+
+	// The parser reports PCRE errors (invalid UTF-8 mostly) on stdout, which
+	// would swamp libFuzzer's own output on stderr.
+	if (!freopen("/dev/null", "w", stdout)) {
+		exit(1);
+	}
+
+	return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	struct uap_parse_cost cost;
+	uap_parser_parse_string_cost(ua_parser, ua_info, (const char *)data, size, &cost);
+
+	cost_counters[0][cost_bucket(cost.match_steps)] = 1;
+	cost_counters[1][cost_bucket(cost.rules_tried)] = 1;
+
+	if (cost.match_steps > worst_steps) {
+		worst_steps = cost.match_steps;
+		save_worst(data, size);
+	}
+
+	return 0;
+}
+
+#else // UAP_FUZZ_STANDALONE
+
+static uint8_t *read_file(const char *path, size_t *size) {
+	FILE *fd = fopen(path, "rb");
+	if (!fd) {
+		return NULL;
+	}
+
+	size_t capacity = 4096;
+	uint8_t *data = malloc(capacity);
+	*size = 0;
+
+	size_t n;
+	while (data && (n = fread(data + *size, 1, capacity - *size, fd)) > 0) {
+		*size += n;
+		if (*size == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+
+	fclose(fd);
+	return data;
+}
+
+
+int main(int argc, char **argv) {
+	unsigned long long max_steps = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+			case 'm': max_steps = strtoull(optarg, NULL, 10); break;
+			default: optind = argc + 1; break;
+		}
+	}
+
+	if (optind >= argc) {
+		printf("usage: %s [-m max steps] <input>...\n", argv[0]);
+		return -1;
+	}
+
+	if (!load_parsers()) {
+		return -1;
+	}
+
+	int over_budget = 0;
+	printf("steps\trules\tusec\tinput\n");
+
+	for (int i = optind; i < argc; i++) {
+		size_t size;
+		uint8_t *data = read_file(argv[i], &size);
+		if (!data) {
+			fprintf(stderr, "unable to read %s\n", argv[i]);
+			continue;
+		}
+
+		struct uap_parse_cost cost;
+		const double usec = time_parse(data, size, &cost);
+		printf("%llu\t%u\t%.2f\t%s\n", (unsigned long long)cost.match_steps, cost.rules_tried, usec, argv[i]);
+
+		if (max_steps && cost.match_steps > max_steps) {
+			over_budget++;
+		}
+
+		free(data);
+	}
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+	uap_parser_destroy(timing_parser);
+
+	if (over_budget) {
+		fprintf(stderr, "%d inputs over %llu steps\n", over_budget, max_steps);
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif // UAP_FUZZ_STANDALONE
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include "uap/uap.h"
+
+// Reorders a regexes.yaml so the expressions hit most often by a corpus of
+// user agent strings (one per line) are tried first, and writes the result.
+
+int main(int argc, char **argv) {
+
+	if (argc < 3) {
+		printf("usage: %s <regexes.yaml> <user agent corpus> [output.yaml]\n", argv[0]);
+		return -1;
+	}
+
+	FILE *regexes = fopen(argv[1], "rb");
+	if (!regexes) {
+		fprintf(stderr, "unable to open %s\n", argv[1]);
+		return -1;
+	}
+
+	FILE *corpus = fopen(argv[2], "rb");
+	if (!corpus) {
+		fprintf(stderr, "unable to open %s\n", argv[2]);
+		fclose(regexes);
+		return -1;
+	}
+
+	struct uap_parser *ua_parser = uap_parser_create();
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+
+	const int loaded = uap_parser_read_file(ua_parser, regexes);
+	fclose(regexes);
+
+	if (!loaded) {
+		fprintf(stderr, "unable to load %s\n", argv[1]);
+		uap_useragent_info_destroy(ua_info);
+		uap_parser_destroy(ua_parser);
+		fclose(corpus);
+		return -1;
+	}
+
+	uap_parser_collect_rule_stats(ua_parser, 1);
+
+	char line[8192];
+	unsigned long count = 0;
+	while (fgets(line, sizeof(line), corpus)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0]) {
+			uap_parser_parse_string(ua_parser, ua_info, line);
+			count++;
+		}
+	}
+	fclose(corpus);
+
+	const int moved = uap_parser_reorder_rules(ua_parser);
+	fprintf(stderr, "%lu user agents, %d expressions moved\n", count, moved);
+
+	int result = 0;
+	FILE *out = argc > 3 ? fopen(argv[3], "wb") : stdout;
+	if (!out || !uap_parser_write_yaml(ua_parser, out)) {
+		fprintf(stderr, "unable to write reordered expressions\n");
+		result = -1;
+	}
+	if (out && out != stdout) {
+		fclose(out);
+	}
+
+	uap_parser_destroy(ua_parser);
+	uap_useragent_info_destroy(ua_info);
+
+	return result;
+}
@@ -0,0 +1,368 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "uap/uap.h"
+#include "regexes.yaml.h"
+
+// Cold start benchmark. Every sample is a fresh process (fork and exec of this
+// binary) which builds a parser one way, parses a single user agent and
+// reports back:
+//  - time to first parse, from just before the fork to the parse returning
+//  - time spent loading the parser
+//  - resident memory after the first parse, and the peak
+// The parent then prints medians and the 10th to 90th percentile spread for
+// each load mode.
+
+#define MAX_SAMPLES 1000
+
+static const char *first_user_agent =
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36";
+
+static const char *const modes[] = {
+	"file",     // uap_parser_read_file()
+	"buffer",   // uap_parser_read_buffer() on the compiled-in regexes.yaml
+	"parallel", // as buffer, compiling on an executor
+	"profile",  // as buffer, with a rule profile loaded first
+};
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+struct sample {
+	double first_parse; // ms
+	double load;        // ms
+	double rss;         // KiB
+	double peak_rss;    // KiB
+};
+
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Resident memory and its peak in KiB, from one read of /proc/self/status
+// so the two describe the same moment
+static void proc_status_memory(double *rss, double *peak) {
+	FILE *fd = fopen("/proc/self/status", "r");
+	char line[256];
+
+	*rss = *peak = 0;
+
+	while (fd && fgets(line, sizeof(line), fd)) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			*rss = strtod(line + 6, NULL);
+		} else if (strncmp(line, "VmHWM:", 6) == 0) {
+			*peak = strtod(line + 6, NULL);
+		}
+	}
+
+	if (fd) {
+		fclose(fd);
+	}
+}
+
+
+//###############################
+// Child: one cold start
+//###############################
+
+struct spawned_task {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+
+static void *run_spawned_task(void *arg) {
+	struct spawned_task task = *(struct spawned_task *)arg;
+	free(arg);
+	task.fn(task.arg);
+	return NULL;
+}
+
+
+// The simplest possible executor: a detached thread per task
+static int spawn_submit(void *context, void (*fn)(void *arg), void *arg) {
+	(void)context;
+
+	struct spawned_task *task = malloc(sizeof(struct spawned_task));
+	if (!task) {
+		return 0;
+	}
+
+	task->fn = fn;
+	task->arg = arg;
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	const int started = pthread_create(&thread, &attr, &run_spawned_task, task) == 0;
+	pthread_attr_destroy(&attr);
+
+	if (!started) {
+		free(task);
+	}
+	return started;
+}
+
+
+static int cold_start(const char *mode, const uint64_t start, const char *regexes, const char *profile) {
+	struct uap_parser_options options = { .flags = 0 };
+
+	if (strcmp(mode, "parallel") == 0) {
+		options.executor.submit = &spawn_submit;
+		options.executor.concurrency = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	const uint64_t load_start = now_ns();
+	struct uap_parser *ua_parser = uap_parser_create_with_options(&options);
+
+	if (strcmp(mode, "profile") == 0) {
+		FILE *fd = profile ? fopen(profile, "rb") : NULL;
+		if (!fd || uap_parser_load_profile(ua_parser, fd) < 0) {
+			return -1;
+		}
+		fclose(fd);
+	}
+
+	if (strcmp(mode, "file") == 0) {
+		FILE *fd = fopen(regexes, "rb");
+		if (!fd) {
+			return -1;
+		}
+		uap_parser_read_file(ua_parser, fd);
+		fclose(fd);
+	} else {
+		uap_parser_read_buffer(ua_parser, ___uap_core_regexes_yaml, ___uap_core_regexes_yaml_len);
+	}
+
+	const uint64_t load_end = now_ns();
+
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	uap_parser_parse_string(ua_parser, ua_info, first_user_agent);
+	const uint64_t first_parse = now_ns();
+
+	double rss, peak;
+	proc_status_memory(&rss, &peak);
+
+	printf("%.4f %.4f %.0f %.0f\n",
+			(first_parse - start) * 1e-6,
+			(load_end - load_start) * 1e-6,
+			rss, peak);
+
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+	return 0;
+}
+
+
+//###############################
+// Parent: sample and summarize
+//###############################
+
+static int sample_cold_start(const char *self, const char *mode, const char *regexes, const char *profile, struct sample *sample) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0) {
+		return 0;
+	}
+
+	char start[32];
+	snprintf(start, sizeof(start), "%llu", (unsigned long long)now_ns());
+
+	const pid_t pid = fork();
+
+	if (pid == 0) {
+		dup2(pipe_fds[1], STDOUT_FILENO);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+
+		char *args[] = {
+			(char *)self, "-x", (char *)mode, "-s", start,
+			"-p", (char *)(profile ? profile : ""), (char *)regexes, NULL,
+		};
+		execv(self, args);
+		_exit(127);
+	}
+
+	close(pipe_fds[1]);
+
+	FILE *fd = fdopen(pipe_fds[0], "r");
+	int read = 0;
+
+	if (fd) {
+		read = fscanf(fd, "%lf %lf %lf %lf", &sample->first_parse, &sample->load, &sample->rss, &sample->peak_rss) == 4;
+		fclose(fd);
+	} else {
+		close(pipe_fds[0]);
+	}
+
+	int status = 0;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return 0;
+	}
+
+	return read;
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Median and 10th/90th percentiles of one field of the samples
+static void summarize(const struct sample *samples, const int count, const size_t field, double *median, double *low, double *high) {
+	double values[MAX_SAMPLES];
+
+	for (int i = 0; i < count; i++) {
+		values[i] = *(const double *)((const char *)&samples[i] + field);
+	}
+
+	qsort(values, count, sizeof(double), &compare_doubles);
+	*median = count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+	*low = values[count / 10];
+	*high = values[count - 1 - count / 10];
+}
+
+
+// The sample with the median resident memory, so its RSS and peak are
+// reported together; separate medians could put the RSS above the peak
+static const struct sample *median_rss_sample(const struct sample *samples, const int count) {
+	double values[MAX_SAMPLES];
+
+	for (int i = 0; i < count; i++) {
+		values[i] = samples[i].rss;
+	}
+
+	qsort(values, count, sizeof(double), &compare_doubles);
+
+	int median = 0;
+	while (samples[median].rss != values[(count - 1) / 2]) {
+		median++;
+	}
+
+	return &samples[median];
+}
+
+
+// Writes a profile of the corpus to a temporary file, for the profile mode
+static char *write_profile(const char *corpus) {
+	FILE *corpus_fd = fopen(corpus, "rb");
+	if (!corpus_fd) {
+		return NULL;
+	}
+
+	static char path[] = "/tmp/uapstart-XXXXXX";
+	const int profile_fd = mkstemp(path);
+	FILE *fd = profile_fd >= 0 ? fdopen(profile_fd, "wb") : NULL;
+
+	if (!fd) {
+		fclose(corpus_fd);
+		return NULL;
+	}
+
+	struct uap_parser *ua_parser = uap_parser_create();
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	uap_parser_read_buffer(ua_parser, ___uap_core_regexes_yaml, ___uap_core_regexes_yaml_len);
+	uap_parser_collect_rule_stats(ua_parser, 1);
+
+	char line[8192];
+	while (fgets(line, sizeof(line), corpus_fd)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] && line[0] != '#') {
+			uap_parser_parse_string(ua_parser, ua_info, line);
+		}
+	}
+
+	const int written = uap_parser_write_profile(ua_parser, fd);
+
+	fclose(fd);
+	fclose(corpus_fd);
+	uap_useragent_info_destroy(ua_info);
+	uap_parser_destroy(ua_parser);
+
+	return written ? path : NULL;
+}
+
+
+int main(int argc, char **argv) {
+	const char *child_mode = NULL;
+	const char *profile = NULL;
+	const char *corpus = NULL;
+	uint64_t start = 0;
+	int iterations = 21;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:x:s:p:")) != -1) {
+		switch (opt) {
+			case 'n': iterations = atoi(optarg); break;
+			case 'c': corpus = optarg; break;
+			case 'x': child_mode = optarg; break;
+			case 's': start = strtoull(optarg, NULL, 10); break;
+			case 'p': profile = optarg; break;
+			default: optind = argc + 1; break;
+		}
+	}
+
+	if (optind + 1 != argc || iterations < 1 || iterations > MAX_SAMPLES) {
+		printf("usage: %s [-n iterations] [-c profile corpus] <regexes.yaml>\n", argv[0]);
+		return -1;
+	}
+
+	const char *regexes = argv[optind];
+
+	if (child_mode) {
+		return cold_start(child_mode, start, regexes, profile) == 0 ? 0 : 1;
+	}
+
+	// Re-run this binary for every sample, so each one starts cold
+	const char *self = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : argv[0];
+	char *profile_path = corpus ? write_profile(corpus) : NULL;
+
+	printf("%-9s %-26s %-26s %-10s %s\n", "mode", "first parse ms [p10-p90]", "load ms [p10-p90]", "rss KiB", "peak KiB");
+
+	for (size_t mode = 0; mode < NUM_MODES; mode++) {
+		if (strcmp(modes[mode], "profile") == 0 && !profile_path) {
+			continue;
+		}
+
+		struct sample samples[MAX_SAMPLES];
+		int count = 0;
+
+		for (int i = 0; i < iterations; i++) {
+			count += sample_cold_start(self, modes[mode], regexes, profile_path, &samples[count]);
+		}
+
+		if (count == 0) {
+			printf("%-9s failed\n", modes[mode]);
+			continue;
+		}
+
+		double first_parse[3], load[3];
+		summarize(samples, count, offsetof(struct sample, first_parse), &first_parse[0], &first_parse[1], &first_parse[2]);
+		summarize(samples, count, offsetof(struct sample, load), &load[0], &load[1], &load[2]);
+		const struct sample *memory = median_rss_sample(samples, count);
+
+		printf("%-9s %8.3f [%6.3f-%7.3f]   %8.3f [%6.3f-%7.3f]   %-10.0f %.0f\n",
+				modes[mode],
+				first_parse[0], first_parse[1], first_parse[2],
+				load[0], load[1], load[2],
+				memory->rss, memory->peak_rss);
+	}
+
+	if (profile_path) {
+		unlink(profile_path);
+	}
+
+	return 0;
+}